@@ -0,0 +1,139 @@
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <sched.h>
+#include <unistd.h>
+#include <libdw_bpf.h>
+#include "../examples/queue.h"
+
+/*
+ * Contention benchmark of the handoff from one poller to a pool of
+ * resolvers: moves items from one producer to 1, 2, 4 and 8 consumers
+ * through the Queue<T> of examples/queue.h and through unwind_queue_t,
+ * one item and a batch at a time, e.g.
+ *
+ *   queue -n 2000000 -b 32
+ *
+ * Items carry no work, what is measured is the queue alone.
+ */
+
+static unsigned long nr_items = 2000000;
+static unsigned int batch = 32;
+
+typedef std::chrono::duration<double> seconds;
+
+static seconds run_locked(unsigned int nr_consumers)
+{
+    Queue<void> queue;
+    std::vector<std::thread> consumers;
+    std::atomic<unsigned long> popped(0);
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < nr_consumers; i++)
+        consumers.emplace_back([&]() {
+            unsigned long nr = 0;
+
+            while (queue.pop())
+                nr++;
+            popped += nr;
+        });
+
+    for (unsigned long i = 1; i <= nr_items; i++)
+        queue.push(reinterpret_cast<void *>(i));
+    for (unsigned int i = 0; i < nr_consumers; i++)
+        queue.push(nullptr);
+    for (auto &t : consumers)
+        t.join();
+
+    if (popped != nr_items)
+        std::cerr << "Queue<T> lost items" << std::endl;
+    return std::chrono::steady_clock::now() - start;
+}
+
+static seconds run_lockfree(unsigned int nr_consumers, unsigned int n)
+{
+    unwind_queue_t *queue = unwind_queue__new(4096);
+    std::vector<std::thread> consumers;
+    std::atomic<unsigned long> popped(0);
+    std::vector<void *> items(n);
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < nr_consumers; i++)
+        consumers.emplace_back([&]() {
+            std::vector<void *> got(n);
+            unsigned long nr = 0, k;
+
+            while ((k = unwind_queue__pop_batch(queue, got.data(), n, -1)))
+                nr += k;
+            popped += nr;
+        });
+
+    for (unsigned long i = 1; i <= nr_items; ) {
+        unsigned int k = std::min<unsigned long>(n, nr_items - i + 1), done;
+
+        for (unsigned int j = 0; j < k; j++)
+            items[j] = reinterpret_cast<void *>(i + j);
+        for (done = 0; done < k; ) {
+            unsigned int nr = unwind_queue__push_batch(queue,
+                                                       items.data() + done,
+                                                       k - done);
+            if (!nr)
+                sched_yield();    /* full, the consumers are behind */
+            done += nr;
+        }
+        i += k;
+    }
+    unwind_queue__close(queue);
+    for (auto &t : consumers)
+        t.join();
+    unwind_queue__delete(queue);
+
+    if (popped != nr_items)
+        std::cerr << "unwind_queue_t lost items" << std::endl;
+    return std::chrono::steady_clock::now() - start;
+}
+
+static int usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [-n items] [-b batch]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_items = std::max(1L, atol(optarg));
+            break;
+        case 'b':
+            batch = std::max(1, atoi(optarg));
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    std::cout << "consumers   Queue<T>   unwind_queue   unwind_queue x"
+              << batch << "   (Mitems/s)" << std::endl;
+    for (unsigned int nr : {1, 2, 4, 8}) {
+        double locked = run_locked(nr).count();
+        double single = run_lockfree(nr, 1).count();
+        double batched = run_lockfree(nr, batch).count();
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(9) << nr
+                  << std::setw(11) << nr_items / locked / 1e6
+                  << std::setw(15) << nr_items / single / 1e6
+                  << std::setw(17) << nr_items / batched / 1e6 << std::endl;
+    }
+
+    return 0;
+}
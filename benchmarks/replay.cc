@@ -0,0 +1,189 @@
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <libdw_bpf.h>
+
+/*
+ * Replay recorded fixtures through bpf_unwind_ctx__resolve_callchain()
+ * and check the callchains against the expected ones, e.g.
+ *
+ *   replay -p 5 callchain_O2.unw callchain_O2.expected ...
+ *
+ * The first pass runs on a fresh machine, the others on the caches it
+ * warmed up. Fixtures come from cases/callchain, the DSOs they name
+ * have to be where they were recorded. Exits non-zero if any callchain
+ * came out wrong.
+ */
+
+static int maxdepth = 64;
+
+struct fixture {
+    std::string name;
+    std::vector<unwind_ctx *> records;
+    std::vector<std::vector<u64>> expected;
+};
+
+static int unwind_ctx_handler(struct unwind_ctx *uc, int size, void *cookie)
+{
+    auto records = static_cast<std::vector<unwind_ctx *> *>(cookie);
+    /* The record is the file's until we return, keep a copy. */
+    auto copy = static_cast<unwind_ctx *>(malloc(size));
+
+    memcpy(copy, uc, size);
+    records->push_back(copy);
+    return 0;
+}
+
+static bool read_expected(const char *path, fixture &f)
+{
+    std::ifstream in(path);
+    std::string line;
+
+    if (!in)
+        return false;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::vector<u64> chain;
+        u64 ip;
+
+        while (words >> std::hex >> ip)
+            chain.push_back(ip);
+        f.expected.push_back(chain);
+    }
+    return true;
+}
+
+static double percent(u64 part, u64 whole)
+{
+    return whole ? 100.0 * part / whole : 100.0;
+}
+
+static unsigned check(const fixture &f, const std::vector<u64> &ips,
+                      const std::vector<int> &depths)
+{
+    unsigned nr_wrong = 0;
+
+    for (size_t i = 0; i < f.records.size(); i++) {
+        auto &chain = f.expected[i];
+        const u64 *got = &ips[i * maxdepth];
+        size_t depth = depths[i];
+
+        if (depth < chain.size() ||
+            memcmp(got, chain.data(), chain.size() * sizeof(u64)))
+            nr_wrong++;
+    }
+    return nr_wrong;
+}
+
+static unsigned run(fixture &f, machine_t *machine, int pass)
+{
+    size_t nr = f.records.size();
+    std::vector<u64> ips(nr * maxdepth);
+    std::vector<int> depths(nr);
+    struct unwind_stats before, after;
+    struct stacktrace st;
+    u64 nr_failed = 0, nr_truncated = 0;
+
+    machine__read_stats(machine, &before);
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < nr; i++) {
+        st.ips = &ips[i * maxdepth];
+        st.depth = maxdepth;
+        if (bpf_unwind_ctx__resolve_callchain(&st, machine, f.records[i]))
+            nr_failed++;
+        nr_truncated += st.stop == UNWIND_STOP_STACK;
+        depths[i] = st.depth;
+    }
+
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start;
+    machine__read_stats(machine, &after);
+
+    u64 frames = after.frames - before.frames;
+    u64 info_misses = after.find_proc_info - before.find_proc_info;
+    u64 dso_hits = after.dso_cache_hits - before.dso_cache_hits;
+    u64 dso_reads = dso_hits + after.dso_cache_misses - before.dso_cache_misses;
+    unsigned nr_wrong = check(f, ips, depths);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << f.name << (pass ? " warm: " : " cold: ")
+              << nr / secs.count() << " events/s, "
+              << (frames ? secs.count() * 1e9 / frames : 0) << " ns/frame, "
+              << "unwind info hits " << percent(frames - info_misses, frames)
+              << "%, dso hits " << percent(dso_hits, dso_reads)
+              << "%, " << nr_failed << " failed, "
+              << nr_truncated << " out of stack, "
+              << nr_wrong << "/" << nr << " wrong" << std::endl;
+
+    return nr_wrong;
+}
+
+static int usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [-p passes] [-d maxdepth]"
+              << " fixture.unw fixture.expected ..." << std::endl;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int passes = 3, opt;
+    unsigned nr_wrong = 0;
+
+    while ((opt = getopt(argc, argv, "p:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            passes = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            maxdepth = std::max(1, atoi(optarg));
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (optind == argc || (argc - optind) % 2)
+        return usage(argv[0]);
+
+    for (int i = optind; i < argc; i += 2) {
+        fixture f;
+        const char *base = strrchr(argv[i], '/');
+
+        f.name = base ? base + 1 : argv[i];
+        unwind_file_t *file = unwind_file__open(argv[i]);
+        if (!file || !read_expected(argv[i + 1], f)) {
+            std::cerr << "can't read " << f.name << ": "
+                      << strerror(errno) << std::endl;
+            unwind_file__close(file);
+            return 1;
+        }
+
+        machine_t *machine = machine__new();
+        int ret = unwind_file__replay(file, machine, unwind_ctx_handler,
+                                      &f.records);
+        unwind_file__close(file);
+        if (ret < 0 || f.records.size() != f.expected.size()) {
+            std::cerr << f.name << ": " << f.records.size() << " records, "
+                      << f.expected.size() << " expected" << std::endl;
+            return 1;
+        }
+
+        for (int pass = 0; pass < passes; pass++)
+            nr_wrong += run(f, machine, pass);
+
+        machine__delete(machine);
+        for (auto uc : f.records)
+            free(uc);
+    }
+
+    return nr_wrong != 0;
+}
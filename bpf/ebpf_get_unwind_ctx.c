@@ -1,96 +1,245 @@
 #include <linux/sched.h>
 #include <uapi/linux/ptrace.h>
 
-#ifndef __inline
-# define __inline                               \
-        inline __attribute__((always_inline))
+#include "unwind_ctx.h"
+
+/*
+ * Scratch space to build the record in, too big for the BPF stack. A
+ * program can't be preempted or re-entered on its CPU while it runs,
+ * so one slot per CPU is enough and, unlike a hash element, never has
+ * to be allocated.
+ */
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_PATCHED
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
+#else
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx_slot, 1);
 #endif
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
+BPF_PERF_OUTPUT(unwind_ctxs);
 
-struct unwind_ctx {
-        u64 ts;
-        u32 tid;
-        u32 tgid;
+/* Which tasks to capture, see struct unwind_target. */
+BPF_HASH(unwind_targets, u64, struct unwind_target, 1024);
 
-        struct pt_regs uregs;
-        char name[TASK_COMM_LEN];
+/*
+ * Bytes of stack to copy per tgid, published by the resolver with
+ * machine__publish_stack_sizes() from how deep its unwinds of that
+ * process actually had to read. Processes without an entry get all
+ * of STACK_SIZE.
+ */
+BPF_HASH(stack_sizes, u32, u32, 4096);
 
-        int size;
-        char data[STACK_SIZE];
-};
+/* Duplicate suppression, see UNWIND_CTX_DEDUP in unwind_ctx.h. */
+#ifdef UNWIND_CTX_DEDUP
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
+BPF_TABLE("lru_hash", u64, struct unwind_dedup_entry, unwind_dedup, 10240);
+BPF_PERF_OUTPUT(unwind_counts);
 
-BPF_PERF_OUTPUT(unwind_ctxs);
+/* Returns true if the event was counted and needs no record. */
+static __inline
+bool unwind_ctx__dedup(void *ctx, u64 id, struct pt_regs *user_regs,
+                       void *sp)
+{
+        struct unwind_dedup_entry *entry, init = {};
+        struct unwind_count count;
+        u64 now = bpf_ktime_get_ns();
+        bool counted;
+
+        /* Without a key the event just goes out in full. */
+        if (unwind_dedup__init(&count, id, user_regs, sp))
+                return false;
+
+        entry = unwind_dedup.lookup(&count.hash);
+        if (!entry) {
+                init.window = now;
+                unwind_dedup.update(&count.hash, &init);
+                return false;
+        }
+
+        counted = unwind_dedup__count(entry, &count, now);
+        if (count.count)
+                unwind_counts.perf_submit(ctx, &count, sizeof(count));
+
+        return counted;
+}
+
+#endif
+
+static __inline
+bool unwind_ctx__sample(u64 id)
+{
+        struct unwind_target *target = NULL;
+        u64 key;
+        int i;
+
+#pragma unroll
+        for (i = 0; i < UNWIND_TARGET__NR_KEYS && !target; i++) {
+                key = unwind_target__key(id, i);
+                target = unwind_targets.lookup(&key);
+        }
+
+        return unwind_target__keep(target);
+}
 
 static __inline
 int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
 {
         struct pt_regs *user_regs = NULL;
-        struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
         struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
         void *sp = NULL;
-        int ret = 0;
+        u32 tgid;
+        int size;
+        u64 id;
         int z = 0;
 
-        task = (struct task_struct *)bpf_get_current_task();
-        if (!tracepoint && ctx && user_mode(ctx)) {
-                user_regs = ctx;
-        } else {
-                if (task->mm)
-                        user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
-        }
+        id = bpf_get_current_pid_tgid();
+        if (!unwind_ctx__sample(id))
+                return 0;
 
+        user_regs = unwind_ctx__user_regs(ctx, tracepoint);
         if (!user_regs)
                 return -1;
+        if (unwind_ctx__user_sp(ctx, tracepoint, user_regs, &sp))
+                return -1;
 
-        ret = bpf_probe_read(&sp, sizeof(sp), &user_regs->sp);
-        if (ret < 0)
+#ifdef UNWIND_CTX_DEDUP
+        if (unwind_ctx__dedup(tracepoint ? attr : ctx, id, user_regs, sp))
+                return 0;
+#endif
+
+        uc = (struct unwind_ctx *)scratch.lookup(&z);
+        if (!uc)
                 return -1;
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
+        tgid = id >> 32;
+        size = unwind_ctx__fill(uc, id, user_regs, sp,
+                                stack_sizes.lookup(&tgid));
+        if (size < 0)
                 return -1;
 
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
+        if (tracepoint)
+                unwind_ctxs.perf_submit(attr, uc, size);
+        else
+                unwind_ctxs.perf_submit(ctx, uc, size);
+
+        return 0;
+}
 
-        uc = cache.lookup_or_init(&k, zuc);
-        if (!uc)
-                return -1;
+/*
+ * Slow call capture, build with -DUNWIND_CTX_LATENCY. Call
+ * get_unwind_ctx_entry() from the entry probe of a syscall or function
+ * and get_unwind_ctx_exit() from its exit probe. Entry only saves the
+ * user registers and a timestamp per tid. The stack is read at exit,
+ * and only if the call took at least the threshold in
+ * unwind_latency_threshold, set with unwind_latency__set_threshold().
+ * Reading it late is fine: everything above the entry sp belongs to
+ * the callers, which can't have run while the thread was in the call.
+ * Except for the word at the entry sp, the return address of a probed
+ * function: a uretprobe replaces it with its trampoline, so entry
+ * saves it and exit puts it back into the copy. A callee may also
+ * have reused its incoming stack arguments, but unwinding only reads
+ * the callers' saved registers and return addresses above them.
+ */
+#ifdef UNWIND_CTX_LATENCY
+
+struct unwind_entry {
+        u64 ts;
+        struct pt_regs uregs;
+        u64 ret;        /* the word at uregs.sp, see above */
+};
+
+struct unwind_slow_call {
+        u64 latency;
+        struct unwind_ctx uc;
+#if UNWIND_READ_STACK != UNWIND_READ_STACK_PATCHED
+        char slack[UNWIND_READ_PAGE];
+#endif
+};
+
+/* LRU, so that calls whose exit is never seen age out. */
+BPF_TABLE("lru_hash", u32, struct unwind_entry, unwind_entries, 10240);
+BPF_ARRAY(unwind_latency_threshold, u64, 1);
+BPF_PERCPU_ARRAY(slow_scratch, struct unwind_slow_call, 1);
+BPF_PERF_OUTPUT(unwind_slow_calls);
+
+static __inline
+int get_unwind_ctx_entry(struct pt_regs *ctx, bool tracepoint)
+{
+        struct unwind_entry entry = {};
+        struct pt_regs *user_regs;
+        u64 id;
+        u32 tid;
+
+        id = bpf_get_current_pid_tgid();
+        if (!unwind_ctx__sample(id))
+                return 0;
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
-        ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
-        if (ret < 0)
+        user_regs = unwind_ctx__user_regs(ctx, tracepoint);
+        if (!user_regs)
                 return -1;
-        bpf_get_current_comm(&uc->name, sizeof(uc->name));
-        if (!tracepoint && ctx && !user_mode(ctx)) {
-                sp -= 16;
-                uc->uregs.sp = (unsigned long)sp;
-        }
-        ret = bpf_probe_read_stack(&uc->data, sizeof(uc->data), sp);
-        if (ret < 0)
+        if (bpf_probe_read(&entry.uregs, sizeof(entry.uregs), user_regs) < 0)
                 return -1;
-        if (ret == 0)
-                uc->size = STACK_SIZE;
-        else
-                uc->size = STACK_SIZE - ret;
+        if (!tracepoint && ctx && !user_mode(ctx))
+                entry.uregs.sp -= 16;
+        bpf_probe_read(&entry.ret, sizeof(entry.ret), (void *)entry.uregs.sp);
+
+        tid = id;
+        entry.ts = bpf_ktime_get_ns();
+        unwind_entries.update(&tid, &entry);
+
+        return 0;
+}
+
+static __inline
+int get_unwind_ctx_exit(struct pt_regs *ctx, bool tracepoint, void *attr)
+{
+        struct unwind_slow_call *sc;
+        struct unwind_entry *entry;
+        u64 id, latency, *threshold;
+        u32 tid, tgid, size, max;
+        int z = 0;
+
+        id = bpf_get_current_pid_tgid();
+        tid = id;
+        entry = unwind_entries.lookup(&tid);
+        if (!entry)
+                return 0;
+
+        latency = bpf_ktime_get_ns() - entry->ts;
+        threshold = unwind_latency_threshold.lookup(&z);
+        if (threshold && latency < *threshold)
+                goto out;
+
+        sc = slow_scratch.lookup(&z);
+        if (!sc)
+                goto out;
+
+        sc->latency = latency;
+        sc->uc.ts = entry->ts;
+        sc->uc.tgid = id >> 32;
+        sc->uc.tid = id;
+        __builtin_memcpy(&sc->uc.uregs, &entry->uregs, sizeof(sc->uc.uregs));
+        bpf_get_current_comm(&sc->uc.name, sizeof(sc->uc.name));
+        tgid = id >> 32;
+        if (unwind_ctx__read_stack(&sc->uc, stack_sizes.lookup(&tgid),
+                                   (void *)entry->uregs.sp))
+                goto out;
+        if (entry->ret && sc->uc.size >= sizeof(entry->ret))
+                __builtin_memcpy(sc->uc.data, &entry->ret, sizeof(entry->ret));
+
+        size = __builtin_offsetof(struct unwind_slow_call, uc.data) +
+               sc->uc.size;
+        max = __builtin_offsetof(struct unwind_slow_call, uc) + sizeof(sc->uc);
+        if (size > max)
+                size = max;
 
         if (tracepoint)
-                unwind_ctxs.perf_submit(attr, uc, sizeof(*uc));
+                unwind_slow_calls.perf_submit(attr, sc, size);
         else
-                unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
-
-        cache.delete(&k);
+                unwind_slow_calls.perf_submit(ctx, sc, size);
 
+out:
+        unwind_entries.delete(&tid);
         return 0;
 }
+
+#endif
@@ -0,0 +1,137 @@
+#include <linux/sched.h>
+#include <uapi/linux/ptrace.h>
+
+#include "unwind_ctx.h"
+
+/*
+ * Same record as ebpf_get_unwind_ctx.c, but shipped on a BPF ring
+ * buffer shared by all CPUs instead of a perf buffer per CPU, so that
+ * records come out in order and a busy CPU can use the room an idle
+ * one leaves. Needs 5.8+.
+ *
+ * Read it in userspace with ringbuf__new() on the map's fd, records
+ * are handed to the callback in place.
+ */
+
+/* Size in pages, must be a power of 2. */
+#ifndef UNWIND_CTXS_PAGES
+# define UNWIND_CTXS_PAGES    256
+#endif
+
+BPF_RINGBUF_OUTPUT(unwind_ctxs, UNWIND_CTXS_PAGES);
+
+/*
+ * The record is built in a per-CPU slot, as in ebpf_get_unwind_ctx.c,
+ * and only the part of the stack that was read is copied into the
+ * ring. Reserving a whole record in place would take STACK_SIZE of
+ * the ring for every event, however shallow its stack.
+ */
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_PATCHED
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
+#else
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx_slot, 1);
+#endif
+
+/* Which tasks to capture, see struct unwind_target. */
+BPF_HASH(unwind_targets, u64, struct unwind_target, 1024);
+
+/*
+ * Bytes of stack to copy per tgid, published by the resolver with
+ * machine__publish_stack_sizes() from how deep its unwinds of that
+ * process actually had to read. Processes without an entry get all
+ * of STACK_SIZE.
+ */
+BPF_HASH(stack_sizes, u32, u32, 4096);
+
+/* Duplicate suppression, see UNWIND_CTX_DEDUP in unwind_ctx.h. */
+#ifdef UNWIND_CTX_DEDUP
+
+BPF_TABLE("lru_hash", u64, struct unwind_dedup_entry, unwind_dedup, 10240);
+BPF_RINGBUF_OUTPUT(unwind_counts, 16);
+
+/* Returns true if the event was counted and needs no record. */
+static __inline
+bool unwind_ctx__dedup(u64 id, struct pt_regs *user_regs, void *sp)
+{
+        struct unwind_dedup_entry *entry, init = {};
+        struct unwind_count count;
+        u64 now = bpf_ktime_get_ns();
+        bool counted;
+
+        /* Without a key the event just goes out in full. */
+        if (unwind_dedup__init(&count, id, user_regs, sp))
+                return false;
+
+        entry = unwind_dedup.lookup(&count.hash);
+        if (!entry) {
+                init.window = now;
+                unwind_dedup.update(&count.hash, &init);
+                return false;
+        }
+
+        counted = unwind_dedup__count(entry, &count, now);
+        if (count.count)
+                unwind_counts.ringbuf_output(&count, sizeof(count), 0);
+
+        return counted;
+}
+
+#endif
+
+static __inline
+bool unwind_ctx__sample(u64 id)
+{
+        struct unwind_target *target = NULL;
+        u64 key;
+        int i;
+
+#pragma unroll
+        for (i = 0; i < UNWIND_TARGET__NR_KEYS && !target; i++) {
+                key = unwind_target__key(id, i);
+                target = unwind_targets.lookup(&key);
+        }
+
+        return unwind_target__keep(target);
+}
+
+static __inline
+int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint)
+{
+        struct pt_regs *user_regs = NULL;
+        struct unwind_ctx *uc = NULL;
+        void *sp = NULL;
+        u32 tgid;
+        int size;
+        u64 id;
+        int z = 0;
+
+        id = bpf_get_current_pid_tgid();
+        if (!unwind_ctx__sample(id))
+                return 0;
+
+        user_regs = unwind_ctx__user_regs(ctx, tracepoint);
+        if (!user_regs)
+                return -1;
+        if (unwind_ctx__user_sp(ctx, tracepoint, user_regs, &sp))
+                return -1;
+
+#ifdef UNWIND_CTX_DEDUP
+        if (unwind_ctx__dedup(id, user_regs, sp))
+                return 0;
+#endif
+
+        uc = (struct unwind_ctx *)scratch.lookup(&z);
+        if (!uc)
+                return -1;
+
+        tgid = id >> 32;
+        size = unwind_ctx__fill(uc, id, user_regs, sp,
+                                stack_sizes.lookup(&tgid));
+        if (size < 0)
+                return -1;
+
+        /* Fails, and the event is lost, only if the consumer lags behind. */
+        unwind_ctxs.ringbuf_output(uc, size, 0);
+
+        return 0;
+}
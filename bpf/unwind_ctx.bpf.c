@@ -0,0 +1,271 @@
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+/*
+ * Precompiled CO-RE twin of ebpf_get_unwind_ctx_ringbuf.c, built into
+ * a libbpf skeleton with -DENABLE_CORE_CAPTURE=ON and driven from
+ * userspace through capture__new() and friends. Nothing is compiled
+ * at run time, field offsets are relocated against the running
+ * kernel's BTF when the object is loaded. Needs 5.8+ with BTF.
+ *
+ * The stack is copied page by page with the stock
+ * bpf_probe_read_user(), so a fault only loses the pages past it.
+ * Where the kernel has sleepable uprobes, unwind_ctx_uprobe_sleepable
+ * uses bpf_copy_from_user() instead, which faults pages in rather than
+ * giving up on ones that are swapped out. capture__new() probes for it.
+ */
+
+#ifndef STACK_SIZE
+# define STACK_SIZE             4096 * 2
+#endif
+#define TASK_COMM_LEN           16
+
+/* x86_64 without KASAN, only used where bpf_task_pt_regs() is missing. */
+#define THREAD_SIZE             (4096 << 2)
+
+struct unwind_ctx {
+        u64 ts;
+        u32 tid;
+        u32 tgid;
+
+        struct pt_regs uregs;
+        char name[TASK_COMM_LEN];
+
+        int size;
+        char data[STACK_SIZE];
+};
+
+#define UNWIND_READ_PAGE        4096
+#define UNWIND_READ_CHUNKS      (STACK_SIZE / UNWIND_READ_PAGE + 1)
+
+/*
+ * Records are built here and copied into the ring with just the part
+ * of the stack that was read. The slack lets the verifier see that a
+ * page read at a variable offset into data stays in the slot. Sleepable
+ * programs can be preempted, so they have slots of their own that are
+ * marked busy while in use.
+ */
+struct unwind_ctx_slot {
+        u64 busy;
+        struct unwind_ctx uc;
+        char slack[UNWIND_READ_PAGE];
+};
+
+struct {
+        __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+        __uint(max_entries, 1);
+        __type(key, u32);
+        __type(value, struct unwind_ctx_slot);
+} scratch SEC(".maps");
+
+struct {
+        __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+        __uint(max_entries, 1);
+        __type(key, u32);
+        __type(value, struct unwind_ctx_slot);
+} sleepable_scratch SEC(".maps");
+
+/* Resized with capture_opts.ringbuf_pages before loading. */
+struct {
+        __uint(type, BPF_MAP_TYPE_RINGBUF);
+        __uint(max_entries, 256 * 4096);
+} unwind_ctxs SEC(".maps");
+
+/* Same keys as in ebpf_get_unwind_ctx.c, see unwind_filter__set(). */
+#define UNWIND_TARGET_TGID              0
+#define UNWIND_TARGET_TID               1
+#define UNWIND_TARGET_DEFAULT           2
+#define UNWIND_TARGET_KEY(type, id)     ((u64)(type) << 32 | (u32)(id))
+
+struct unwind_target {
+        u32 rate;
+        u32 flags;
+};
+
+struct {
+        __uint(type, BPF_MAP_TYPE_HASH);
+        __uint(max_entries, 1024);
+        __type(key, u64);
+        __type(value, struct unwind_target);
+} unwind_targets SEC(".maps");
+
+struct {
+        __uint(type, BPF_MAP_TYPE_HASH);
+        __uint(max_entries, 4096);
+        __type(key, u32);
+        __type(value, u32);
+} stack_sizes SEC(".maps");
+
+static __always_inline
+bool unwind_ctx__sample(u64 id)
+{
+        struct unwind_target *target;
+        u64 key;
+
+        key = UNWIND_TARGET_KEY(UNWIND_TARGET_TID, id);
+        target = bpf_map_lookup_elem(&unwind_targets, &key);
+        if (!target) {
+                key = UNWIND_TARGET_KEY(UNWIND_TARGET_TGID, id >> 32);
+                target = bpf_map_lookup_elem(&unwind_targets, &key);
+        }
+        if (!target) {
+                key = UNWIND_TARGET_KEY(UNWIND_TARGET_DEFAULT, 0);
+                target = bpf_map_lookup_elem(&unwind_targets, &key);
+        }
+
+        if (!target)
+                return true;
+        if (target->rate <= 1)
+                return target->rate == 1;
+        return bpf_get_prandom_u32() % target->rate == 0;
+}
+
+static __always_inline
+bool user_mode(struct pt_regs *regs)
+{
+        return (regs->cs & 3) == 3;
+}
+
+/* Registers the task entered the kernel with, NULL for kernel threads. */
+static __always_inline
+struct pt_regs *unwind_ctx__task_regs(void)
+{
+        struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+        void *stack;
+
+        if (!BPF_CORE_READ(task, mm))
+                return NULL;
+
+        if (bpf_core_enum_value_exists(enum bpf_func_id, BPF_FUNC_task_pt_regs))
+                return (struct pt_regs *)bpf_task_pt_regs(bpf_get_current_task_btf());
+
+        stack = BPF_CORE_READ(task, stack);
+        return (struct pt_regs *)(stack + THREAD_SIZE) - 1;
+}
+
+/*
+ * Copy @len bytes at @sp one page at a time, up to the first page that
+ * can't be read, and return how many bytes were.
+ */
+static __always_inline
+u32 unwind_ctx__read_user(char *dst, u32 len, void *sp, bool sleepable)
+{
+        u32 off = 0, chunk;
+        long err;
+        int i;
+
+        for (i = 0; i < UNWIND_READ_CHUNKS; i++) {
+                if (off >= len || off >= STACK_SIZE)
+                        break;
+                chunk = UNWIND_READ_PAGE -
+                        (((unsigned long)sp + off) & (UNWIND_READ_PAGE - 1));
+                if (chunk > len - off)
+                        chunk = len - off;
+                if (chunk > UNWIND_READ_PAGE)
+                        break;
+                if (sleepable)
+                        err = bpf_copy_from_user(dst + off, chunk, sp + off);
+                else
+                        err = bpf_probe_read_user(dst + off, chunk, sp + off);
+                if (err)
+                        break;
+                off += chunk;
+        }
+
+        return off;
+}
+
+static __always_inline
+int get_unwind_ctx(struct pt_regs *ctx, bool kprobe, bool sleepable)
+{
+        struct unwind_ctx_slot *slot;
+        struct pt_regs *user_regs;
+        struct unwind_ctx *uc;
+        u64 id = bpf_get_current_pid_tgid();
+        u32 tgid = id >> 32, len, *want;
+        int z = 0;
+
+        if (!unwind_ctx__sample(id))
+                return 0;
+
+        if (ctx && user_mode(ctx))
+                user_regs = ctx;
+        else
+                user_regs = unwind_ctx__task_regs();
+        if (!user_regs)
+                return 0;
+
+        if (sleepable) {
+                slot = bpf_map_lookup_elem(&sleepable_scratch, &z);
+                if (!slot || __sync_lock_test_and_set(&slot->busy, 1))
+                        return 0;
+        } else {
+                slot = bpf_map_lookup_elem(&scratch, &z);
+                if (!slot)
+                        return 0;
+        }
+        uc = &slot->uc;
+
+        if (bpf_probe_read_kernel(&uc->uregs, sizeof(uc->uregs), user_regs))
+                goto out;
+        if (kprobe && user_regs != ctx)
+                uc->uregs.sp -= 16;
+
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = tgid;
+        uc->tid = id;
+        bpf_get_current_comm(&uc->name, sizeof(uc->name));
+
+        want = bpf_map_lookup_elem(&stack_sizes, &tgid);
+        len = sizeof(uc->data);
+        if (want && *want && *want < len)
+                len = *want;
+        uc->size = unwind_ctx__read_user(uc->data, len,
+                                         (void *)uc->uregs.sp, sleepable);
+
+        len = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (len > sizeof(*uc))
+                len = sizeof(*uc);
+        bpf_ringbuf_output(&unwind_ctxs, uc, len, 0);
+
+out:
+        if (sleepable)
+                slot->busy = 0;
+        return 0;
+}
+
+/* Attached by capture__attach_*(), the sections carry no target. */
+SEC("kprobe")
+int unwind_ctx_kprobe(struct pt_regs *ctx)
+{
+        return get_unwind_ctx(ctx, true, false);
+}
+
+SEC("uprobe")
+int unwind_ctx_uprobe(struct pt_regs *ctx)
+{
+        return get_unwind_ctx(ctx, false, false);
+}
+
+/* Only loaded where sleepable uprobes are supported, 6.0+. */
+SEC("uprobe.s")
+int unwind_ctx_uprobe_sleepable(struct pt_regs *ctx)
+{
+        return get_unwind_ctx(ctx, false, true);
+}
+
+SEC("tracepoint")
+int unwind_ctx_tracepoint(void *ctx)
+{
+        return get_unwind_ctx(NULL, false, false);
+}
+
+SEC("perf_event")
+int unwind_ctx_perf_event(struct bpf_perf_event_data *ctx)
+{
+        return get_unwind_ctx(&ctx->regs, false, false);
+}
+
+char LICENSE[] SEC("license") = "GPL";
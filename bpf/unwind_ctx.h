@@ -0,0 +1,342 @@
+#ifndef __UNWIND_CTX_H
+#define __UNWIND_CTX_H
+
+/*
+ * What ebpf_get_unwind_ctx.c and ebpf_get_unwind_ctx_ringbuf.c share,
+ * reach it by adding -I with this directory to the program's cflags.
+ * bcc only rewrites map calls and kernel memory accesses in the main
+ * file, so the maps and the code that touches them stay in the
+ * programs, everything here works on plain memory and helpers.
+ */
+
+#ifndef __inline
+# define __inline                               \
+        inline __attribute__((always_inline))
+#endif
+
+struct unwind_ctx {
+        u64 ts;
+        u32 tid;
+        u32 tgid;
+
+        struct pt_regs uregs;
+        char name[TASK_COMM_LEN];
+
+        int size;
+        char data[STACK_SIZE];
+};
+
+/*
+ * How the user stack is copied, pick it with unwind_read_stack__probe()
+ * and pass unwind_read_stack__cflag() to the compiler:
+ *
+ * UNWIND_READ_STACK_PATCHED - bpf_probe_read_stack() from
+ *     patches/bpf.patch, one call that stops at the first fault.
+ * UNWIND_READ_STACK_USER - stock bpf_probe_read_user() (5.5+), page by
+ *     page so that a fault only loses the pages past it.
+ */
+#define UNWIND_READ_STACK_PATCHED       0
+#define UNWIND_READ_STACK_USER          1
+
+#ifndef UNWIND_READ_STACK
+# define UNWIND_READ_STACK              UNWIND_READ_STACK_PATCHED
+#endif
+
+#define UNWIND_READ_PAGE                4096
+#define UNWIND_READ_CHUNKS              (STACK_SIZE / UNWIND_READ_PAGE + 1)
+
+/*
+ * The verifier can't tell that a page read at a variable offset into
+ * data ends within it, the slack lets it see the read stays in the slot.
+ */
+struct unwind_ctx_slot {
+        struct unwind_ctx uc;
+        char slack[UNWIND_READ_PAGE];
+};
+
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_USER
+/*
+ * Copy @len bytes at @sp one page at a time, up to the first page that
+ * faults. Returns how many bytes were left, like bpf_probe_read_stack().
+ * @dst must be followed by UNWIND_READ_PAGE bytes of slack.
+ */
+static __inline
+int unwind_ctx__read_user(char *dst, u32 len, void *sp)
+{
+        u32 off = 0, chunk;
+        int i;
+
+#pragma unroll
+        for (i = 0; i < UNWIND_READ_CHUNKS; i++) {
+                if (off >= len || off >= STACK_SIZE)
+                        break;
+                chunk = UNWIND_READ_PAGE -
+                        (((unsigned long)sp + off) & (UNWIND_READ_PAGE - 1));
+                if (chunk > len - off)
+                        chunk = len - off;
+                if (chunk > UNWIND_READ_PAGE)
+                        break;
+                if (bpf_probe_read_user(dst + off, chunk, sp + off))
+                        break;
+                off += chunk;
+        }
+
+        return len - off;
+}
+#endif
+
+/*
+ * Registers the task entered the kernel with, NULL for kernel threads.
+ * The task is read with bpf_probe_read() by hand, bcc doesn't rewrite
+ * its fields here.
+ */
+static __inline
+struct pt_regs *unwind_ctx__user_regs(struct pt_regs *ctx, bool tracepoint)
+{
+        struct task_struct *task;
+        void *mm = NULL;
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_PATCHED
+        unsigned long sp0 = 0;
+#else
+        void *stack = NULL;
+#endif
+
+        if (!tracepoint && ctx && user_mode(ctx))
+                return ctx;
+
+        task = (struct task_struct *)bpf_get_current_task();
+        bpf_probe_read(&mm, sizeof(mm), &task->mm);
+        if (!mm)
+                return NULL;
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_PATCHED
+        bpf_probe_read(&sp0, sizeof(sp0), &task->thread.sp0);
+        return (struct pt_regs *)sp0 - 1;
+#else
+        /* Newer x86_64 kernels dropped thread.sp0, go by the stack. */
+        bpf_probe_read(&stack, sizeof(stack), &task->stack);
+        return (struct pt_regs *)(stack + THREAD_SIZE) - 1;
+#endif
+}
+
+/*
+ * Where to read the user stack from. An event in the kernel stopped
+ * the task at its syscall entry, with the return address of the libc
+ * wrapper's call still below the saved sp.
+ */
+static __inline
+int unwind_ctx__user_sp(struct pt_regs *ctx, bool tracepoint,
+                        struct pt_regs *user_regs, void **sp)
+{
+        if (bpf_probe_read(sp, sizeof(*sp), &user_regs->sp) < 0)
+                return -1;
+        if (!tracepoint && ctx && !user_mode(ctx))
+                *sp -= 16;
+
+        return 0;
+}
+
+/*
+ * Copy the stack at @sp into @uc, as much of it as the stack_sizes
+ * entry @want of the task's tgid asks for, all of it without one.
+ */
+static __inline
+int unwind_ctx__read_stack(struct unwind_ctx *uc, u32 *want, void *sp)
+{
+        u32 len = sizeof(uc->data);
+        int ret;
+
+        if (want && *want && *want < len)
+                len = *want;
+#if UNWIND_READ_STACK == UNWIND_READ_STACK_PATCHED
+        ret = bpf_probe_read_stack(&uc->data, len, sp);
+#else
+        ret = unwind_ctx__read_user(uc->data, len, sp);
+#endif
+        if (ret < 0)
+                return -1;
+        uc->size = len - ret;
+
+        return 0;
+}
+
+/*
+ * Fill the record of the current task @id in @uc, stack read from @sp
+ * on. Returns how much of @uc to ship: only the part of the stack that
+ * was read, whatever is left in a scratch slot from an earlier event
+ * stays behind. Negative on failure.
+ */
+static __inline
+int unwind_ctx__fill(struct unwind_ctx *uc, u64 id, struct pt_regs *user_regs,
+                     void *sp, u32 *want)
+{
+        u32 size;
+
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
+        if (bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs) < 0)
+                return -1;
+        uc->uregs.sp = (unsigned long)sp;
+        bpf_get_current_comm(&uc->name, sizeof(uc->name));
+        if (unwind_ctx__read_stack(uc, want, sp))
+                return -1;
+
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
+
+        return size;
+}
+
+/*
+ * Which tasks to capture, keyed by UNWIND_TARGET_KEY(). A tid entry
+ * wins over its tgid's, the UNWIND_TARGET_DEFAULT entry covers every
+ * other task, and with no entry at all everything is captured. A rate
+ * of N keeps one event in N, 0 drops them all. It is checked before
+ * anything is copied, fill it from userspace with unwind_filter__set().
+ */
+#define UNWIND_TARGET_TGID              0
+#define UNWIND_TARGET_TID               1
+#define UNWIND_TARGET_DEFAULT           2
+#define UNWIND_TARGET_KEY(type, id)     ((u64)(type) << 32 | (u32)(id))
+
+struct unwind_target {
+        u32 rate;
+        u32 flags;
+};
+
+#define UNWIND_TARGET__NR_KEYS          3
+
+/*
+ * The @i-th key to look the task @id up with, the first one that has
+ * an entry decides.
+ */
+static __inline
+u64 unwind_target__key(u64 id, int i)
+{
+        switch (i) {
+        case 0:
+                return UNWIND_TARGET_KEY(UNWIND_TARGET_TID, id);
+        case 1:
+                return UNWIND_TARGET_KEY(UNWIND_TARGET_TGID, id >> 32);
+        default:
+                return UNWIND_TARGET_KEY(UNWIND_TARGET_DEFAULT, 0);
+        }
+}
+
+/* Whether to keep an event of a task @target, NULL if it has none. */
+static __inline
+bool unwind_target__keep(struct unwind_target *target)
+{
+        if (!target)
+                return true;
+        if (target->rate <= 1)
+                return target->rate == 1;
+        return bpf_get_prandom_u32() % target->rate == 0;
+}
+
+/*
+ * Optional duplicate suppression, build with -DUNWIND_CTX_DEDUP. Events
+ * are keyed by a hash of tgid, ip and the top UNWIND_DEDUP_WORDS words
+ * of the stack. Only the first event of a key in every window is
+ * shipped as a full record, later ones are just counted and go out as
+ * struct unwind_count records on unwind_counts, either when the window
+ * ends or once UNWIND_DEDUP_FLUSH of them piled up. Every full record
+ * stands for one event itself. unwind_ctx__hash() in the library
+ * computes the same key from a record, see callchain_counts__add().
+ */
+#ifdef UNWIND_CTX_DEDUP
+
+#ifndef UNWIND_DEDUP_WINDOW_NS
+# define UNWIND_DEDUP_WINDOW_NS         1000000000ULL
+#endif
+#ifndef UNWIND_DEDUP_FLUSH
+# define UNWIND_DEDUP_FLUSH             1024
+#endif
+#define UNWIND_DEDUP_WORDS              8
+#define UNWIND_DEDUP_FNV_OFFSET         0xcbf29ce484222325ULL
+#define UNWIND_DEDUP_FNV_PRIME          0x100000001b3ULL
+
+struct unwind_count {
+        u64 hash;
+        u32 tid;
+        u32 tgid;
+        u64 count;
+};
+
+struct unwind_dedup_entry {
+        u64 window;     /* when the last full record went out */
+        u64 count;      /* events counted but not shipped yet */
+};
+
+static __inline
+u64 unwind_ctx__hash(u32 tgid, u64 ip, void *sp)
+{
+        u64 words[UNWIND_DEDUP_WORDS] = {};
+        u64 hash = UNWIND_DEDUP_FNV_OFFSET;
+        int i;
+
+        /* Zeroes words if it fails, the library does the same. */
+        bpf_probe_read(&words, sizeof(words), sp);
+
+        hash = (hash ^ tgid) * UNWIND_DEDUP_FNV_PRIME;
+        hash = (hash ^ ip) * UNWIND_DEDUP_FNV_PRIME;
+#pragma unroll
+        for (i = 0; i < UNWIND_DEDUP_WORDS; i++)
+                hash = (hash ^ words[i]) * UNWIND_DEDUP_FNV_PRIME;
+
+        return hash;
+}
+
+/*
+ * Start the count of the current task @id, which stopped at @user_regs
+ * with the stack to read at @sp. Its key ends up in count->hash.
+ */
+static __inline
+int unwind_dedup__init(struct unwind_count *count, u64 id,
+                       struct pt_regs *user_regs, void *sp)
+{
+        u64 ip;
+
+        if (bpf_probe_read(&ip, sizeof(ip), &user_regs->ip) < 0)
+                return -1;
+        count->tgid = id >> 32;
+        count->tid = id;
+        count->hash = unwind_ctx__hash(count->tgid, ip, sp);
+        count->count = 0;
+
+        return 0;
+}
+
+/*
+ * Count the event of @count in the @entry of its key, made at @now.
+ * Returns true if the event was counted and needs no record, leaves
+ * what is due in count->count, to go out on unwind_counts if nonzero.
+ */
+static __inline
+bool unwind_dedup__count(struct unwind_dedup_entry *entry,
+                         struct unwind_count *count, u64 now)
+{
+        if (now - entry->window >= UNWIND_DEDUP_WINDOW_NS) {
+                /* New window, flush the old one and ship this event. */
+                entry->window = now;
+                count->count = entry->count;
+                if (count->count)
+                        __sync_fetch_and_add(&entry->count, -count->count);
+                return false;
+        }
+
+        count->count = __sync_fetch_and_add(&entry->count, 1) + 1;
+        if (count->count < UNWIND_DEDUP_FLUSH) {
+                count->count = 0;
+                return true;
+        }
+        /* Whatever raced in after our add stays for next time. */
+        __sync_fetch_and_add(&entry->count, -count->count);
+
+        return true;
+}
+
+#endif
+
+#endif
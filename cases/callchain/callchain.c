@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <alloca.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <libdw_bpf.h>
+
+/*
+ * Records its own stack at the bottom of known call chains, the replay
+ * fixtures of benchmarks/. Built at several optimisation levels without
+ * frame pointers, so every level has different CFI to get through.
+ *
+ *   callchain out.unw out.expected [records]
+ *
+ * Every record is written to out.unw together with the maps of this
+ * process, and the callchain the unwinder should find for it, taken
+ * from __builtin_return_address() on the way down, to out.expected as
+ * one line of hex ips, innermost first.
+ */
+
+#define MAX_DEPTH	16
+
+static struct unwind_ctx uc;
+static u64 chain[MAX_DEPTH + 4];
+static int nr_chain;
+static char *stack_end;
+static unwind_file_t *file;
+static FILE *expected;
+
+/* Callers are reported with the ip inside the call, like the unwinder does. */
+#define record_caller() \
+	(chain[nr_chain++] = (u64)__builtin_return_address(0) - 1)
+
+/* Keeps the call from being turned into a jump. */
+#define no_tail_call(ret)	asm volatile("" : "+r" (ret) :: "memory")
+
+static int __attribute__ ((noinline)) capture(void)
+{
+	struct pt_regs *regs = &uc.uregs;
+	u64 sp;
+	int i;
+
+	record_caller();
+
+	asm volatile("movq %%rsp, %c[sp](%[regs])\n\t"
+		     "movq %%rbp, %c[bp](%[regs])\n\t"
+		     "movq %%rbx, %c[bx](%[regs])\n\t"
+		     "movq %%r12, %c[r12](%[regs])\n\t"
+		     "movq %%r13, %c[r13](%[regs])\n\t"
+		     "movq %%r14, %c[r14](%[regs])\n\t"
+		     "movq %%r15, %c[r15](%[regs])\n\t"
+		     "leaq 0(%%rip), %%rax\n\t"
+		     "movq %%rax, %c[ip](%[regs])\n\t"
+		     :
+		     : [regs] "r" (regs),
+		       [sp] "i" (offsetof(struct pt_regs, sp)),
+		       [bp] "i" (offsetof(struct pt_regs, bp)),
+		       [bx] "i" (offsetof(struct pt_regs, bx)),
+		       [r12] "i" (offsetof(struct pt_regs, r12)),
+		       [r13] "i" (offsetof(struct pt_regs, r13)),
+		       [r14] "i" (offsetof(struct pt_regs, r14)),
+		       [r15] "i" (offsetof(struct pt_regs, r15)),
+		       [ip] "i" (offsetof(struct pt_regs, ip))
+		     : "rax", "memory");
+
+	sp = regs->sp;
+	uc.size = sizeof(uc.data);
+	if ((u64)(stack_end - (char *)sp) < (u64)uc.size)
+		uc.size = stack_end - (char *)sp;
+	memcpy(uc.data, (void *)sp, uc.size);
+
+	if (unwind_file__write(file, &uc, unwind_ctx__size(&uc)))
+		return -1;
+
+	fprintf(expected, "%lx", regs->ip);
+	for (i = nr_chain - 1; i >= 0; i--)
+		fprintf(expected, " %llx", (unsigned long long)chain[i]);
+	fputc('\n', expected);
+
+	return 0;
+}
+
+static int level_plain(int k, int depth, unsigned seed);
+static int level_alloca(int k, int depth, unsigned seed);
+static int level_indirect(int k, int depth, unsigned seed);
+
+static int (* volatile indirect)(int k, int depth, unsigned seed);
+
+/* Inlined everywhere, so it never shows up as a frame of its own. */
+static inline __attribute__ ((always_inline))
+int descend(int k, int depth, unsigned seed)
+{
+	if (k == depth)
+		return capture();
+
+	switch ((seed >> (k % 8)) % 3) {
+	case 0:
+		return level_plain(k + 1, depth, seed);
+	case 1:
+		return level_alloca(k + 1, depth, seed);
+	default:
+		return indirect(k + 1, depth, seed);
+	}
+}
+
+static int __attribute__ ((noinline)) level_plain(int k, int depth, unsigned seed)
+{
+	volatile char pad[64];
+	int ret;
+
+	record_caller();
+	pad[0] = k;
+	ret = descend(k, depth, seed);
+	no_tail_call(ret);
+	return ret + pad[0] - k;
+}
+
+/* A variable sized frame, its CFA is kept in a register even at -O2. */
+static int __attribute__ ((noinline)) level_alloca(int k, int depth, unsigned seed)
+{
+	volatile char *pad = alloca(16 + (seed + k) % 64);
+	int ret;
+
+	record_caller();
+	pad[0] = k;
+	ret = descend(k, depth, seed);
+	no_tail_call(ret);
+	return ret + pad[0] - k;
+}
+
+static int __attribute__ ((noinline)) level_indirect(int k, int depth, unsigned seed)
+{
+	int ret;
+
+	record_caller();
+	ret = descend(k, depth, seed);
+	no_tail_call(ret);
+	return ret;
+}
+
+static int stack_end_init(void)
+{
+	pthread_attr_t attr;
+	size_t size;
+	void *addr;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return -1;
+	pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	stack_end = (char *)addr + size;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct unwind_file_opts opts = {};
+	struct timespec ts;
+	int i, nr = 1000, ret = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s out.unw out.expected [records]\n",
+			argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		nr = atoi(argv[3]);
+
+	if (stack_end_init()) {
+		fprintf(stderr, "can't find the end of the stack\n");
+		return 1;
+	}
+
+	file = unwind_file__create(argv[1], &opts);
+	expected = fopen(argv[2], "w");
+	if (!file || !expected) {
+		perror("can't create the fixture");
+		return 1;
+	}
+
+	indirect = level_indirect;
+	uc.tgid = getpid();
+	uc.tid = syscall(SYS_gettid);
+	prctl(PR_GET_NAME, uc.name);
+
+	record_caller();
+	for (i = 0; i < nr && !ret; i++) {
+		nr_chain = 1;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uc.ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		ret = descend(0, 1 + i % MAX_DEPTH, i * 2654435761U);
+	}
+
+	if (unwind_file__close(file) || fclose(expected) || ret) {
+		perror("can't write the fixture");
+		return 1;
+	}
+
+	return 0;
+}
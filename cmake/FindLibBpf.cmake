@@ -0,0 +1,41 @@
+# - Try to find libbpf
+# Once done this will define
+#
+#  LIBBPF_FOUND - system has libbpf
+#  LIBBPF_INCLUDE_DIRS - the directory holding bpf/libbpf.h
+#  LIBBPF_LIBRARIES - Link these to use libbpf
+#
+
+if (LIBBPF_LIBRARIES AND LIBBPF_INCLUDE_DIRS)
+  set (LibBpf_FIND_QUIETLY TRUE)
+endif (LIBBPF_LIBRARIES AND LIBBPF_INCLUDE_DIRS)
+
+find_path (LIBBPF_INCLUDE_DIRS
+  NAMES
+    bpf/libbpf.h
+  PATHS
+    /usr/include
+    /usr/local/include
+    /opt/local/include
+    ENV CPATH)
+
+find_library (LIBBPF_LIBRARIES
+  NAMES
+    bpf
+  PATHS
+    /usr/lib
+    /usr/lib64
+    /usr/local/lib
+    /usr/local/lib64
+    /opt/local/lib
+    ENV LIBRARY_PATH
+    ENV LD_LIBRARY_PATH)
+
+include (FindPackageHandleStandardArgs)
+
+# handle the QUIETLY and REQUIRED arguments and set LIBBPF_FOUND to TRUE if all listed variables are TRUE
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibBpf DEFAULT_MSG
+  LIBBPF_LIBRARIES
+  LIBBPF_INCLUDE_DIRS)
+
+mark_as_advanced(LIBBPF_INCLUDE_DIRS LIBBPF_LIBRARIES)
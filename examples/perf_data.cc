@@ -0,0 +1,138 @@
+#include "queue.h"
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <libdw_bpf.h>
+
+/*
+ * Unwind the samples of a perf record --call-graph dwarf file on
+ * several threads sharing one machine, e.g.
+ *
+ *   perf record --call-graph dwarf -a -- sleep 10
+ *   perf_data perf.data 8
+ *
+ * The DSOs the samples hit have to be at the same paths on this host.
+ */
+
+static int maxdepth = 64;
+static std::atomic<u64> nr_unwound(0), nr_failed(0), nr_frames(0);
+
+/* Samples queued but not resolved yet, see drain(). */
+struct in_flight {
+    Queue<unwind_ctx> q;
+    std::mutex mutex;
+    std::condition_variable done;
+    u64 nr = 0;
+};
+
+static int unwind_ctx_handler(struct unwind_ctx *uc, int size, void *cookie)
+{
+    auto f = static_cast<in_flight*>(cookie);
+    /* The record is the reader's until we return, queue a copy. */
+    auto copy = static_cast<unwind_ctx*>(malloc(size));
+
+    memcpy(copy, uc, size);
+    {
+        std::lock_guard<std::mutex> lock(f->mutex);
+        f->nr++;
+    }
+    f->q.push(copy);
+    return 0;
+}
+
+/*
+ * The reader is about to unmap, exec or exit something, let the
+ * samples from before resolve against the maps they were taken with.
+ */
+static void drain(void *cookie)
+{
+    auto f = static_cast<in_flight*>(cookie);
+    std::unique_lock<std::mutex> lock(f->mutex);
+
+    f->done.wait(lock, [f] { return !f->nr; });
+}
+
+static void resolve(machine_t *machine, in_flight *f)
+{
+    resolver_opts opts = { .max_depth = maxdepth };
+    resolver_t *resolver = resolver__new(&opts);
+
+    while (auto uc = f->q.pop()) {
+        auto st = resolver__resolve(resolver, machine, uc);
+        if (!st->depth) {
+            nr_failed++;
+        } else {
+            nr_unwound++;
+            nr_frames += st->depth;
+        }
+        free(uc);
+
+        std::lock_guard<std::mutex> lock(f->mutex);
+        if (!--f->nr)
+            f->done.notify_one();
+    }
+    resolver__delete(resolver);
+}
+
+int main(int argc, char **argv) {
+    unsigned nr_threads = 4;
+
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " perf.data [threads] [maxdepth]" << std::endl;
+        return 1;
+    }
+    if (argc > 2)
+        nr_threads = std::stoi(argv[2]);
+    if (argc > 3)
+        maxdepth = std::stoi(argv[3]);
+
+    perf_data_t *pd = perf_data__open(argv[1]);
+    if (!pd) {
+        std::cerr << "can't read " << argv[1] << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    struct machine_opts opts = {};
+    opts.threading = MACHINE_THREADING_CONCURRENT;
+    machine_t *machine = machine__new_opts(&opts);
+
+    in_flight f;
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads(nr_threads);
+    for (auto &&t : threads)
+        t = std::thread(resolve, machine, &f);
+
+    perf_data__set_barrier(pd, drain);
+    auto ret = perf_data__process(pd, machine, unwind_ctx_handler, &f);
+    if (ret < 0)
+        std::cerr << "perf_data__process failed: " << ret << std::endl;
+
+    for (unsigned i = 0; i < nr_threads; i++)
+        f.q.push(nullptr);
+    for (auto &&t : threads)
+        t.join();
+
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start;
+    u64 nr = nr_unwound + nr_failed;
+    std::cout << nr << " samples in " << secs.count() << "s, "
+              << nr / secs.count() << " samples/s, "
+              << nr_failed << " failed, "
+              << (nr_unwound ? (double)nr_frames / nr_unwound : 0)
+              << " frames per callchain" << std::endl;
+
+    perf_data__close(pd);
+    machine__delete(machine);
+
+    return ret < 0;
+}
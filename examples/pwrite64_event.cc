@@ -21,11 +21,6 @@ std::string BPF_PROGRAM = R"(
 
 #define STACK_SIZE    4096 * 2
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
-
 struct unwind_ctx {
         u64 ts;
         u32 tid;
@@ -38,83 +33,89 @@ struct unwind_ctx {
         char data[STACK_SIZE];
 };
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
-
-BPF_PERF_OUTPUT(unwind_ctxs);
-
-static __inline
-int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
-{
-        struct pt_regs *user_regs = NULL;
-        struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
-        struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
-        void *sp = NULL;
-        int ret = 0;
-        int z = 0;
-
-        task = (struct task_struct *)bpf_get_current_task();
-
-        if (!tracepoint && ctx && user_mode(ctx)) {
-             user_regs = ctx;
-        } else {
-               if (task->mm)
-                    user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
-        }
+struct unwind_entry {
+        u64 ts;
+        struct pt_regs uregs;
+};
 
-        if (!user_regs)
-                return -1;
+struct unwind_slow_call {
+        u64 latency;
+        struct unwind_ctx uc;
+};
 
-        ret = bpf_probe_read(&sp, sizeof(sp), &user_regs->sp);
-        if (ret < 0)
-                return -1;
+/*
+ * Entry saves the registers and a timestamp per tid, the stack is
+ * only read at exit, for writes slower than the threshold. The
+ * caller's stack can't change while the thread is in the syscall.
+ */
+BPF_TABLE("lru_hash", u32, struct unwind_entry, unwind_entries, 10240);
+BPF_ARRAY(unwind_latency_threshold, u64, 1);
+BPF_PERCPU_ARRAY(slow_scratch, struct unwind_slow_call, 1);
+BPF_PERF_OUTPUT(unwind_slow_calls);
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
-                return -1;
+TRACEPOINT_PROBE(syscalls, sys_enter_pwrite64) {
+        struct unwind_entry entry = {};
+        struct task_struct *task;
+        struct pt_regs *user_regs;
+        u32 tid = bpf_get_current_pid_tgid();
 
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
+        task = (struct task_struct *)bpf_get_current_task();
+        if (!task->mm)
+                return 0;
+        user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
+        if (bpf_probe_read(&entry.uregs, sizeof(entry.uregs), user_regs) < 0)
+                return 0;
 
-        uc = cache.lookup_or_init(&k, zuc);
-        if (!uc)
-                return -1;
+        entry.ts = bpf_ktime_get_ns();
+        unwind_entries.update(&tid, &entry);
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
+        return 0;
+}
 
-        ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
+TRACEPOINT_PROBE(syscalls, sys_exit_pwrite64) {
+        struct unwind_slow_call *sc;
+        struct unwind_entry *entry;
+        u64 id, latency, *threshold;
+        u32 tid, size;
+        int ret, z = 0;
+
+        id = bpf_get_current_pid_tgid();
+        tid = id;
+        entry = unwind_entries.lookup(&tid);
+        if (!entry)
+                return 0;
+
+        latency = bpf_ktime_get_ns() - entry->ts;
+        threshold = unwind_latency_threshold.lookup(&z);
+        if (threshold && latency < *threshold)
+                goto out;
+
+        sc = slow_scratch.lookup(&z);
+        if (!sc)
+                goto out;
+
+        sc->latency = latency;
+        sc->uc.ts = entry->ts;
+        sc->uc.tgid = id >> 32;
+        sc->uc.tid = id;
+        __builtin_memcpy(&sc->uc.uregs, &entry->uregs, sizeof(sc->uc.uregs));
+        bpf_get_current_comm(&sc->uc.name, sizeof(sc->uc.name));
+        ret = bpf_probe_read_stack(&sc->uc.data, sizeof(sc->uc.data),
+                                   (void *)entry->uregs.sp);
         if (ret < 0)
-                return -1;
-        bpf_get_current_comm(&uc->name, sizeof(uc->name));
-        if (!tracepoint && ctx && !user_mode(ctx)) {
-               sp -= 16;
-               uc->uregs.sp = (unsigned long)sp;
-        }
-        ret = bpf_probe_read_stack(&uc->data, sizeof(uc->data), sp);
-        if (ret < 0)
-                return -1;
-        if (ret == 0)
-                uc->size = STACK_SIZE;
-        else
-                uc->size = STACK_SIZE - ret;
-
-        if (tracepoint)
-                unwind_ctxs.perf_submit(attr, uc, sizeof(*uc));
-        else
-                unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
+                goto out;
+        sc->uc.size = STACK_SIZE - ret;
 
-        cache.delete(&k);
+        size = __builtin_offsetof(struct unwind_slow_call, uc.data) +
+               sc->uc.size;
+        if (size > sizeof(*sc))
+                size = sizeof(*sc);
+        unwind_slow_calls.perf_submit(args, sc, size);
 
+out:
+        unwind_entries.delete(&tid);
         return 0;
 }
-
-TRACEPOINT_PROBE(syscalls, sys_enter_pwrite64) {
-        return get_unwind_ctx(NULL, true, args);
-}
 )";
 
 #ifndef __maybe_unused
@@ -125,16 +126,22 @@ typedef uint64_t    unw_word_t;
 
 static ebpf::BPF *bpf;
 static int maxdepth = 4;
+static u64 threshold_us = 1000;
 static pid_t tgid;
 static pid_t tid;
+static unwind_pool_t *pool;
 
 static void unwind_ctx_handler(void *cb_cookie,
                                void *raw,
-                               int raw_size __maybe_unused) {
-    auto uc = static_cast<unwind_ctx*>(raw);
-    auto q = static_cast<Queue<unwind_ctx>*>(cb_cookie);
-    if (uc->tgid == tgid) {
-        q->push(uc);
+                               int raw_size) {
+    auto sc = static_cast<unwind_slow_call*>(raw);
+    auto q = static_cast<Queue<unwind_slow_call>*>(cb_cookie);
+    if (sc->uc.tgid == tgid) {
+        // The record is only valid until we return.
+        auto copy = static_cast<unwind_slow_call*>(
+            unwind_pool__copy(pool, raw, raw_size));
+        if (copy)
+            q->push(copy);
     }
 }
 
@@ -142,14 +149,14 @@ class EventPollTask: public Stoppable {
     public:
         void run() {
             while (stopRequested() == false) {
-                bpf->poll_perf_buffer("unwind_ctxs");
+                bpf->poll_perf_buffer("unwind_slow_calls");
             }
         }
 };
 
 class ResolveCallchainTask: public Stoppable {
     public:
-        void init(pid_t _tgid, pid_t _tid, Queue<unwind_ctx> *_q) {
+        void init(pid_t _tgid, pid_t _tid, Queue<unwind_slow_call> *_q) {
             tgid = _tgid;
             tid = _tid;
             q = _q;
@@ -161,9 +168,8 @@ class ResolveCallchainTask: public Stoppable {
                 std::cerr << "thread_map failed: " << ret << std::endl;
             }
 
-            struct stacktrace st;
-            st.depth = maxdepth;
-            st.ips = reinterpret_cast<u64*>(calloc(sizeof(u64*), st.depth));
+            resolver_opts opts = { .max_depth = maxdepth };
+            resolver_t *resolver = resolver__new(&opts);
 
             bcc_symbol symbol;
             bcc_symbol_option symbol_option = {
@@ -173,30 +179,34 @@ class ResolveCallchainTask: public Stoppable {
             };
             void *cache = bcc_symcache_new(tgid, &symbol_option);
             while (stopRequested() == false) {
-                auto uc = q->pop();
-                auto ret = bpf_unwind_ctx__resolve_callchain(&st, machine, uc);
-                if (ret) {
-                    std::cerr << "resolve_callchain failed: " << ret << std::endl;
-                    exit(1);
+                auto sc = q->pop();
+                auto st = resolver__resolve(resolver, machine, &sc->uc);
+                if (!st->depth) {
+                    std::cerr << "resolve_callchain failed: " << st->stop << std::endl;
+                    unwind_pool__free(pool, sc);
+                    continue;
                 }
 
-                std::cout << "TGID: " << tgid << " TID: " << tid << std::endl;
-                for (int i = 0; i < st.depth; i++) {
-                    if (bcc_symcache_resolve(cache, st.ips[i], &symbol) != 0) {
+                std::cout << "TGID: " << tgid << " TID: " << tid
+                          << " LATENCY: " << sc->latency / 1000 << "us" << std::endl;
+                for (int i = 0; i < st->depth; i++) {
+                    if (bcc_symcache_resolve(cache, st->ips[i], &symbol) != 0) {
                         std::cout << "[UNKNOWN]" << std::endl;
                     } else {
                         std::cout << symbol.demangle_name << std::endl;
                         bcc_symbol_free_demangle_name(&symbol);
                     }
                 }
+                unwind_pool__free(pool, sc);
             }
             bcc_free_symcache(cache, tgid);
+            resolver__delete(resolver);
             machine__delete(machine);
         }
     private:
         pid_t tgid;
         pid_t tid;
-        Queue<unwind_ctx> *q;
+        Queue<unwind_slow_call> *q;
 };
 
 EventPollTask ept;
@@ -213,6 +223,8 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
     tid = std::stoi(argv[2]);
     if (argv[3])
        maxdepth = std::stoi(argv[3]);
+    if (argv[3] && argv[4])
+       threshold_us = std::stoull(argv[4]);
     bpf = new ebpf::BPF(0, nullptr, true, "", true);
     auto init_res = bpf->init(BPF_PROGRAM);
     if (init_res.code() != 0) {
@@ -220,16 +232,27 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
         return 1;
     }
 
-    auto attach_res =
-        bpf->attach_tracepoint("syscalls:sys_enter_pwrite64",
-                               "tracepoint__syscalls__sys_enter_pwrite64");
-    if (attach_res.code() != 0) {
-        std::cerr << attach_res.msg() << std::endl;
+    int threshold_fd = unwind_filter__find("unwind_latency_threshold");
+    if (threshold_fd < 0 ||
+        unwind_latency__set_threshold(threshold_fd, threshold_us * 1000)) {
+        std::cerr << "Failed to set the latency threshold" << std::endl;
         return 1;
     }
 
-    Queue<unwind_ctx> q;
-    auto open_res = bpf->open_perf_buffer("unwind_ctxs", &unwind_ctx_handler,
+    for (auto tp : {"sys_enter_pwrite64", "sys_exit_pwrite64"}) {
+        auto attach_res =
+            bpf->attach_tracepoint(std::string("syscalls:") + tp,
+                                   std::string("tracepoint__syscalls__") + tp);
+        if (attach_res.code() != 0) {
+            std::cerr << attach_res.msg() << std::endl;
+            return 1;
+        }
+    }
+
+    Queue<unwind_slow_call> q;
+    unwind_pool_opts pool_opts = { .slot_size = sizeof(unwind_slow_call) };
+    pool = unwind_pool__new(&pool_opts);
+    auto open_res = bpf->open_perf_buffer("unwind_slow_calls", &unwind_ctx_handler,
                                           nullptr, reinterpret_cast<void*>(&q), 64);
     if (open_res.code() != 0) {
         std::cerr << open_res.msg() << std::endl;
@@ -259,5 +282,6 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
         std::cerr << detach_res.msg() << std::endl;
     }
 
+    unwind_pool__delete(pool);
     return 0;
 }
@@ -21,11 +21,6 @@ std::string BPF_PROGRAM = R"(
 
 #define STACK_SIZE    4096 * 2
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
-
 struct unwind_ctx {
         u64 ts;
         u32 tid;
@@ -38,30 +33,115 @@ struct unwind_ctx {
         char data[STACK_SIZE];
 };
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
+/* Per-CPU scratch record, see bpf/ebpf_get_unwind_ctx.c. */
+#if UNWIND_READ_STACK == 0
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
+#else
+/* Room for a page read that starts anywhere in data. */
+struct unwind_ctx_slot {
+        struct unwind_ctx uc;
+        char slack[4096];
+};
+
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx_slot, 1);
+
+/* Stock kernels: page by page, returns how many bytes were left. */
+static __inline
+int read_user_stack(char *dst, u32 len, void *sp)
+{
+        u32 off = 0, chunk;
+        int i;
+
+#pragma unroll
+        for (i = 0; i < STACK_SIZE / 4096 + 1; i++) {
+                if (off >= len || off >= STACK_SIZE)
+                        break;
+                chunk = 4096 - (((unsigned long)sp + off) & 4095);
+                if (chunk > len - off)
+                        chunk = len - off;
+                if (chunk > 4096)
+                        break;
+                if (bpf_probe_read_user(dst + off, chunk, sp + off))
+                        break;
+                off += chunk;
+        }
+
+        return len - off;
+}
+#endif
 
 BPF_PERF_OUTPUT(unwind_ctxs);
 
+/*
+ * Which tasks to capture, keyed by UNWIND_TARGET_KEY(). A tid entry
+ * wins over its tgid's, the UNWIND_TARGET_DEFAULT entry covers every
+ * other task, and with no entry at all everything is captured. A rate
+ * of N keeps one event in N, 0 drops them all. It is checked before
+ * anything is copied, fill it from userspace with unwind_filter__set().
+ */
+#define UNWIND_TARGET_TGID              0
+#define UNWIND_TARGET_TID               1
+#define UNWIND_TARGET_DEFAULT           2
+#define UNWIND_TARGET_KEY(type, id)     ((u64)(type) << 32 | (u32)(id))
+
+struct unwind_target {
+        u32 rate;
+        u32 flags;
+};
+
+BPF_HASH(unwind_targets, u64, struct unwind_target, 1024);
+
+static __inline
+bool unwind_ctx__sample(u64 id)
+{
+        struct unwind_target *target;
+        u64 key;
+
+        key = UNWIND_TARGET_KEY(UNWIND_TARGET_TID, id);
+        target = unwind_targets.lookup(&key);
+        if (!target) {
+                key = UNWIND_TARGET_KEY(UNWIND_TARGET_TGID, id >> 32);
+                target = unwind_targets.lookup(&key);
+        }
+        if (!target) {
+                key = UNWIND_TARGET_KEY(UNWIND_TARGET_DEFAULT, 0);
+                target = unwind_targets.lookup(&key);
+        }
+
+        if (!target)
+                return true;
+        if (target->rate <= 1)
+                return target->rate == 1;
+        return bpf_get_prandom_u32() % target->rate == 0;
+}
+
 static __inline
 int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
 {
         struct pt_regs *user_regs = NULL;
         struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
         struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
         void *sp = NULL;
         int ret = 0;
+        u32 size;
+        u64 id;
         int z = 0;
 
+        id = bpf_get_current_pid_tgid();
+        if (!unwind_ctx__sample(id))
+                return 0;
+
         task = (struct task_struct *)bpf_get_current_task();
 
         if (!tracepoint && ctx && user_mode(ctx)) {
              user_regs = ctx;
-        } else {
-               if (task->mm)
-                    user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
+        } else if (task->mm) {
+#if UNWIND_READ_STACK == 0
+               user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
+#else
+               user_regs = (struct pt_regs *)((void *)task->stack +
+                                              THREAD_SIZE) - 1;
+#endif
         }
 
         if (!user_regs)
@@ -71,20 +151,13 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         if (ret < 0)
                 return -1;
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
-                return -1;
-
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
-
-        uc = cache.lookup_or_init(&k, zuc);
+        uc = (struct unwind_ctx *)scratch.lookup(&z);
         if (!uc)
                 return -1;
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
 
         ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
         if (ret < 0)
@@ -94,7 +167,11 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
                 sp -= 16;
                 uc->uregs.sp = (unsigned long)sp;
         }
+#if UNWIND_READ_STACK == 0
         ret = bpf_probe_read_stack(&uc->data, sizeof(uc->data), sp);
+#else
+        ret = read_user_stack(uc->data, sizeof(uc->data), sp);
+#endif
         if (ret < 0)
                 return -1;
         if (ret == 0)
@@ -102,12 +179,15 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         else
                 uc->size = STACK_SIZE - ret;
 
+        /* Cut short after the stack read, see bpf/unwind_ctx.h. */
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
+
         if (tracepoint)
-                unwind_ctxs.perf_submit(attr, uc, sizeof(*uc));
+                unwind_ctxs.perf_submit(attr, uc, size);
         else
-                unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
-
-        cache.delete(&k);
+                unwind_ctxs.perf_submit(ctx, uc, size);
 
         return 0;
 }
@@ -131,14 +211,19 @@ static ebpf::BPF *bpf;
 static int maxdepth = 4;
 static pid_t tgid;
 static pid_t tid;
+static unwind_pool_t *pool;
 
 static void unwind_ctx_handler(void *cb_cookie,
                                void *raw,
-                               int raw_size __maybe_unused) {
+                               int raw_size) {
     auto uc = static_cast<unwind_ctx*>(raw);
     auto q = static_cast<Queue<unwind_ctx>*>(cb_cookie);
     if (uc->tgid == tgid) {
-        q->push(uc);
+        // The record is only valid until we return.
+        auto copy = static_cast<unwind_ctx*>(
+            unwind_pool__copy(pool, raw, raw_size));
+        if (copy)
+            q->push(copy);
     }
 }
 
@@ -172,9 +257,8 @@ class ResolveCallchainTask: public Stoppable {
             }
             bpf_dl_iterate_phdr(machine, tgid, __callback, NULL);
 
-            struct stacktrace st;
-            st.depth = maxdepth;
-            st.ips = reinterpret_cast<u64*>(calloc(sizeof(u64*), st.depth));
+            resolver_opts opts = { .max_depth = maxdepth };
+            resolver_t *resolver = resolver__new(&opts);
 
             bcc_symbol symbol;
             bcc_symbol_option symbol_option = {
@@ -185,22 +269,25 @@ class ResolveCallchainTask: public Stoppable {
             void *cache = bcc_symcache_new(tgid, &symbol_option);
             while (stopRequested() == false) {
                 auto uc = q->pop();
-                auto ret = bpf_unwind_ctx__resolve_callchain(&st, machine, uc);
-                if (ret) {
-                    std::cerr << "resolve_callchain failed: " << ret << std::endl;
-                    exit(1);
+                auto st = resolver__resolve(resolver, machine, uc);
+                if (!st->depth) {
+                    std::cerr << "resolve_callchain failed: " << st->stop << std::endl;
+                    unwind_pool__free(pool, uc);
+                    continue;
                 }
                 std::cout << "TGID: " << tgid << " TID: " << tid << std::endl;
-                for (int i = 0; i < st.depth; i++) {
-                    if (bcc_symcache_resolve(cache, st.ips[i], &symbol) != 0) {
+                for (int i = 0; i < st->depth; i++) {
+                    if (bcc_symcache_resolve(cache, st->ips[i], &symbol) != 0) {
                         std::cout << "[UNKNOWN]" << std::endl;
                     } else {
                         std::cout << symbol.demangle_name << std::endl;
                         bcc_symbol_free_demangle_name(&symbol);
                     }
                 }
+                unwind_pool__free(pool, uc);
             }
             bcc_free_symcache(cache, tgid);
+            resolver__delete(resolver);
             machine__delete(machine);
         }
     private:
@@ -224,13 +311,33 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
     std::string syscall(argv[3]);
     if (argv[4])
        maxdepth = std::stoi(argv[4]);
+    // Use the patched bpf_probe_read_stack() if the kernel has it.
+    int read_stack = unwind_read_stack__probe();
+    if (read_stack < 0) {
+        std::cerr << "Can't read user stacks on this kernel: "
+                  << read_stack << std::endl;
+        return 1;
+    }
+
     bpf = new ebpf::BPF(0, nullptr, true, "", true);
-    auto init_res = bpf->init(BPF_PROGRAM);
+    auto init_res = bpf->init(BPF_PROGRAM, {
+        unwind_read_stack__cflag(static_cast<unwind_read_stack>(read_stack))
+    });
     if (init_res.code() != 0) {
         std::cerr << init_res.msg() << std::endl;
         return 1;
     }
 
+    // Only copy stacks of the traced process, everything else is dropped
+    // in the kernel before any of it is read.
+    int targets_fd = unwind_filter__find("unwind_targets");
+    if (targets_fd < 0 ||
+        unwind_filter__set(targets_fd, UNWIND_TARGET_TGID, tgid, 1) ||
+        unwind_filter__set(targets_fd, UNWIND_TARGET_DEFAULT, 0, 0)) {
+        std::cerr << "Failed to set up the target filter" << std::endl;
+        return 1;
+    }
+
     std::string syscall_fnname = bpf->get_syscall_fnname(syscall);
     auto attach_res = bpf->attach_kprobe(syscall_fnname, "probe_syscall_entry");
     if (attach_res.code() != 0) {
@@ -239,6 +346,7 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
     }
 
     Queue<unwind_ctx> q;
+    pool = unwind_pool__new(nullptr);
     auto open_res = bpf->open_perf_buffer("unwind_ctxs", &unwind_ctx_handler,
                                           nullptr, reinterpret_cast<void*>(&q), 64);
     if (open_res.code() != 0) {
@@ -269,5 +377,6 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
         std::cerr << detach_res.msg() << std::endl;
     }
 
+    unwind_pool__delete(pool);
     return 0;
 }
@@ -1,12 +1,10 @@
-#include "queue.h"
-#include "stoppable.h"
-#include <vector>
 #include <bcc/BPF.h>
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
 #include <csignal>
-#include <thread>
+#include <atomic>
+#include <mutex>
 #include <libdw_bpf.h>
 #include <cstdlib>
 #include <elf.h>
@@ -22,11 +20,6 @@ std::string BPF_PROGRAM = R"(
 
 #define STACK_SIZE    4096 * 2
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
-
 struct unwind_ctx {
         u64 ts;
         u32 tid;
@@ -39,8 +32,8 @@ struct unwind_ctx {
         char data[STACK_SIZE];
 };
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
+/* Per-CPU scratch record, see bpf/ebpf_get_unwind_ctx.c. */
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
 
 BPF_PERF_OUTPUT(unwind_ctxs);
 
@@ -49,11 +42,11 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
 {
         struct pt_regs *user_regs = NULL;
         struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
         struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
         void *sp = NULL;
         int ret = 0;
+        u32 size;
+        u64 id;
         int z = 0;
 
         task = (struct task_struct *)bpf_get_current_task();
@@ -72,20 +65,14 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         if (ret < 0)
                 return -1;
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
-                return -1;
-
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
-
-        uc = cache.lookup_or_init(&k, zuc);
+        uc = scratch.lookup(&z);
         if (!uc)
                 return -1;
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
+        id = bpf_get_current_pid_tgid();
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
 
         ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
         if (ret < 0)
@@ -103,12 +90,15 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         else
                 uc->size = STACK_SIZE - ret;
 
+        /* Cut short after the stack read, see bpf/unwind_ctx.h. */
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
+
         if (tracepoint)
-                unwind_ctxs.perf_submit(attr, uc, sizeof(*uc));
+                unwind_ctxs.perf_submit(attr, uc, size);
         else
-                unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
-
-        cache.delete(&k);
+                unwind_ctxs.perf_submit(ctx, uc, size);
 
         return 0;
 }
@@ -131,98 +121,77 @@ typedef uint64_t    unw_word_t;
 static ebpf::BPF *bpf;
 static int maxdepth = 4;
 static pid_t tgid;
-static pid_t tid;
-
-static void unwind_ctx_handler(void *cb_cookie,
-                               void *raw,
-                               int raw_size __maybe_unused) {
+static void *symcache;
+static std::mutex symcache_lock;
+static std::atomic<bool> stop(false);
+
+// Runs on the perf buffer polling thread. The record is only valid until
+// we return, the pipeline copies it.
+static void unwind_ctx_handler(void *cb_cookie, void *raw, int raw_size) {
+    auto pipeline = static_cast<pipeline_t*>(cb_cookie);
     auto uc = static_cast<unwind_ctx*>(raw);
-    auto q = static_cast<Queue<unwind_ctx>*>(cb_cookie);
-    if (uc->tgid == tgid) {
-        q->push(uc);
-    }
+
+    // Dropped records are counted by the pipeline.
+    if (uc->tgid == tgid)
+        pipeline__submit(pipeline, uc, raw_size);
 }
 
-class EventPollTask: public Stoppable {
-    public:
-        void run() {
-            while (stopRequested() == false) {
-                bpf->poll_perf_buffer("unwind_ctxs");
-            }
-        }
-};
+// The kernel found the perf buffer full, count them with the rest.
+static void unwind_ctx_lost(void *cb_cookie, uint64_t lost) {
+    pipeline__lost(static_cast<pipeline_t*>(cb_cookie), lost);
+}
 
-class ResolveCallchainTask: public Stoppable {
-    public:
-        void init(pid_t _tgid, pid_t _tid, Queue<unwind_ctx> *_q) {
-            tgid = _tgid;
-            tid = _tid;
-            q = _q;
-        }
-        void run() {
-            machine_t *machine = machine__new();
-            auto ret = bpf_unwind_ctx__thread_map(machine, tgid, tid);
-            if (ret) {
-                std::cerr << "thread_map failed: " << ret << std::endl;
-            }
-
-            struct stacktrace st;
-            st.depth = maxdepth;
-            st.ips = reinterpret_cast<u64*>(calloc(sizeof(u64*), st.depth));
-
-            bcc_symbol symbol;
-            bcc_symbol_option symbol_option = {
-                .use_debug_file = 1,
-                .check_debug_file_crc = 1,
-                .use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC)
-            };
-            void *cache = bcc_symcache_new(tgid, &symbol_option);
-
-            while (stopRequested() == false) {
-                auto uc = q->pop();
-                auto ret = bpf_unwind_ctx__resolve_callchain(&st, machine, uc);
-                if (ret) {
-                    std::cerr << "resolve_callchain failed: " << ret << std::endl;
-                    exit(1);
-                }
-
-                std::cout << "TGID: " << tgid << " TID: " << tid << std::endl;
-                for (int i = 0; i < st.depth; i++) {
-                    if (bcc_symcache_resolve(cache, st.ips[i], &symbol) != 0) {
-                        std::cout << "[UNKNOWN]" << std::endl;
-                    } else {
-                        std::cout << symbol.demangle_name << std::endl;
-                        bcc_symbol_free_demangle_name(&symbol);
-                    }
-                }
-            }
-
-            bcc_free_symcache(cache, tgid);
-            machine__delete(machine);
-        }
-    private:
-        pid_t tgid;
-        pid_t tid;
-        Queue<unwind_ctx> *q;
-};
+// Runs on whichever worker resolved uc.
+static void callchain_handler(const struct unwind_ctx *uc,
+                              struct stacktrace *st, int ret,
+                              void *cookie __maybe_unused) {
+    if (ret || !st->depth) {
+        std::cerr << "resolve_callchain failed: " << st->stop << std::endl;
+        return;
+    }
 
-EventPollTask ept;
-std::vector<ResolveCallchainTask*> rcts;
+    std::string out = "TGID: " + std::to_string(uc->tgid) +
+                      " TID: " + std::to_string(uc->tid) + "\n";
+    std::lock_guard<std::mutex> guard(symcache_lock);
+    for (int i = 0; i < st->depth; i++) {
+        bcc_symbol symbol;
 
-static void signal_handler(int s) {
-    std::cerr << "Terminating..." << std::endl;
-    ept.stop();
-    for (auto&& rct : rcts) {
-        rct->stop();
+        if (bcc_symcache_resolve(symcache, st->ips[i], &symbol) != 0) {
+            out += "[UNKNOWN]\n";
+        } else {
+            out += std::string(symbol.demangle_name) + "\n";
+            bcc_symbol_free_demangle_name(&symbol);
+        }
     }
+    std::cout << out;
 }
 
-int main(int argc __maybe_unused, char **argv __maybe_unused) {
+static void signal_handler(int s __maybe_unused) {
+    std::cerr << "Terminating..." << std::endl;
+    stop = true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0]
+                  << " tgid syscall [maxdepth] [workers] [policy]"
+                  << std::endl;
+        return 1;
+    }
+
     tgid = std::stoi(argv[1]);
-    tid = std::stoi(argv[2]);
-    std::string syscall(argv[3]);
-    if (argv[4])
-       maxdepth = std::stoi(argv[4]);
+    std::string syscall(argv[2]);
+    if (argc > 3)
+        maxdepth = std::stoi(argv[3]);
+
+    struct pipeline_opts opts = {};
+    opts.nr_workers = argc > 4 ? std::stoi(argv[4]) : 4;
+    opts.max_depth = maxdepth;
+    opts.callback = callchain_handler;
+    // 0 drops the newest, 1 the oldest, 2 downsamples, 3 degrades.
+    if (argc > 5)
+        opts.policy = static_cast<pipeline_policy>(std::stoi(argv[5]));
+
     bpf = new ebpf::BPF(0, nullptr, true, "", true);
     auto init_res = bpf->init(BPF_PROGRAM);
     if (init_res.code() != 0) {
@@ -237,9 +206,22 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
         return 1;
     }
 
-    Queue<unwind_ctx> q;
+    bcc_symbol_option symbol_option = {
+        .use_debug_file = 1,
+        .check_debug_file_crc = 1,
+        .use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC)
+    };
+    symcache = bcc_symcache_new(tgid, &symbol_option);
+
+    // Poller, workers and shutdown order all belong to the pipeline.
+    pipeline_t *pipeline = pipeline__new(&opts);
+    if (!pipeline) {
+        std::cerr << "pipeline__new failed" << std::endl;
+        return 1;
+    }
+
     auto open_res = bpf->open_perf_buffer("unwind_ctxs", &unwind_ctx_handler,
-                                          nullptr, reinterpret_cast<void*>(&q), 64);
+                                          &unwind_ctx_lost, pipeline, 64);
     if (open_res.code() != 0) {
         std::cerr << open_res.msg() << std::endl;
         return 1;
@@ -253,28 +235,28 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
     signal(SIGINT, signal_handler);
     std::cout << "Started tracing, hit Ctrl-C to terminate." << std::endl;
 
-    std::thread t1([&]() {
-        ept.run();
-    });
-    std::vector<std::thread> threads(4);
-    for(unsigned i = 0; i < threads.size(); ++i) {
-        threads[i] = std::thread([&]() {
-            ResolveCallchainTask rct;
-            rct.init(tgid, tid, &q);
-            rcts.push_back(&rct);
-            rct.run();
-        });
-    }
-    t1.join();
-
-    for (auto &&t : threads) {
-        t.join();
-    }
+    while (!stop)
+        bpf->poll_perf_buffer("unwind_ctxs", 100);
 
     auto detach_res = bpf->detach_all();
     if (detach_res.code() != 0) {
         std::cerr << detach_res.msg() << std::endl;
     }
 
+    // Nothing is submitted any more, drops are final.
+    struct pipeline_stats stats;
+    pipeline__read_stats(pipeline, &stats);
+    // Resolves whatever is still queued before returning.
+    pipeline__delete(pipeline);
+    bcc_free_symcache(symcache, tgid);
+
+    static const char *reasons[PIPELINE_DROP__NR] = {
+        "full", "evicted", "sampled", "too big", "lost",
+    };
+    std::cerr << stats.submitted << " submitted, dropped:";
+    for (int i = 0; i < PIPELINE_DROP__NR; i++)
+        std::cerr << " " << reasons[i] << " " << stats.dropped[i];
+    std::cerr << std::endl;
+
     return 0;
 }
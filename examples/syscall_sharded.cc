@@ -0,0 +1,212 @@
+#include <bcc/BPF.h>
+#include <iostream>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <atomic>
+#include <libdw_bpf.h>
+
+std::string BPF_PROGRAM = R"(
+#include <linux/sched.h>
+#include <uapi/linux/ptrace.h>
+
+#ifndef __inline
+# define __inline                               \
+        inline __attribute__((always_inline))
+#endif
+
+#define STACK_SIZE    4096 * 2
+
+struct unwind_ctx {
+        u64 ts;
+        u32 tid;
+        u32 tgid;
+
+        struct pt_regs uregs;
+        char name[TASK_COMM_LEN];
+
+        int size;
+        char data[STACK_SIZE];
+};
+
+/* Per-CPU scratch record, see bpf/ebpf_get_unwind_ctx.c. */
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
+
+BPF_PERF_OUTPUT(unwind_ctxs);
+
+static __inline
+int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
+{
+        struct pt_regs *user_regs = NULL;
+        struct task_struct *task = NULL;
+        struct unwind_ctx *uc = NULL;
+        void *sp = NULL;
+        int ret = 0;
+        u32 size;
+        u64 id;
+        int z = 0;
+
+        task = (struct task_struct *)bpf_get_current_task();
+
+        if (!tracepoint && ctx && user_mode(ctx)) {
+             user_regs = ctx;
+        } else {
+               if (task->mm)
+                    user_regs = ((struct pt_regs *)(task)->thread.sp0 - 1);
+        }
+
+        if (!user_regs)
+                return -1;
+
+        ret = bpf_probe_read(&sp, sizeof(sp), &user_regs->sp);
+        if (ret < 0)
+                return -1;
+
+        uc = scratch.lookup(&z);
+        if (!uc)
+                return -1;
+
+        id = bpf_get_current_pid_tgid();
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
+
+        ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
+        if (ret < 0)
+                return -1;
+        bpf_get_current_comm(&uc->name, sizeof(uc->name));
+        if (!tracepoint && ctx && !user_mode(ctx)) {
+                sp -= 16;
+                uc->uregs.sp = (unsigned long)sp;
+        }
+        ret = bpf_probe_read_stack(&uc->data, sizeof(uc->data), sp);
+        if (ret < 0)
+                return -1;
+        if (ret == 0)
+                uc->size = STACK_SIZE;
+        else
+                uc->size = STACK_SIZE - ret;
+
+        /* Cut short after the stack read, see bpf/unwind_ctx.h. */
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
+
+        if (tracepoint)
+                unwind_ctxs.perf_submit(attr, uc, size);
+        else
+                unwind_ctxs.perf_submit(ctx, uc, size);
+
+        return 0;
+}
+
+int probe_syscall_entry(void *ctx)
+{
+        if (get_unwind_ctx(ctx, false, NULL) < 0)
+                bpf_trace_printk("get_unwind_ctx failed\n");
+
+        return 0;
+}
+)";
+
+
+#ifndef __maybe_unused
+# define __maybe_unused __attribute__((unused))
+#endif
+
+static ebpf::BPF *bpf;
+static std::atomic<bool> stop(false);
+
+// Runs on the perf buffer polling thread, the only producer.
+static void unwind_ctx_handler(void *cb_cookie, void *raw, int raw_size) {
+    auto dispatcher = static_cast<dispatcher_t*>(cb_cookie);
+    dispatcher__push(dispatcher, static_cast<unwind_ctx*>(raw), raw_size);
+}
+
+// Runs on the worker that owns uc->tgid.
+static void callchain_handler(const struct unwind_ctx *uc,
+                              struct stacktrace *st, int ret,
+                              void *cookie __maybe_unused) {
+    if (ret) {
+        fprintf(stderr, "resolve_callchain failed: %d\n", ret);
+        return;
+    }
+
+    // One printf per callchain, so workers don't interleave lines.
+    std::string out = "TGID: " + std::to_string(uc->tgid) +
+                      " TID: " + std::to_string(uc->tid) + "\n";
+    for (int i = 0; i < st->depth; i++) {
+        char ip[32];
+        snprintf(ip, sizeof(ip), "    %#" PRIx64 "\n", st->ips[i]);
+        out += ip;
+    }
+    fputs(out.c_str(), stdout);
+}
+
+static void signal_handler(int s __maybe_unused) {
+    std::cerr << "Terminating..." << std::endl;
+    stop = true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " syscall [maxdepth] [workers]" << std::endl;
+        return 1;
+    }
+
+    std::string syscall(argv[1]);
+    struct dispatcher_opts opts = {};
+    opts.nr_workers = argc > 3 ? std::stoi(argv[3]) : 4;
+    opts.max_depth = argc > 2 ? std::stoi(argv[2]) : 4;
+    opts.callback = callchain_handler;
+
+    bpf = new ebpf::BPF(0, nullptr, true, "", true);
+    auto init_res = bpf->init(BPF_PROGRAM);
+    if (init_res.code() != 0) {
+        std::cerr << init_res.msg() << std::endl;
+        return 1;
+    }
+
+    std::string syscall_fnname = bpf->get_syscall_fnname(syscall);
+    auto attach_res = bpf->attach_kprobe(syscall_fnname, "probe_syscall_entry");
+    if (attach_res.code() != 0) {
+        std::cerr << attach_res.msg() << std::endl;
+        return 1;
+    }
+
+    dispatcher_t *dispatcher = dispatcher__new(&opts);
+    if (!dispatcher) {
+        std::cerr << "dispatcher__new failed" << std::endl;
+        return 1;
+    }
+
+    auto open_res = bpf->open_perf_buffer("unwind_ctxs", &unwind_ctx_handler,
+                                          nullptr, dispatcher, 64);
+    if (open_res.code() != 0) {
+        std::cerr << open_res.msg() << std::endl;
+        return 1;
+    }
+
+    if (bpf->free_bcc_memory()) {
+        std::cerr << "Failed to free llvm/clang memory" << std::endl;
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    std::cout << "Started tracing, hit Ctrl-C to terminate." << std::endl;
+
+    while (!stop)
+        bpf->poll_perf_buffer("unwind_ctxs", 100);
+
+    auto detach_res = bpf->detach_all();
+    if (detach_res.code() != 0) {
+        std::cerr << detach_res.msg() << std::endl;
+    }
+
+    // Resolves whatever is still queued before returning.
+    dispatcher__delete(dispatcher);
+
+    return 0;
+}
@@ -21,11 +21,6 @@ std::string BPF_PROGRAM = R"(
 
 #define STACK_SIZE    4096 * 2
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
-
 struct unwind_ctx {
         u64 ts;
         u32 tid;
@@ -38,8 +33,8 @@ struct unwind_ctx {
         char data[STACK_SIZE];
 };
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
+/* Per-CPU scratch record, see bpf/ebpf_get_unwind_ctx.c. */
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
 
 BPF_PERF_OUTPUT(unwind_ctxs);
 
@@ -48,11 +43,11 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
 {
         struct pt_regs *user_regs = NULL;
         struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
         struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
         void *sp = NULL;
         int ret = 0;
+        u32 size;
+        u64 id;
         int z = 0;
 
         task = (struct task_struct *)bpf_get_current_task();
@@ -70,20 +65,14 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         if (ret < 0)
                 return -1;
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
-                return -1;
-
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
-
-        uc = cache.lookup_or_init(&k, zuc);
+        uc = scratch.lookup(&z);
         if (!uc)
                 return -1;
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
+        id = bpf_get_current_pid_tgid();
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
         ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
         if (ret < 0)
                 return -1;
@@ -100,12 +89,15 @@ int get_unwind_ctx(struct pt_regs *ctx, bool tracepoint, void *attr)
         else
                 uc->size = STACK_SIZE - ret;
 
+        /* Cut short after the stack read, see bpf/unwind_ctx.h. */
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
+
         if (tracepoint)
-                unwind_ctxs.perf_submit(attr, uc, sizeof(*uc));
+                unwind_ctxs.perf_submit(attr, uc, size);
         else
-                unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
-
-        cache.delete(&k);
+                unwind_ctxs.perf_submit(ctx, uc, size);
 
         return 0;
 }
@@ -128,13 +120,17 @@ typedef uint64_t    unw_word_t;
 static ebpf::BPF *bpf;
 static int maxdepth = 4;
 static int i = 0;
+static unwind_pool_t *pool;
 
 static void unwind_ctx_handler(void *cb_cookie,
                                void *raw,
-                               int raw_size __maybe_unused) {
-    auto uc = static_cast<unwind_ctx*>(raw);
+                               int raw_size) {
     auto q = static_cast<Queue<unwind_ctx>*>(cb_cookie);
-    q->push(uc);
+    // The record is only valid until we return.
+    auto copy = static_cast<unwind_ctx*>(
+        unwind_pool__copy(pool, raw, raw_size));
+    if (copy)
+        q->push(copy);
 }
 
 class EventPollTask: public Stoppable {
@@ -160,9 +156,8 @@ class ResolveCallchainTask: public Stoppable {
                 std::cerr << "thread_map failed: " << ret << std::endl;
             }
 
-            struct stacktrace st;
-            st.depth = maxdepth;
-            st.ips = reinterpret_cast<u64*>(calloc(sizeof(u64*), st.depth));
+            resolver_opts opts = { .max_depth = maxdepth };
+            resolver_t *resolver = resolver__new(&opts);
 
             bcc_symbol symbol;
             bcc_symbol_option symbol_option = {
@@ -173,22 +168,25 @@ class ResolveCallchainTask: public Stoppable {
             void *cache = bcc_symcache_new(tgid, &symbol_option);
             while (stopRequested() == false) {
                 auto uc = q->pop();
-                auto ret = bpf_unwind_ctx__resolve_callchain(&st, machine, uc);
-                if (ret) {
-                    std::cerr << "resolve_callchain failed: " << ret << std::endl;
-                    exit(1);
+                auto st = resolver__resolve(resolver, machine, uc);
+                if (!st->depth) {
+                    std::cerr << "resolve_callchain failed: " << st->stop << std::endl;
+                    unwind_pool__free(pool, uc);
+                    continue;
                 }
 
-                for (int i = 0; i < st.depth; i++) {
-                    if (bcc_symcache_resolve(cache, st.ips[i], &symbol) != 0) {
+                for (int i = 0; i < st->depth; i++) {
+                    if (bcc_symcache_resolve(cache, st->ips[i], &symbol) != 0) {
                         std::cout << "[UNKNOWN]" << std::endl;
                     } else {
                         std::cout << symbol.demangle_name << std::endl;
                         bcc_symbol_free_demangle_name(&symbol);
                     }
                 }
+                unwind_pool__free(pool, uc);
             }
             bcc_free_symcache(cache, tgid);
+            resolver__delete(resolver);
             machine__delete(machine);
         }
     private:
@@ -227,6 +225,7 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
     }
 
     Queue<unwind_ctx> q;
+    pool = unwind_pool__new(nullptr);
     auto open_res = bpf->open_perf_buffer("unwind_ctxs", &unwind_ctx_handler,
                                           nullptr, reinterpret_cast<void*>(&q), 64);
     if (open_res.code() != 0) {
@@ -257,5 +256,6 @@ int main(int argc __maybe_unused, char **argv __maybe_unused) {
         std::cerr << detach_res.msg() << std::endl;
     }
 
+    unwind_pool__delete(pool);
     return 0;
 }
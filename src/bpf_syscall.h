@@ -0,0 +1,64 @@
+#ifndef __BPF_SYSCALL_H_
+#define __BPF_SYSCALL_H_
+
+#include "types.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+/*
+ * The few bpf(2) commands the library needs to talk to maps of a
+ * program somebody else loaded, without depending on libbpf or bcc.
+ * All of them return 0 or a negative errno.
+ */
+
+#define ptr_to_u64(ptr)    ((u64)(unsigned long)(ptr))
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    int ret = syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+
+    return ret < 0 ? -errno : ret;
+}
+
+static inline int sys_bpf_map_update(int fd, const void *key,
+                                     const void *value, u64 flags)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = ptr_to_u64(key);
+    attr.value = ptr_to_u64(value);
+    attr.flags = flags;
+
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static inline int sys_bpf_map_delete(int fd, const void *key)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = ptr_to_u64(key);
+
+    return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static inline int sys_bpf_obj_info(int fd, void *info, u32 len)
+{
+    union bpf_attr attr;
+
+    memset(info, 0, len);
+    memset(&attr, 0, sizeof(attr));
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = len;
+    attr.info.info = ptr_to_u64(info);
+
+    return sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr);
+}
+
+#endif // __BPF_SYSCALL_H_
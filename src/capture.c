@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "libdw_bpf.h"
+#include "utility.h"
+#include "unwind_ctx.skel.h"
+#include <bpf/libbpf.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Loads the CO-RE object built from bpf/unwind_ctx.bpf.c out of the
+ * skeleton linked into the library, so nothing is compiled at run
+ * time. Records come out of the same ring buffer ringbuf__poll()
+ * reads, the filter and stack size maps are the ones the bcc programs
+ * have, see capture__map_fd().
+ */
+struct capture {
+    struct unwind_ctx_bpf *skel;
+    ringbuf_t *rb;
+    struct bpf_link **links;
+    int nr_links;
+    bool sleepable;    /* unwind_ctx_uprobe_sleepable got loaded */
+};
+
+void capture__delete(struct capture *capture)
+{
+    int i;
+
+    if (!capture)
+        return;
+
+    for (i = 0; i < capture->nr_links; i++)
+        bpf_link__destroy(capture->links[i]);
+    free(capture->links);
+    ringbuf__delete(capture->rb);
+    unwind_ctx_bpf__destroy(capture->skel);
+    free(capture);
+}
+
+static struct unwind_ctx_bpf *capture__open(const struct capture_opts *opts,
+                                            bool sleepable)
+{
+    struct unwind_ctx_bpf *skel = unwind_ctx_bpf__open();
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (libbpf_get_error(skel))
+        return NULL;
+
+    if (opts && opts->ringbuf_pages &&
+        bpf_map__set_max_entries(skel->maps.unwind_ctxs,
+                                 opts->ringbuf_pages * page_size))
+        goto out_err;
+
+    if (!sleepable)
+        bpf_program__set_autoload(skel->progs.unwind_ctx_uprobe_sleepable,
+                                  false);
+
+    if (unwind_ctx_bpf__load(skel))
+        goto out_err;
+
+    return skel;
+
+out_err:
+    unwind_ctx_bpf__destroy(skel);
+    return NULL;
+}
+
+struct capture *capture__new(const struct capture_opts *opts)
+{
+    struct capture *capture = xcalloc(1, sizeof(*capture));
+
+    /*
+     * The verifier is the feature probe: kernels without sleepable
+     * uprobes or bpf_copy_from_user() reject that program, then load
+     * everything else on its own.
+     */
+    capture->skel = capture__open(opts, true);
+    capture->sleepable = capture->skel != NULL;
+    if (!capture->skel)
+        capture->skel = capture__open(opts, false);
+    if (!capture->skel)
+        goto out_err;
+
+    capture->rb = ringbuf__new(bpf_map__fd(capture->skel->maps.unwind_ctxs));
+    if (!capture->rb)
+        goto out_err;
+
+    return capture;
+
+out_err:
+    capture__delete(capture);
+    return NULL;
+}
+
+static int capture__add_link(struct capture *capture, struct bpf_link *link)
+{
+    struct bpf_link **links;
+    long err = libbpf_get_error(link);
+
+    if (err)
+        return err;
+
+    links = realloc(capture->links,
+                    (capture->nr_links + 1) * sizeof(*links));
+    if (!links) {
+        bpf_link__destroy(link);
+        return -ENOMEM;
+    }
+
+    links[capture->nr_links++] = link;
+    capture->links = links;
+
+    return 0;
+}
+
+/* Capture on every call of the kernel function @func. */
+int capture__attach_kprobe(struct capture *capture, const char *func)
+{
+    return capture__add_link(capture,
+        bpf_program__attach_kprobe(capture->skel->progs.unwind_ctx_kprobe,
+                                   false, func));
+}
+
+/*
+ * Capture on every call of @func, or at @offset into @binary if @func
+ * is NULL, in process @pid or in all processes if it's -1.
+ */
+int capture__attach_uprobe(struct capture *capture, pid_t pid,
+                           const char *binary, const char *func, u64 offset)
+{
+    LIBBPF_OPTS(bpf_uprobe_opts, uprobe_opts, .func_name = func);
+    struct bpf_program *prog = capture->skel->progs.unwind_ctx_uprobe;
+
+    if (capture->sleepable)
+        prog = capture->skel->progs.unwind_ctx_uprobe_sleepable;
+
+    return capture__add_link(capture,
+        bpf_program__attach_uprobe_opts(prog, pid, binary, offset,
+                                        &uprobe_opts));
+}
+
+/* Capture on the tracepoint @category:@name, e.g. syscalls:sys_enter_write. */
+int capture__attach_tracepoint(struct capture *capture,
+                               const char *category, const char *name)
+{
+    return capture__add_link(capture,
+        bpf_program__attach_tracepoint(capture->skel->progs.unwind_ctx_tracepoint,
+                                       category, name));
+}
+
+/*
+ * Open a perf event as perf_event_open(2) would with @attr, @pid and
+ * @cpu, and capture on every sample, or overflow, of it. Call it once
+ * per CPU to sample a whole system. The event is closed on
+ * capture__delete().
+ */
+int capture__attach_perf_event(struct capture *capture,
+                               struct perf_event_attr *attr,
+                               pid_t pid, int cpu)
+{
+    struct bpf_link *link;
+    long err;
+    int fd;
+
+    fd = syscall(__NR_perf_event_open, attr, pid, cpu, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    link = bpf_program__attach_perf_event(
+        capture->skel->progs.unwind_ctx_perf_event, fd);
+    err = libbpf_get_error(link);
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    return capture__add_link(capture, link);
+}
+
+/*
+ * The fd of the map called @name in the loaded object, "unwind_targets"
+ * for unwind_filter__set() or "stack_sizes" for
+ * machine__publish_stack_sizes(). Owned by @capture.
+ */
+int capture__map_fd(struct capture *capture, const char *name)
+{
+    return bpf_object__find_map_fd_by_name(capture->skel->obj, name);
+}
+
+/* The ring buffer records come out of, e.g. for pipeline__attach_ringbuf(). */
+ringbuf_t *capture__ringbuf(struct capture *capture)
+{
+    return capture->rb;
+}
+
+int capture__poll(struct capture *capture, int timeout,
+                  ringbuf_cb_t cb, void *cookie)
+{
+    return ringbuf__poll(capture->rb, timeout, cb, cookie);
+}
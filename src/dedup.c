@@ -0,0 +1,190 @@
+#include "libdw_bpf.h"
+#include "hash.h"
+#include "utility.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Must match unwind_ctx__hash() in bpf/unwind_ctx.h. */
+#define UNWIND_DEDUP_WORDS         8
+#define UNWIND_DEDUP_FNV_OFFSET    0xcbf29ce484222325ULL
+#define UNWIND_DEDUP_FNV_PRIME     0x100000001b3ULL
+
+#define CALLCHAIN_COUNTS__MIN_BITS 10
+
+/*
+ * One deduplicated callchain. Counts that arrive before the record
+ * they belong to, which happens when the two outputs are read in a
+ * different order, wait with ips still NULL.
+ */
+struct callchain_count {
+    u64 hash;
+    pid_t tgid;
+    int depth;
+    u64 *ips;
+    u64 count;
+    bool used;
+};
+
+struct callchain_counts {
+    struct callchain_count *table;
+    unsigned int bits;
+    unsigned int nr;
+};
+
+/*
+ * The key the program dedups an event by. Only the part of the top
+ * words that was shipped can be hashed, the rest counts as zero just
+ * like in the kernel when the read faults. Stacks shallower than the
+ * words the kernel read may then hash differently, which only costs
+ * that callchain a separate entry.
+ */
+u64 unwind_ctx__hash(const struct unwind_ctx *uc)
+{
+    u64 words[UNWIND_DEDUP_WORDS] = { 0 };
+    u64 hash = UNWIND_DEDUP_FNV_OFFSET;
+    size_t len = sizeof(words);
+    int i;
+
+    if (uc->size > 0 && (size_t)uc->size < len)
+        len = uc->size;
+    if (uc->size > 0)
+        memcpy(words, uc->data, len);
+
+    hash = (hash ^ uc->tgid) * UNWIND_DEDUP_FNV_PRIME;
+    hash = (hash ^ uc->uregs.ip) * UNWIND_DEDUP_FNV_PRIME;
+    for (i = 0; i < UNWIND_DEDUP_WORDS; i++)
+        hash = (hash ^ words[i]) * UNWIND_DEDUP_FNV_PRIME;
+
+    return hash;
+}
+
+callchain_counts_t *callchain_counts__new(void)
+{
+    struct callchain_counts *cc = xcalloc(1, sizeof(*cc));
+
+    cc->bits = CALLCHAIN_COUNTS__MIN_BITS;
+    cc->table = xcalloc(1U << cc->bits, sizeof(*cc->table));
+
+    return cc;
+}
+
+void callchain_counts__delete(callchain_counts_t *cc)
+{
+    unsigned int i;
+
+    if (!cc)
+        return;
+
+    for (i = 0; i < 1U << cc->bits; i++)
+        free(cc->table[i].ips);
+    free(cc->table);
+    free(cc);
+}
+
+static struct callchain_count *
+__callchain_counts__slot(struct callchain_count *table, unsigned int bits,
+                         u64 hash)
+{
+    unsigned int mask = (1U << bits) - 1;
+    unsigned int i = hash_64(hash, bits);
+
+    while (table[i].used && table[i].hash != hash)
+        i = (i + 1) & mask;
+
+    return &table[i];
+}
+
+static void callchain_counts__grow(struct callchain_counts *cc)
+{
+    struct callchain_count *old = cc->table;
+    unsigned int i, old_size = 1U << cc->bits;
+
+    cc->bits++;
+    cc->table = xcalloc(1U << cc->bits, sizeof(*cc->table));
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].used)
+            *__callchain_counts__slot(cc->table, cc->bits, old[i].hash) = old[i];
+    }
+    free(old);
+}
+
+static struct callchain_count *
+callchain_counts__findnew(struct callchain_counts *cc, u64 hash, pid_t tgid)
+{
+    struct callchain_count *slot;
+
+    /* Keep the load under 3/4. */
+    if ((cc->nr + 1) * 4 > 3U << cc->bits)
+        callchain_counts__grow(cc);
+
+    slot = __callchain_counts__slot(cc->table, cc->bits, hash);
+    if (!slot->used) {
+        slot->used = true;
+        slot->hash = hash;
+        slot->tgid = tgid;
+        cc->nr++;
+    }
+
+    return slot;
+}
+
+/*
+ * Account the full record @uc, resolved to @st, as one event. The
+ * first record of a callchain keeps a copy of @st, later ones, one per
+ * dedup window, just add to its count.
+ */
+int callchain_counts__add(callchain_counts_t *cc,
+                          const struct unwind_ctx *uc,
+                          const struct stacktrace *st)
+{
+    struct callchain_count *slot;
+
+    slot = callchain_counts__findnew(cc, unwind_ctx__hash(uc), uc->tgid);
+    slot->count++;
+
+    if (!slot->ips && st->depth > 0) {
+        slot->ips = xmalloc(st->depth * sizeof(u64));
+        memcpy(slot->ips, st->ips, st->depth * sizeof(u64));
+        slot->depth = st->depth;
+    }
+
+    return 0;
+}
+
+/* Merge a struct unwind_count from the program's unwind_counts output. */
+int callchain_counts__add_count(callchain_counts_t *cc,
+                                const struct unwind_count *count)
+{
+    struct callchain_count *slot;
+
+    slot = callchain_counts__findnew(cc, count->hash, count->tgid);
+    slot->count += count->count;
+
+    return 0;
+}
+
+/*
+ * Call @cb for every callchain with its total, counts still waiting
+ * for their record are skipped. Stops at, and returns, the first non
+ * zero return of @cb.
+ */
+int callchain_counts__for_each(callchain_counts_t *cc,
+                               callchain_counts_cb_t cb, void *cookie)
+{
+    struct callchain_count *slot;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < 1U << cc->bits; i++) {
+        slot = &cc->table[i];
+        if (!slot->used || !slot->ips)
+            continue;
+
+        ret = cb(slot->tgid, slot->ips, slot->depth, slot->count, cookie);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
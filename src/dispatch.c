@@ -0,0 +1,425 @@
+#include "dispatch.h"
+#include "machine.h"
+#include "event.h"
+#include "hash.h"
+#include "utility.h"
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#define DISPATCH__TABLE_MIN    64
+
+static void dispatch_table__init(struct dispatch_table *table,
+                                 unsigned int nr_slots)
+{
+    table->slots = xcalloc(nr_slots, sizeof(*table->slots));
+    table->mask = nr_slots - 1;
+    table->nr = 0;
+}
+
+static void dispatch_table__exit(struct dispatch_table *table)
+{
+    free(table->slots);
+}
+
+static struct dispatch_route *
+dispatch_table__find(struct dispatch_table *table, pid_t tgid)
+{
+    unsigned int i = hash_32(tgid, ilog2(table->mask + 1));
+
+    for (; table->slots[i].used; i = (i + 1) & table->mask) {
+        if (table->slots[i].tgid == tgid)
+            return &table->slots[i];
+    }
+
+    return NULL;
+}
+
+/* @tgid must not be in @table yet. */
+static struct dispatch_route *
+__dispatch_table__insert(struct dispatch_table *table, pid_t tgid)
+{
+    unsigned int i = hash_32(tgid, ilog2(table->mask + 1));
+
+    while (table->slots[i].used)
+        i = (i + 1) & table->mask;
+
+    table->slots[i].used = true;
+    table->slots[i].tgid = tgid;
+    table->nr++;
+
+    return &table->slots[i];
+}
+
+/*
+ * Rebuild @table at a size fit for its live entries. With @prune the
+ * routes nothing was sent to during the last interval are dropped, a
+ * tgid that shows up again later is placed from scratch.
+ */
+static void dispatch_table__rehash(struct dispatch_table *table, bool prune)
+{
+    struct dispatch_table old = *table;
+    unsigned int i;
+
+    dispatch_table__init(table, max(roundup_pow_of_two(old.nr * 4),
+                                    (unsigned int)DISPATCH__TABLE_MIN));
+
+    for (i = 0; i <= old.mask; i++) {
+        struct dispatch_route *route = &old.slots[i];
+
+        if (!route->used || (prune && !route->nr))
+            continue;
+
+        *__dispatch_table__insert(table, route->tgid) = *route;
+    }
+
+    dispatch_table__exit(&old);
+}
+
+static struct dispatch_route *
+dispatch_table__insert(struct dispatch_table *table, pid_t tgid)
+{
+    if (table->nr + 1 > (table->mask + 1) / 2)
+        dispatch_table__rehash(table, false);
+
+    return __dispatch_table__insert(table, tgid);
+}
+
+/*
+ * Spin for a while before going to sleep, a producer that is in the
+ * middle of a burst refills the ring faster than a futex round trip.
+ */
+static void dispatch_worker__park(struct dispatch_worker *worker)
+{
+    struct dispatcher *dispatcher = worker->dispatcher;
+    int i;
+
+    for (i = 0; i < DISPATCH__SPIN; i++) {
+        if (spsc_ring__count(worker->ring) ||
+            atomic_load_explicit(&dispatcher->stop, memory_order_relaxed))
+            return;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    atomic_store(&worker->sleeping, true);
+    /*
+     * Pairs with the fence in dispatch_worker__wake(): either we see
+     * the entry that was just committed or the producer sees us asleep.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!spsc_ring__count(worker->ring) && !atomic_load(&dispatcher->stop))
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    atomic_store(&worker->sleeping, false);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void dispatch_worker__wake(struct dispatch_worker *worker)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&worker->sleeping, memory_order_relaxed))
+        return;
+
+    pthread_mutex_lock(&worker->lock);
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void dispatch_worker__resolve(struct dispatch_worker *worker,
+                                     struct unwind_ctx *uc)
+{
+    struct dispatcher *dispatcher = worker->dispatcher;
+    int ret;
+
+    /* Moved to another worker or gone quiet, maybe exited. */
+    if (uc->size == DISPATCH__FORGET) {
+        machine__remove_process(worker->machine, uc->tgid);
+        return;
+    }
+
+    /*
+     * The first event of a tgid that was routed here, either new or
+     * moved over from another worker, maps it into our own machine,
+     * later ones remap it if it mapped more or the tgid was reused.
+     */
+    machine__prepare_thread(worker->machine, uc->tgid, uc->tid, uc->uregs.ip);
+
+    ret = __resolver__resolve(worker->resolver, worker->machine, uc);
+
+    if (dispatcher->opts.callback)
+        dispatcher->opts.callback(uc, &worker->resolver->st, ret,
+                                  dispatcher->opts.cookie);
+}
+
+static void *dispatch_worker__run(void *arg)
+{
+    struct dispatch_worker *worker = arg;
+    struct dispatcher *dispatcher = worker->dispatcher;
+    struct unwind_ctx *uc;
+
+    for (;;) {
+        uc = spsc_ring__peek(worker->ring);
+        if (uc) {
+            dispatch_worker__resolve(worker, uc);
+            spsc_ring__consume(worker->ring);
+            continue;
+        }
+
+        /* Drain what was queued before the stop, then leave. */
+        if (atomic_load(&dispatcher->stop) && !spsc_ring__peek(worker->ring))
+            break;
+
+        dispatch_worker__park(worker);
+    }
+
+    return NULL;
+}
+
+static int dispatch_worker__init(struct dispatch_worker *worker,
+                                 struct dispatcher *dispatcher)
+{
+    struct machine_opts opts = {
+        .threading = MACHINE_THREADING_SINGLE,
+        .dsos      = dispatcher->dsos,
+    };
+
+    worker->dispatcher = dispatcher;
+    worker->ring = spsc_ring__new(dispatcher->opts.ring_size,
+                                  sizeof(struct unwind_ctx));
+    worker->machine = machine__new_opts(&opts);
+    worker->resolver = __resolver__new(dispatcher->opts.max_depth);
+    atomic_init(&worker->sleeping, false);
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    return pthread_create(&worker->thread, NULL, dispatch_worker__run, worker);
+}
+
+static void dispatch_worker__exit(struct dispatch_worker *worker)
+{
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    resolver__delete(worker->resolver);
+    machine__delete(worker->machine);
+    spsc_ring__delete(worker->ring);
+}
+
+static struct dispatch_worker *dispatcher__idlest(struct dispatcher *dispatcher)
+{
+    struct dispatch_worker *idlest = &dispatcher->workers[0];
+    unsigned int i;
+
+    for (i = 1; i < dispatcher->nr_workers; i++) {
+        struct dispatch_worker *worker = &dispatcher->workers[i];
+
+        if (worker->nr < idlest->nr ||
+            (worker->nr == idlest->nr && worker->nr_tgids < idlest->nr_tgids))
+            idlest = worker;
+    }
+
+    return idlest;
+}
+
+static inline u64 dispatch__dist(u64 a, u64 b)
+{
+    return a > b ? a - b : b - a;
+}
+
+/* Queue @uc for @worker, waiting for room rather than losing it. */
+static void dispatch_worker__queue(struct dispatch_worker *worker,
+                                   const struct unwind_ctx *uc, int size)
+{
+    struct unwind_ctx *entry;
+
+    while (!(entry = spsc_ring__reserve(worker->ring))) {
+        dispatch_worker__wake(worker);
+        sched_yield();
+    }
+
+    memcpy(entry, uc, size);
+    spsc_ring__commit(worker->ring);
+    dispatch_worker__wake(worker);
+}
+
+/* Have the worker @tgid was routed to drop it from its machine. */
+static void dispatcher__forget(struct dispatcher *dispatcher,
+                               struct dispatch_route *route)
+{
+    struct unwind_ctx forget = {
+        .tgid = route->tgid,
+        .size = DISPATCH__FORGET,
+    };
+
+    dispatch_worker__queue(&dispatcher->workers[route->worker], &forget,
+                           offsetof(struct unwind_ctx, data));
+}
+
+/*
+ * Only whole tgids ever move, so a process is resolved by one worker
+ * at a time, apart from the few events still queued on the old one
+ * while it is handed over. If the busiest worker got noticeably more
+ * events than the idlest one during the last interval, move the tgid
+ * that brings the two closest together. A tgid that is the busiest
+ * worker's only load stays where it is, moving it gains nothing.
+ */
+static void dispatcher__rebalance(struct dispatcher *dispatcher)
+{
+    struct dispatch_worker *busiest = &dispatcher->workers[0], *idlest;
+    struct dispatch_route *best = NULL;
+    unsigned int i;
+    u64 gap;
+
+    for (i = 1; i < dispatcher->nr_workers; i++) {
+        if (dispatcher->workers[i].nr > busiest->nr)
+            busiest = &dispatcher->workers[i];
+    }
+    idlest = dispatcher__idlest(dispatcher);
+
+    gap = busiest->nr - idlest->nr;
+    if (busiest == idlest || gap * 4 < busiest->nr)
+        goto out;
+
+    for (i = 0; i <= dispatcher->routes.mask; i++) {
+        struct dispatch_route *route = &dispatcher->routes.slots[i];
+
+        if (!route->used || route->worker != busiest - dispatcher->workers)
+            continue;
+        /* Moving more than the gap would just flip the imbalance. */
+        if (route->nr >= gap)
+            continue;
+        if (!best || dispatch__dist(2 * route->nr, gap) <
+                     dispatch__dist(2 * best->nr, gap))
+            best = route;
+    }
+
+    if (best) {
+        dispatcher__forget(dispatcher, best);
+        best->worker = idlest - dispatcher->workers;
+        busiest->nr_tgids--;
+        idlest->nr_tgids++;
+    }
+
+out:
+    for (i = 0; i <= dispatcher->routes.mask; i++) {
+        struct dispatch_route *route = &dispatcher->routes.slots[i];
+
+        /* Forget tgids that went quiet. */
+        if (route->used && !route->nr) {
+            dispatcher->workers[route->worker].nr_tgids--;
+            dispatcher__forget(dispatcher, route);
+        }
+    }
+    dispatch_table__rehash(&dispatcher->routes, true);
+
+    for (i = 0; i <= dispatcher->routes.mask; i++)
+        dispatcher->routes.slots[i].nr = 0;
+    for (i = 0; i < dispatcher->nr_workers; i++)
+        dispatcher->workers[i].nr = 0;
+}
+
+/*
+ * Queue a copy of @uc, of which only the first @size bytes are valid,
+ * for the worker that owns its tgid. Only one thread may push, usually
+ * the one polling the perf buffer. If the worker's ring is full this
+ * waits for room rather than losing the event.
+ */
+int dispatcher__push(struct dispatcher *dispatcher,
+                     const struct unwind_ctx *uc, int size)
+{
+    struct dispatch_worker *worker;
+    struct dispatch_route *route;
+    struct unwind_ctx *entry;
+
+    if (size < (int)offsetof(struct unwind_ctx, data) || uc->size < 0)
+        return -EINVAL;
+    size = min(size, (int)sizeof(*uc));
+
+    route = dispatch_table__find(&dispatcher->routes, uc->tgid);
+    if (!route) {
+        worker = dispatcher__idlest(dispatcher);
+        route = dispatch_table__insert(&dispatcher->routes, uc->tgid);
+        route->worker = worker - dispatcher->workers;
+        route->nr = 0;
+        worker->nr_tgids++;
+    }
+    worker = &dispatcher->workers[route->worker];
+    route->nr++;
+    worker->nr++;
+
+    while (!(entry = spsc_ring__reserve(worker->ring))) {
+        dispatch_worker__wake(worker);
+        sched_yield();
+    }
+
+    memcpy(entry, uc, size);
+    if (entry->size > size - (int)offsetof(struct unwind_ctx, data))
+        entry->size = size - offsetof(struct unwind_ctx, data);
+    spsc_ring__commit(worker->ring);
+    dispatch_worker__wake(worker);
+
+    /* With one worker this only forgets the tgids that went quiet. */
+    if (++dispatcher->nr_pushed % DISPATCH__REBALANCE_INTERVAL == 0)
+        dispatcher__rebalance(dispatcher);
+
+    return 0;
+}
+
+struct dispatcher *dispatcher__new(const struct dispatcher_opts *opts)
+{
+    struct dispatcher *dispatcher;
+    unsigned int i, nr_workers = opts->nr_workers ? opts->nr_workers : 1;
+
+    dispatcher = xzalloc_aligned(alignof(*dispatcher),
+                                 sizeof(*dispatcher) +
+                                 nr_workers * sizeof(dispatcher->workers[0]));
+    dispatcher->opts = *opts;
+    dispatcher->opts.ring_size = roundup_pow_of_two(opts->ring_size ?
+                                                    opts->ring_size :
+                                                    DISPATCH__RING_SIZE);
+    if (dispatcher->opts.max_depth < 1)
+        dispatcher->opts.max_depth = DISPATCH__MAX_DEPTH;
+    dispatcher->dsos = opts->dsos ? dsos__get(opts->dsos) : dsos__new();
+    atomic_init(&dispatcher->stop, false);
+    dispatch_table__init(&dispatcher->routes, DISPATCH__TABLE_MIN);
+
+    for (i = 0; i < nr_workers; i++) {
+        if (dispatch_worker__init(&dispatcher->workers[i], dispatcher)) {
+            dispatch_worker__exit(&dispatcher->workers[i]);
+            break;
+        }
+        dispatcher->nr_workers++;
+    }
+
+    if (dispatcher->nr_workers != nr_workers) {
+        dispatcher__delete(dispatcher);
+        return NULL;
+    }
+
+    return dispatcher;
+}
+
+/*
+ * Every event pushed so far is resolved and called back before the
+ * workers exit.
+ */
+void dispatcher__delete(struct dispatcher *dispatcher)
+{
+    unsigned int i;
+
+    if (!dispatcher)
+        return;
+
+    atomic_store(&dispatcher->stop, true);
+
+    for (i = 0; i < dispatcher->nr_workers; i++) {
+        struct dispatch_worker *worker = &dispatcher->workers[i];
+
+        dispatch_worker__wake(worker);
+        pthread_join(worker->thread, NULL);
+        dispatch_worker__exit(worker);
+    }
+
+    dispatch_table__exit(&dispatcher->routes);
+    dsos__put(dispatcher->dsos);
+    free(dispatcher);
+}
@@ -0,0 +1,67 @@
+#ifndef __DISPATCH_H_
+#define __DISPATCH_H_
+
+#include "types.h"
+#include "ring.h"
+#include "stdatomic.h"
+#include "libdw_bpf.h"
+#include "resolver.h"
+#include <pthread.h>
+
+/* Events routed between two rebalancing passes. */
+#define DISPATCH__REBALANCE_INTERVAL    4096
+#define DISPATCH__RING_SIZE             256
+#define DISPATCH__MAX_DEPTH             64
+#define DISPATCH__SPIN                  1024
+
+/*
+ * unwind_ctx.size of a ring entry that tells the worker to forget the
+ * tgid, queued behind the tgid's last events.
+ */
+#define DISPATCH__FORGET                -1
+
+/* tgid -> worker, only ever touched by the producer. */
+struct dispatch_route {
+    pid_t tgid;
+    int worker;
+    u32 nr;        /* events routed this interval */
+    bool used;
+};
+
+struct dispatch_table {
+    struct dispatch_route *slots;
+    unsigned int mask;
+    unsigned int nr;
+};
+
+struct dispatch_worker {
+    cache_aligned(struct spsc_ring *ring);
+    struct dispatcher *dispatcher;
+    machine_t *machine;        /* only ever touched by this worker */
+    struct resolver *resolver;
+    pthread_t thread;
+
+    /* Parking, see dispatch_worker__park(). */
+    atomic_bool sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Producer side. */
+    u64 nr;                    /* events routed this interval */
+    unsigned int nr_tgids;
+};
+
+struct dispatcher {
+    struct dispatcher_opts opts;
+    struct dsos *dsos;
+    atomic_bool stop;
+
+    /* Producer side. */
+    struct dispatch_table routes;
+    u64 nr_pushed;
+
+    unsigned int nr_workers;
+    struct dispatch_worker workers[0];
+};
+
+#endif // __DISPATCH_H_
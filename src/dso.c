@@ -1,9 +1,12 @@
 #include "dso.h"
+#include "libdw_bpf.h"
 #include "map.h"
 #include "list.h"
 #include "rbtree.h"
 #include "symbol.h"
 #include "utility.h"
+#include "machine.h"
+#include "log.h"
 #include <string.h>
 #include <pthread.h>
 #include <libgen.h>
@@ -142,28 +145,54 @@ static void dso__set_basename(struct dso *dso)
        dso__set_short_name(dso, base, true);
 }
 
-static struct dso *dso__new(const char *name)
+static struct dso *dso__new(const char *name, bool threaded)
 {
      struct dso *dso = xcalloc(1, sizeof(*dso) + strlen(name) + 1);
 
      strcpy(dso->name, name);
      dso__set_long_name(dso, dso->name, false);
      dso__set_short_name(dso, dso->name, false);
-     dso->data.cache = RB_ROOT;
+     dso->data.cache = NULL;
      dso->data.fd = -1;
-     dso->data.status = DSO_DATA_STATUS_UNKNOWN;
+     atomic_init(&dso->data.status, DSO_DATA_STATUS_UNKNOWN);
      RB_CLEAR_NODE(&dso->rb_node);
      dso->root = NULL;
      INIT_LIST_HEAD(&dso->node);
-     pthread_mutex_init(&dso->lock, NULL);
+     mutex_init(&dso->lock, threaded);
      refcount_set(&dso->refcnt, 1);
 
      return dso;
 }
 
+static void dso_cache__free(struct dso *dso)
+{
+     u64 i;
+
+     if (!dso->data.cache)
+          return;
+
+     for (i = 0; i < dso->data.nr_pages; i++)
+          free(atomic_load_explicit(&dso->data.cache[i],
+                                    memory_order_relaxed));
+     free(dso->data.cache);
+     dso->data.cache = NULL;
+}
+
 static void dso__delete(struct dso *dso)
 {
+     assert(RB_EMPTY_NODE(&dso->rb_node));
+
+     dso_cache__free(dso);
+     if (dso->data.fd >= 0)
+          close(dso->data.fd);
 
+     if (dso->short_name_allocated)
+          free((char *)dso->short_name);
+     if (dso->long_name_allocated)
+          free((char *)dso->long_name);
+
+     mutex_destroy(&dso->lock);
+     free(dso);
 }
 
 struct dso *dso__get(struct dso *dso)
@@ -188,16 +217,14 @@ static int do_open(char *name)
 {
      int fd;
 
-     fd = open(name, O_RDONLY);
+     fd = open(name, O_RDONLY | O_CLOEXEC);
      if (fd >= 0)
           return fd;
 
-     /* FIXME: not thread-safe */
-     fprintf(stderr, "dso open failed: %s\n", strerror(errno));
+     fd = -errno;
+     pr_warning("dso open %s failed: %s\n", name, strerror(-fd));
 
-     assert(0);
-
-     return -1;
+     return fd;
 }
 
 /**
@@ -214,9 +241,14 @@ static int open_dso(struct dso *dso)
 
      dso__read_binary_type_filename(dso, name, PATH_MAX);
 
-     assert(is_regular_file(name));
-
-     fd = do_open(name);
+     /*
+      * Maps straight from perf records also name [vdso], [heap],
+      * //anon and files deleted since, none of which can be read.
+      */
+     if (is_regular_file(name))
+          fd = do_open(name);
+     else
+          fd = -ENOENT;
 
      free(name);
      return fd;
@@ -224,15 +256,55 @@ static int open_dso(struct dso *dso)
 
 static void try_to_open_dso(struct dso *dso)
 {
-     if (dso->data.fd >= 0)
-          return;
+     int status = DSO_DATA_STATUS_ERROR;
+     struct stat st;
 
      dso->data.fd = open_dso(dso);
 
-     if (dso->data.fd >= 0)
-          dso->data.status = DSO_DATA_STATUS_OK;
-     else
-          dso->data.status = DSO_DATA_STATUS_ERROR;
+     do {
+          if (dso->data.fd < 0)
+               break;
+
+          if (fstat(dso->data.fd, &st) < 0) {
+               // FIXME: strerror not thread-safe
+               fprintf(stderr, "dso cache fstat failed: %s\n", strerror(errno));
+               break;
+          }
+
+          dso->data.file_size = st.st_size;
+          dso->data.nr_pages  = (st.st_size + DSO__DATA_CACHE_SIZE - 1) /
+                                DSO__DATA_CACHE_SIZE;
+          dso->data.cache     = xcalloc(dso->data.nr_pages ?: 1,
+                                        sizeof(*dso->data.cache));
+          status = DSO_DATA_STATUS_OK;
+     } while (0);
+
+     /* Publishes everything above to lock-free readers. */
+     atomic_store_explicit(&dso->data.status, status, memory_order_release);
+}
+
+/*
+ * Open the data file once, resolvers that race here wait for the
+ * winner instead of opening it again.
+ */
+static int dso__data_open(struct dso *dso)
+{
+     int status;
+
+     status = atomic_load_explicit(&dso->data.status, memory_order_acquire);
+     if (likely(status == DSO_DATA_STATUS_OK))
+          return 0;
+     if (status == DSO_DATA_STATUS_ERROR)
+          return -1;
+
+     mutex_lock(&dso->lock);
+     if (atomic_load_explicit(&dso->data.status, memory_order_relaxed) ==
+         DSO_DATA_STATUS_UNKNOWN)
+          try_to_open_dso(dso);
+     mutex_unlock(&dso->lock);
+
+     status = atomic_load_explicit(&dso->data.status, memory_order_acquire);
+     return status == DSO_DATA_STATUS_OK ? 0 : -1;
 }
 
 /**
@@ -246,11 +318,9 @@ static void try_to_open_dso(struct dso *dso)
  */
 int dso__data_get_fd(struct dso *dso, struct machine *machine __maybe_unused)
 {
-     if (dso->data.status == DSO_DATA_STATUS_ERROR)
+     if (dso__data_open(dso))
           return -1;
 
-     try_to_open_dso(dso);
-
      return dso->data.fd;
 }
 
@@ -258,65 +328,6 @@ void dso__data_put_fd(struct dso *dso __maybe_unused)
 {
 }
 
-static struct dso_cache *dso_cache__find(struct dso *dso, u64 offset)
-{
-     const struct rb_root *root = &dso->data.cache;
-     struct rb_node * const *p = &root->rb_node;
-     const struct rb_node *parent = NULL;
-     struct dso_cache *cache;
-
-     while (*p != NULL) {
-          u64 end;
-
-          parent = *p;
-          cache = rb_entry(parent, struct dso_cache, rb_node);
-          end = cache->offset + DSO__DATA_CACHE_SIZE;
-
-          if (offset < cache->offset)
-               p = &(*p)->rb_left;
-          else if (offset >= end)
-               p = &(*p)->rb_right;
-          else
-               return cache;
-     }
-
-     return NULL;
-}
-
-static struct dso_cache *
-dso_cache__insert(struct dso *dso, struct dso_cache *new)
-{
-     struct rb_root *root = &dso->data.cache;
-     struct rb_node **p = &root->rb_node;
-     struct rb_node *parent = NULL;
-     struct dso_cache *cache;
-     u64 offset = new->offset;
-
-     pthread_mutex_lock(&dso->lock);
-     while (*p != NULL) {
-          u64 end;
-
-          parent = *p;
-          cache = rb_entry(parent, struct dso_cache, rb_node);
-          end = cache->offset + DSO__DATA_CACHE_SIZE;
-
-          if (offset < cache->offset)
-               p = &(*p)->rb_left;
-          else if (offset >= end)
-               p = &(*p)->rb_right;
-          else
-               goto out;
-     }
-
-     rb_link_node(&new->rb_node, parent, p);
-     rb_insert_color(&new->rb_node, root);
-
-     cache = NULL;
-out:
-     pthread_mutex_unlock(&dso->lock);
-     return cache;
-}
-
 static ssize_t
 dso_cache__memcpy(struct dso_cache *cache, u64 offset,
                   u8 *data, u64 size)
@@ -328,70 +339,59 @@ dso_cache__memcpy(struct dso_cache *cache, u64 offset,
      return cache_size;
 }
 
-static ssize_t
-dso_cache__read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
+/*
+ * Pages are read once and never dropped while the dso lives, so
+ * publishing them with a CAS is all the locking readers need. Whoever
+ * loses the race frees its copy and uses the winner's.
+ */
+static struct dso_cache *dso_cache__read(struct dso *dso, u64 page,
+                                         struct unwind_stats *stats)
 {
-     struct dso_cache *cache;
-     struct dso_cache *old;
+     struct dso_cache *cache, *old = NULL;
      ssize_t ret;
 
-     do {
-          u64 cache_offset;
-
-          cache = xmalloc(sizeof(*cache) + DSO__DATA_CACHE_SIZE);
-          if (!cache)
-               return -ENOMEM;
-
-          /*
-           * dso->data.fd might be closed if other thread opened another
-           * file (dso) due to open file limit (RLIMIT_NOFILE).
-           * TODO: support close file because of RLIMIT_NOFILE
-           */
-          try_to_open_dso(dso);
+     cache = xmalloc(sizeof(*cache) + DSO__DATA_CACHE_SIZE);
+     cache->offset = page * DSO__DATA_CACHE_SIZE;
 
-          if (dso->data.fd < 0) {
-               ret = -errno;
-               dso->data.status = DSO_DATA_STATUS_ERROR;
-               break;
-          }
-
-          cache_offset = offset & DSO__DATA_CACHE_MASK;
-
-          ret = pread(dso->data.fd, cache->data, DSO__DATA_CACHE_SIZE, cache_offset);
-          if (ret <= 0)
-               break;
-
-          cache->offset = cache_offset;
-          cache->size   = ret;
-     } while (0);
-
-     if (ret > 0) {
-          old = dso_cache__insert(dso, cache);
-          if (old) {
-               /* we lose the race */
-               free(cache);
-               cache = old;
-          }
-
-          ret = dso_cache__memcpy(cache, offset, data, size);
+     ret = pread(dso->data.fd, cache->data, DSO__DATA_CACHE_SIZE,
+                 cache->offset);
+     if (ret <= 0) {
+          free(cache);
+          return NULL;
      }
+     cache->size = ret;
+     unwind_stats__add(&stats->dso_cache_bytes, ret);
 
-     if (ret <= 0)
+     if (!atomic_compare_exchange_strong(&dso->data.cache[page], &old, cache)) {
+          /* we lose the race */
           free(cache);
+          cache = old;
+     }
 
-     return ret;
+     return cache;
 }
 
 static ssize_t
-dso_cache_read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
+dso_cache_read(struct dso *dso, struct unwind_stats *stats,
+               u64 offset, u8 *data, ssize_t size)
 {
+     u64 page = offset / DSO__DATA_CACHE_SIZE;
      struct dso_cache *cache;
 
-     cache = dso_cache__find(dso, offset);
-     if (cache)
-          return dso_cache__memcpy(cache, offset, data, size);
-     else
-          return dso_cache__read(dso, offset, data, size);
+     if (offset >= dso->data.file_size)
+          return 0;
+
+     cache = atomic_load_explicit(&dso->data.cache[page], memory_order_acquire);
+     if (!cache) {
+          unwind_stats__add(&stats->dso_cache_misses, 1);
+          cache = dso_cache__read(dso, page, stats);
+          if (!cache)
+               return -EIO;
+     } else {
+          unwind_stats__add(&stats->dso_cache_hits, 1);
+     }
+
+     return dso_cache__memcpy(cache, offset, data, size);
 }
 
 /*
@@ -399,7 +399,8 @@ dso_cache_read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
  * in the rb_tree. Any read to already cached data is served
  * by cached data.
  */
-static ssize_t cached_read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
+static ssize_t cached_read(struct dso *dso, struct unwind_stats *stats,
+                           u64 offset, u8 *data, ssize_t size)
 {
      ssize_t r = 0;
      u8 *p = data;
@@ -407,7 +408,7 @@ static ssize_t cached_read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
      do {
           ssize_t ret;
 
-          ret = dso_cache_read(dso, offset, p, size);
+          ret = dso_cache_read(dso, stats, offset, p, size);
           if (ret < 0)
                return ret;
 
@@ -427,46 +428,11 @@ static ssize_t cached_read(struct dso *dso, u64 offset, u8 *data, ssize_t size)
      return r;
 }
 
-static int data_file_size(struct dso *dso)
-{
-     int ret = 0;
-     struct stat st;
-
-     if (dso->data.file_size)
-          return 0;
-
-     if (dso->data.status == DSO_DATA_STATUS_ERROR)
-          return -1;
-
-     /*
-      * dso->data.fd might be closed if other thread opened another
-      * file (dso) due to open file limit (RLIMIT_NOFILE).
-      */
-     try_to_open_dso(dso);
-
-     if (dso->data.fd < 0) {
-          ret = -errno;
-          dso->data.status = DSO_DATA_STATUS_ERROR;
-          goto out;
-     }
-
-     if (fstat(dso->data.fd, &st) < 0) {
-          ret = -errno;
-          // FIXME: strerror not thread-safe
-          fprintf(stderr, "dso cache fstat failed: %s\n", strerror(errno));
-          dso->data.status = DSO_DATA_STATUS_ERROR;
-          goto out;
-     }
-     dso->data.file_size = st.st_size;
-
-out:
-     return ret;
-}
-
 static ssize_t
-data_read_offset(struct dso *dso, u64 offset, u8 *data, ssize_t size)
+data_read_offset(struct dso *dso, struct unwind_stats *stats,
+                 u64 offset, u8 *data, ssize_t size)
 {
-     if (data_file_size(dso))
+     if (dso__data_open(dso))
           return -1;
 
      /* Check the offset sanity. */
@@ -476,7 +442,7 @@ data_read_offset(struct dso *dso, u64 offset, u8 *data, ssize_t size)
      if (offset + size < offset)
           return -1;
 
-     return cached_read(dso, offset, data, size);
+     return cached_read(dso, stats, offset, data, size);
 }
 
 /**
@@ -490,14 +456,10 @@ data_read_offset(struct dso *dso, u64 offset, u8 *data, ssize_t size)
  * External interface to read data from dso file offset. Open
  * dso data file and use cached_read to get the data.
  */
-ssize_t dso__data_read_offset(struct dso *dso,
-                              struct machine *machine __maybe_unused,
+ssize_t dso__data_read_offset(struct dso *dso, struct machine *machine,
                               u64 offset, u8 *data, ssize_t size)
 {
-     if (dso->data.status == DSO_DATA_STATUS_ERROR)
-          return -1;
-
-     return data_read_offset(dso,offset, data, size);
+     return data_read_offset(dso, machine__stats(machine), offset, data, size);
 }
 
 /**
@@ -576,7 +538,7 @@ struct dso *dsos__find(struct dsos *dsos, const char *name, bool cmp_short)
 
 struct dso *__dsos__addnew(struct dsos *dsos, const char *name)
 {
-     struct dso *dso = dso__new(name);
+     struct dso *dso = dso__new(name, dsos->threaded);
 
      if (dso != NULL) {
           __dsos__add(dsos, dso);
@@ -602,3 +564,73 @@ struct dso *dsos__findnew(struct dsos *dsos, const char *name)
      up_write(&dsos->lock);
      return dso;
 }
+
+void dsos__init(struct dsos *dsos, bool threaded)
+{
+     INIT_LIST_HEAD(&dsos->head);
+     dsos->root = RB_ROOT;
+     dsos->threaded = threaded;
+     init_rwsem(&dsos->lock, threaded);
+     refcount_set(&dsos->refcnt, 1);
+}
+
+static void dsos__purge(struct dsos *dsos)
+{
+     struct dso *pos, *n;
+
+     down_write(&dsos->lock);
+
+     list_for_each_entry_safe(pos, n, &dsos->head, node) {
+          RB_CLEAR_NODE(&pos->rb_node);
+          pos->root = NULL;
+          list_del_init(&pos->node);
+          dso__put(pos);
+     }
+
+     up_write(&dsos->lock);
+}
+
+void dsos__exit(struct dsos *dsos)
+{
+     dsos__purge(dsos);
+     exit_rwsem(&dsos->lock);
+}
+
+struct dsos *__dsos__new(bool threaded)
+{
+     struct dsos *dsos = xcalloc(1, sizeof(*dsos));
+
+     dsos__init(dsos, threaded);
+     return dsos;
+}
+
+/*
+ * A store handed to several machines through machine_opts.dsos. Each
+ * of them keeps its own threads and maps, but the DSOs behind those
+ * maps, with their open file, cached pages and eh_frame_hdr lookup,
+ * exist once per process instead of once per machine. Machines may
+ * resolve on different threads, so a shared store is always locked.
+ */
+struct dsos *dsos__new(void)
+{
+     return __dsos__new(true);
+}
+
+struct dsos *dsos__get(struct dsos *dsos)
+{
+     if (dsos)
+          refcount_inc(&dsos->refcnt);
+     return dsos;
+}
+
+/*
+ * Maps hold their own reference to the DSO they cover, so dropping the
+ * store only drops the lookup index, DSOs still mapped somewhere stay.
+ */
+void dsos__put(struct dsos *dsos)
+{
+     if (dsos && refcount_dec_and_test(&dsos->refcnt)) {
+          dsos__exit(dsos);
+          free(dsos);
+     }
+}
@@ -6,6 +6,8 @@
 #include "rbtree.h"
 #include "refcount.h"
 #include "rwsem.h"
+#include "mutex.h"
+#include "stdatomic.h"
 #include <stdlib.h>
 
 enum dso_data_status {
@@ -21,12 +23,13 @@ struct machine;
 #define DSO__DATA_CACHE_MASK ~(DSO__DATA_CACHE_SIZE - 1)
 
 struct dso_cache {
-    struct rb_node rb_node;
     u64 offset;
     u64 size;
     char data[0];
 };
 
+typedef _Atomic(struct dso_cache *) atomic_dso_cache_ptr;
+
 /*
  * DSOs are put into both a list for fast iteration and rbtree for fast
  * long name lookup.
@@ -35,8 +38,17 @@ struct dsos {
     struct list_head head;
     struct rb_root root; /* rbtree root sorted by long name */
     struct rw_semaphore lock;
+    bool threaded;
+    refcount_t refcnt;   /* one per attached machine, see dsos__new() */
 };
 
+void dsos__init(struct dsos *dsos, bool threaded);
+void dsos__exit(struct dsos *dsos);
+
+struct dsos *__dsos__new(bool threaded);
+struct dsos *dsos__get(struct dsos *dsos);
+void dsos__put(struct dsos *dsos);
+
 struct dso *dsos__findnew(struct dsos *dsos, const char *name);
 struct dso *__dsos__find(struct dsos *dsos,
                          const char *name,
@@ -48,18 +60,22 @@ struct dso *__dsos__addnew(struct dsos *dsos,
                            const char *name);
 
 struct dso {
-    pthread_mutex_t lock;
+    struct mutex lock;        /* serializes opening the data file */
     struct list_head node;
     struct rb_node   rb_node;    /* rbtree node sorted by long name */
     struct rb_root   *root;      /* root of rbtree that rb_node is in */
 
-    /* dso data file */
+    /*
+     * dso data file, everything but status is set once while opening
+     * and only read after status is seen as DSO_DATA_STATUS_OK.
+     */
     struct {
-        struct rb_root cache;
+        atomic_dso_cache_ptr *cache; /* one slot per cache page */
+        u64 nr_pages;
         int fd;
-        int status;
+        atomic_int status;
         size_t file_size;
-        u64 eh_frame_hdr_offset;
+        atomic_uint_least64_t eh_frame_hdr_offset;
     } data;
 
     const char *short_name;
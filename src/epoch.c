@@ -0,0 +1,183 @@
+#include "epoch.h"
+#include <assert.h>
+
+/*
+ * Objects retired while the global epoch was E may still be in use by
+ * readers that entered during E - 1 or E, once the global epoch has
+ * moved two steps further nobody can see them any more.
+ */
+#define EPOCH__GRACE    2
+
+static void epoch_record__release(void *arg)
+{
+     struct epoch_record *rec = arg;
+
+     /*
+      * Whatever is still pending stays on the record, the next thread
+      * that picks it up or epoch__exit() will run it.
+      */
+     assert(rec->nest == 0);
+     atomic_store_explicit(&rec->in_use, false, memory_order_release);
+}
+
+int epoch__init(struct epoch *epoch, bool threaded)
+{
+     atomic_init(&epoch->global, 1);
+     atomic_init(&epoch->records, NULL);
+     epoch->threaded = threaded;
+     epoch->dying = false;
+
+     if (!threaded)
+          return 0;
+
+     return pthread_key_create(&epoch->key, epoch_record__release);
+}
+
+static void epoch_record__run(struct epoch_record *rec, u64 upto)
+{
+     struct epoch_head *head = rec->pending, *last = NULL, *next;
+
+     while (head && head->epoch + EPOCH__GRACE <= upto) {
+          last = head;
+          head = head->next;
+     }
+
+     if (!last)
+          return;
+
+     /*
+      * Detach what is ready before running it, callbacks dropping the
+      * last reference to something else queue more work on @rec.
+      */
+     next = rec->pending;
+     last->next = NULL;
+     rec->pending = head;
+     if (!head)
+          rec->pending_tail = &rec->pending;
+
+     for (head = next; head; head = next) {
+          next = head->next;
+          --rec->nr_pending;
+          head->func(head);
+     }
+}
+
+/*
+ * Callers must make sure nobody is inside a read section any more,
+ * every callback that is still pending runs here.
+ */
+void epoch__exit(struct epoch *epoch)
+{
+     struct epoch_record *rec, *next;
+
+     epoch->dying = true;
+
+     if (!epoch->threaded)
+          return;
+
+     pthread_key_delete(epoch->key);
+
+     rec = atomic_load(&epoch->records);
+     for (; rec; rec = next) {
+          next = rec->next;
+          epoch_record__run(rec, ~0ULL - EPOCH__GRACE);
+          free(rec);
+     }
+}
+
+struct epoch_record *__epoch__record(struct epoch *epoch)
+{
+     struct epoch_record *rec = pthread_getspecific(epoch->key);
+     struct epoch_record *head;
+
+     if (likely(rec))
+          return rec;
+
+     head = atomic_load_explicit(&epoch->records, memory_order_acquire);
+     for (rec = head; rec; rec = rec->next) {
+          bool in_use = false;
+
+          if (atomic_compare_exchange_strong(&rec->in_use, &in_use, true))
+               goto out;
+     }
+
+     rec = xzalloc_aligned(alignof(*rec), sizeof(*rec));
+     atomic_init(&rec->state, 0);
+     atomic_init(&rec->in_use, true);
+     rec->pending_tail = &rec->pending;
+
+     do {
+          rec->next = head;
+     } while (!atomic_compare_exchange_weak(&epoch->records, &head, rec));
+out:
+     pthread_setspecific(epoch->key, rec);
+     return rec;
+}
+
+/*
+ * Move the global epoch forward if every reader that is inside a
+ * section has already seen the current one.
+ */
+static u64 epoch__try_advance(struct epoch *epoch)
+{
+     /*
+      * Acquire, if somebody else did the advancing we need to see the
+      * readers' sections as they did before freeing anything.
+      */
+     u64 global = atomic_load_explicit(&epoch->global, memory_order_acquire);
+     struct epoch_record *rec;
+
+     atomic_thread_fence(memory_order_seq_cst);
+
+     rec = atomic_load_explicit(&epoch->records, memory_order_acquire);
+     /*
+      * Acquire pairs with the release in epoch__read_unlock(), whatever
+      * a reader did in its last section happens before we move on.
+      */
+     for (; rec; rec = rec->next) {
+          u64 state = atomic_load_explicit(&rec->state, memory_order_acquire);
+
+          if ((state & 1) && (state >> 1) != global)
+               return global;
+     }
+
+     if (atomic_compare_exchange_strong(&epoch->global, &global, global + 1))
+          return global + 1;
+     return global;
+}
+
+void __epoch__collect(struct epoch *epoch, struct epoch_record *rec)
+{
+     epoch_record__run(rec, epoch__try_advance(epoch));
+}
+
+void epoch__call(struct epoch *epoch, struct epoch_head *head,
+                 void (*func)(struct epoch_head *head))
+{
+     struct epoch_record *rec;
+
+     if (!epoch->threaded || epoch->dying) {
+          func(head);
+          return;
+     }
+
+     rec = __epoch__record(epoch);
+
+     head->func  = func;
+     head->next  = NULL;
+     /*
+      * The stamp has to be read after @head was unlinked, a plain load
+      * may pass the unlinking store and stamp the object one epoch too
+      * early. An RMW orders the two and heads a release sequence that
+      * readers entering the next epoch acquire.
+      */
+     head->epoch = atomic_fetch_add_explicit(&epoch->global, 0,
+                                             memory_order_acq_rel);
+
+     *rec->pending_tail = head;
+     rec->pending_tail = &head->next;
+     ++rec->nr_pending;
+
+     if (!rec->nest)
+          __epoch__collect(epoch, rec);
+}
@@ -0,0 +1,99 @@
+#ifndef __EPOCH_H_
+#define __EPOCH_H_
+
+#include "types.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include <pthread.h>
+
+/*
+ * Epoch based reclamation, roughly call_rcu() for userspace.
+ *
+ * Readers bracket their accesses with epoch__read_lock() and
+ * epoch__read_unlock() and may then use pointers they loaded from
+ * shared structures without taking a reference. Writers unlink an
+ * object and hand it to epoch__call(), @func runs once every reader
+ * that could still see it has left its section.
+ *
+ * A machine created with MACHINE_THREADING_SINGLE has no concurrent
+ * readers, read sections are no-ops and callbacks run right away.
+ */
+
+struct epoch_head {
+     struct epoch_head *next;
+     u64 epoch;
+     void (*func)(struct epoch_head *head);
+};
+
+/* One per thread that ever entered a read section of this domain. */
+struct epoch_record {
+     cache_aligned(atomic_ullong state);   /* epoch << 1 | active */
+     atomic_bool in_use;
+     struct epoch_record *next;
+
+     /* Only ever touched by the owning thread. */
+     unsigned int nest;
+     unsigned int nr_pending;
+     struct epoch_head *pending;
+     struct epoch_head **pending_tail;
+};
+
+typedef _Atomic(struct epoch_record *) atomic_epoch_record_ptr;
+
+struct epoch {
+     atomic_ullong global;
+     atomic_epoch_record_ptr records;
+     pthread_key_t key;
+     bool threaded;
+     bool dying;
+};
+
+int epoch__init(struct epoch *epoch, bool threaded);
+void epoch__exit(struct epoch *epoch);
+
+struct epoch_record *__epoch__record(struct epoch *epoch);
+void __epoch__collect(struct epoch *epoch, struct epoch_record *rec);
+
+static inline void epoch__read_lock(struct epoch *epoch)
+{
+     struct epoch_record *rec;
+     u64 global;
+
+     if (!epoch->threaded)
+          return;
+
+     rec = __epoch__record(epoch);
+     if (rec->nest++)
+          return;
+
+     /*
+      * Release so that an advancer seeing us in the new section also
+      * sees everything we did in the previous one, the fence orders
+      * the announcement before any load inside the section.
+      */
+     global = atomic_load_explicit(&epoch->global, memory_order_acquire);
+     atomic_store_explicit(&rec->state, global << 1 | 1, memory_order_release);
+     atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void epoch__read_unlock(struct epoch *epoch)
+{
+     struct epoch_record *rec;
+
+     if (!epoch->threaded)
+          return;
+
+     rec = __epoch__record(epoch);
+     if (--rec->nest)
+          return;
+
+     atomic_store_explicit(&rec->state, 0, memory_order_release);
+
+     if (unlikely(rec->nr_pending))
+          __epoch__collect(epoch, rec);
+}
+
+void epoch__call(struct epoch *epoch, struct epoch_head *head,
+                 void (*func)(struct epoch_head *head));
+
+#endif // __EPOCH_H_
@@ -6,6 +6,7 @@
 #include "libdw_bpf.h"
 #include "unwind.h"
 #include <assert.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <inttypes.h>
@@ -15,34 +16,54 @@
 #define debug(args...)    ""
 #endif
 
-typedef int (*event__handler_t)(struct machine *machine,
-                                struct mmap2_event *event);
+#define MAPS__SYNTHESIZE_NS    1000000000ULL
 
-static int bpf_unwind_ctx__process_mmap(struct machine *machine,
-                                       struct mmap2_event *event)
+/*
+ * Add the mapping @event describes to its process, dropping whatever
+ * it replaces. Used for the /proc snapshot and for MMAP2 records alike.
+ */
+int machine__process_mmap2_event(struct machine *machine,
+                                 struct mmap2_event *event)
 {
     struct thread *thread;
     struct map *map;
+    int ret;
 
     debug("bpf_unwind_ctx_process_map, tgid: %d, tid: %d\n",
           event->tgid, event->tid);
     thread = machine__findnew_thread(machine, event->tgid, event->tid);
-    assert(thread != NULL);
+    if (thread == NULL)
+        return -ENOMEM;
 
     map = map__new(machine, thread, event);
 
+    /*
+     * Overlapping an existing map is fine, after an mprotect() split
+     * or a re-mmap, maps__insert() replaces what it covers.
+     */
     debug("process_mmap, insert new map: %s\n", event->filename);
-    assert(!thread__insert_map(thread, map));
+    ret = thread__insert_map(thread, map);
+    if (ret)
+        debug("process_mmap, can't insert %s: %d\n", event->filename, ret);
     thread__put(thread);
     map__put(map);
 
-    return 0;
+    return ret;
 }
 
-static int bpf_unwind_ctx_prepare_mmap(struct machine *machine,
-                                       struct mmap2_event *event,
-                                       pid_t tgid, pid_t tid,
-                                       event__handler_t process)
+static int machine__synthesized_mmap2(void *machine,
+                                      struct mmap2_event *event)
+{
+    return machine__process_mmap2_event(machine, event);
+}
+
+/*
+ * Call @process with an MMAP2 event for every executable mapping of
+ * @tgid in /proc, @event is the buffer they're built in.
+ */
+int mmap2_events__synthesize(struct mmap2_event *event,
+                             pid_t tgid, pid_t tid,
+                             event__handler_t process, void *priv)
 {
     char filename[PATH_MAX];
     FILE *fp;
@@ -120,7 +141,7 @@ static int bpf_unwind_ctx_prepare_mmap(struct machine *machine,
         event->tgid = tgid;
         event->tid = tid;
 
-        process(machine, event);
+        process(priv, event);
     }
 
     debug("handle map_event cost: %llu\n", rdclock() - t);
@@ -130,33 +151,170 @@ static int bpf_unwind_ctx_prepare_mmap(struct machine *machine,
     return rc;
 }
 
+/*
+ * A thread changed its name, or, with @exec, the process replaced its
+ * image. All its old mappings are gone then, the new ones follow as
+ * MMAP2 records.
+ */
+int machine__process_comm_event(struct machine *machine, pid_t tgid,
+                                pid_t tid, const char *comm, bool exec)
+{
+    struct thread *thread;
+
+    epoch__read_lock(&machine->epoch);
+
+    thread = machine__borrow_thread(machine, tgid, tid);
+    if (thread) {
+        thread__set_comm(thread, comm);
+        if (exec) {
+            maps__remove_all(thread->maps);
+            unwind__flush_access(thread);
+        }
+    }
+
+    epoch__read_unlock(&machine->epoch);
+
+    return thread ? 0 : -ENOMEM;
+}
+
+/*
+ * @tgid/@tid was forked by @ptgid/@ptid and inherits its name. A new
+ * process gets copies of its parent's maps, a new thread shares its
+ * leader's anyway.
+ */
+int machine__process_fork_event(struct machine *machine, pid_t ptgid,
+                                pid_t ptid, pid_t tgid, pid_t tid)
+{
+    struct thread *parent, *child;
+    int ret = 0;
+
+    /* Whatever had the tid before is long gone. */
+    machine__remove_thread(machine, tgid, tid);
+
+    epoch__read_lock(&machine->epoch);
+
+    parent = machine__borrow_thread(machine, ptgid, ptid);
+    child = machine__borrow_thread(machine, tgid, tid);
+    if (parent && child) {
+        char comm[TASK_COMM_LEN];
+
+        thread__comm(parent, comm);
+        thread__set_comm(child, comm);
+        if (tgid == tid && tgid != ptgid)
+            maps__clone(child->maps, parent->maps);
+    } else {
+        ret = -ENOMEM;
+    }
+
+    epoch__read_unlock(&machine->epoch);
+
+    return ret;
+}
+
+int machine__process_exit_event(struct machine *machine, pid_t tgid,
+                                pid_t tid)
+{
+    machine__remove_thread(machine, tgid, tid);
+    return 0;
+}
+
 int bpf_unwind_ctx__thread_map(struct machine *machine, pid_t tgid, pid_t tid)
 {
     struct mmap2_event *event;
+    struct thread *thread;
     int ret = 0;
 
+    /* Every map goes to the process's maps, index them once. */
+    thread = machine__findnew_thread(machine, tgid, tid);
+    if (thread == NULL)
+        return -ENOMEM;
+    maps__begin_batch(thread->maps);
+
     event = xmalloc(sizeof(*event));
-    ret = bpf_unwind_ctx_prepare_mmap(machine, event, tgid, tid,
-                                      bpf_unwind_ctx__process_mmap);
+    ret = mmap2_events__synthesize(event, tgid, tid,
+                                   machine__synthesized_mmap2, machine);
     free(event);
 
+    maps__end_batch(thread->maps);
+    thread__put(thread);
+
     return ret;
 }
 
-int bpf_unwind_ctx__resolve_callchain(struct stacktrace *st,
-                                      struct machine *machine,
-                                      struct unwind_ctx *uc)
+/*
+ * Read @tgid's maps from /proc if @ip isn't in them: processes that
+ * were running before capture started had no MMAP2 records, others
+ * mapped more since, e.g. by dlopen(). Only the resolver that claims
+ * the maps reads them, at most once a second, the others go on with
+ * what is there, so a process that exited doesn't send every one of
+ * its records to /proc.
+ */
+void machine__prepare_thread(struct machine *machine, pid_t tgid, pid_t tid,
+                             u64 ip)
 {
     struct thread *thread;
+    bool claimed = false;
+    u64 last, now;
+
+    epoch__read_lock(&machine->epoch);
+    thread = machine__borrow_thread(machine, tgid, tid);
+    if (thread && !maps__find(thread->maps, ip)) {
+        now = rdclock();
+        last = atomic_load_explicit(&thread->maps->synthesized,
+                                    memory_order_relaxed);
+        if (!last || now - last >= MAPS__SYNTHESIZE_NS)
+            claimed = atomic_compare_exchange_strong(&thread->maps->synthesized,
+                                                     &last, now);
+    }
+    epoch__read_unlock(&machine->epoch);
+
+    if (claimed)
+        bpf_unwind_ctx__thread_map(machine, tgid, tid);
+}
+
+/*
+ * Unwind @sample of @tgid/@tid into @st. @comm, if any, renames the
+ * thread on the way.
+ */
+int machine__resolve_sample(struct machine *machine, pid_t tgid, pid_t tid,
+                            const char *comm,
+                            const struct unwind_sample *sample,
+                            struct stacktrace *st)
+{
+    struct thread *thread;
+    int ret;
+
+    /*
+     * Everything the unwinder touches, the thread, its maps and their
+     * dsos, is borrowed for the duration of the read section.
+     */
+    epoch__read_lock(&machine->epoch);
 
-    thread = machine__findnew_thread(machine, uc->tgid, uc->tid);
+    thread = machine__borrow_thread(machine, tgid, tid);
     assert(thread != NULL);
 
-    if (!thread->addr_space)
-        unwind__prepare_access(thread, NULL, NULL);
-    thread__set_comm(thread, uc->name);
+    if (comm)
+        thread__set_comm(thread, comm);
 
-    return unwind__get_entries(NULL, NULL, thread, uc, st);
+    ret = unwind__get_entries(NULL, NULL, thread, sample, st);
+
+    epoch__read_unlock(&machine->epoch);
+
+    return ret;
+}
+
+int bpf_unwind_ctx__resolve_callchain(struct stacktrace *st,
+                                      struct machine *machine,
+                                      struct unwind_ctx *uc)
+{
+    struct unwind_sample sample = {
+        .regs = &uc->uregs,
+        .stack = uc->data,
+        .size = uc->size > 0 ? uc->size : 0,
+    };
+
+    return machine__resolve_sample(machine, uc->tgid, uc->tid, uc->name,
+                                   &sample, st);
 }
 
 int bpf_dl_iterate_phdr(machine_t *machine, pid_t tgid,
@@ -166,19 +324,23 @@ int bpf_dl_iterate_phdr(machine_t *machine, pid_t tgid,
     struct thread *thread;
     struct map *pos;
     struct dl_phdr_info info;
-    int ret;
+    int ret = 0;
 
     thread = machine__findnew_thread(machine, tgid, tgid);
     assert(thread != NULL);
 
+    down_read(&thread->maps->lock);
     list_for_each_entry(pos, &thread->maps->head, node) {
         info.start_addr = pos->start;
         info.end_addr = pos->end;
         info.dlpi_name = pos->dso->name;
-        ret = __callback(&info, ctx);
-        if (ret < 0)
-            return -1;
+        if (__callback(&info, ctx) < 0) {
+            ret = -1;
+            break;
+        }
     }
+    up_read(&thread->maps->lock);
 
-    return 0;
+    thread__put(thread);
+    return ret;
 }
@@ -5,6 +5,8 @@
 #include "utility.h"
 
 struct unwind_ctx;
+struct unwind_sample;
+struct stacktrace;
 struct machine;
 
 struct mmap2_event {
@@ -21,4 +23,24 @@ struct mmap2_event {
     char filename[PATH_MAX];
 };
 
+typedef int (*event__handler_t)(void *priv, struct mmap2_event *event);
+
+int mmap2_events__synthesize(struct mmap2_event *event,
+                             pid_t tgid, pid_t tid,
+                             event__handler_t process, void *priv);
+int machine__process_mmap2_event(struct machine *machine,
+                                 struct mmap2_event *event);
+int machine__process_comm_event(struct machine *machine, pid_t tgid,
+                                pid_t tid, const char *comm, bool exec);
+int machine__process_fork_event(struct machine *machine, pid_t ptgid,
+                                pid_t ptid, pid_t tgid, pid_t tid);
+int machine__process_exit_event(struct machine *machine, pid_t tgid,
+                                pid_t tid);
+void machine__prepare_thread(struct machine *machine, pid_t tgid, pid_t tid,
+                             u64 ip);
+int machine__resolve_sample(struct machine *machine, pid_t tgid, pid_t tid,
+                            const char *comm,
+                            const struct unwind_sample *sample,
+                            struct stacktrace *st);
+
 #endif // __EVENT_H_
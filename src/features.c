@@ -0,0 +1,119 @@
+#include "libdw_bpf.h"
+#include "bpf_syscall.h"
+#include "utility.h"
+#include <stdio.h>
+#include <sys/utsname.h>
+
+#ifndef BPF_FUNC_probe_read_user
+# define BPF_FUNC_probe_read_user    112
+#endif
+
+#define KERNEL_VERSION(a, b, c)    (((a) << 16) + ((b) << 8) + ((c) > 255 ? 255 : (c)))
+
+/*
+ * patches/bpf.patch inserts its helper in the middle of enum
+ * bpf_func_id, so it can't be probed by number. Its symbols show in
+ * kallsyms even where the addresses are hidden.
+ */
+static bool kernel__has_read_stack(void)
+{
+    char line[256];
+    bool found = false;
+    FILE *fp;
+
+    fp = fopen("/proc/kallsyms", "r");
+    if (!fp)
+        return false;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, " bpf_probe_read_stack")) {
+            found = true;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+/* Kprobe programs had to carry the running kernel's version before 5.0. */
+static u32 kernel__version(void)
+{
+    unsigned int major = 0, minor = 0, patch = 0;
+    struct utsname uts;
+
+    if (uname(&uts) < 0 ||
+        sscanf(uts.release, "%u.%u.%u", &major, &minor, &patch) < 2)
+        return 0;
+
+    return KERNEL_VERSION(major, minor, patch);
+}
+
+/*
+ * Load a kprobe program that just calls @helper, the way libbpf probes
+ * helpers. The verifier rejects it either way, what matters is whether
+ * it complains about the helper itself or only about its arguments.
+ */
+static int kernel__has_helper(int helper)
+{
+    struct bpf_insn insns[] = {
+        { .code = BPF_JMP | BPF_CALL, .imm = helper },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    char license[] = "GPL";
+    char log[4096] = "";
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_KPROBE;
+    attr.insns = ptr_to_u64(insns);
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = ptr_to_u64(license);
+    attr.kern_version = kernel__version();
+    attr.log_buf = ptr_to_u64(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0) {
+        close(fd);
+        return 1;
+    }
+    if (fd == -EPERM)
+        return fd;
+
+    return !strstr(log, "invalid func ") && !strstr(log, "unknown func ");
+}
+
+/*
+ * How the capture programs should copy user stacks on this kernel:
+ * the patched helper where there is one, page by page reads with the
+ * stock one otherwise. Returns -ENOTSUP on kernels older than 5.5,
+ * or -EPERM if the probe may not load programs.
+ */
+int unwind_read_stack__probe(void)
+{
+    int ret;
+
+    if (kernel__has_read_stack())
+        return UNWIND_READ_STACK_PATCHED;
+
+    ret = kernel__has_helper(BPF_FUNC_probe_read_user);
+    if (ret < 0)
+        return ret;
+
+    return ret ? UNWIND_READ_STACK_USER : -ENOTSUP;
+}
+
+/* The compiler flag that builds bpf/ebpf_get_unwind_ctx*.c for @how. */
+const char *unwind_read_stack__cflag(enum unwind_read_stack how)
+{
+    switch (how) {
+    case UNWIND_READ_STACK_USER:
+        return "-DUNWIND_READ_STACK=1";
+    case UNWIND_READ_STACK_PATCHED:
+    default:
+        return "-DUNWIND_READ_STACK=0";
+    }
+}
@@ -0,0 +1,100 @@
+#include "libdw_bpf.h"
+#include "bpf_syscall.h"
+#include "utility.h"
+#include <stdlib.h>
+#include <dirent.h>
+
+/* Must match struct unwind_target in bpf/unwind_ctx.h. */
+struct unwind_target {
+    u32 rate;
+    u32 flags;
+};
+
+static inline u64 unwind_target__key(enum unwind_target_type type, pid_t id)
+{
+    if (type == UNWIND_TARGET_DEFAULT)
+        id = 0;
+    return (u64)type << 32 | (u32)id;
+}
+
+/*
+ * Find the fd of the BPF map called @name (normally "unwind_targets")
+ * among the fds of this process, so that it can be used whatever
+ * loaded the program. The fd still belongs to the loader, don't close
+ * it. Returns -ENOENT if there is no such map.
+ */
+int unwind_filter__find(const char *name)
+{
+    char path[64], link[64];
+    struct dirent *dent;
+    int fd = -ENOENT;
+    DIR *dir;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -errno;
+
+    while ((dent = readdir(dir)) != NULL) {
+        struct bpf_map_info info;
+        ssize_t n;
+        int cur;
+
+        if (dent->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%s", dent->d_name);
+        n = readlink(path, link, sizeof(link) - 1);
+        if (n < 0)
+            continue;
+        link[n] = '\0';
+        if (strcmp(link, "anon_inode:bpf-map"))
+            continue;
+
+        cur = atoi(dent->d_name);
+        if (sys_bpf_obj_info(cur, &info, sizeof(info)) < 0)
+            continue;
+
+        /* Map names are cut at BPF_OBJ_NAME_LEN - 1 characters. */
+        if (!strncmp(info.name, name, sizeof(info.name) - 1)) {
+            fd = cur;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return fd;
+}
+
+/*
+ * Capture one event in @rate for the tgid or tid @id, every event if
+ * @rate is 1, none if it's 0. Takes effect for the next event, the
+ * program needn't be reloaded.
+ */
+int unwind_filter__set(int map_fd, enum unwind_target_type type,
+                       pid_t id, unsigned int rate)
+{
+    struct unwind_target target = { .rate = rate };
+    u64 key = unwind_target__key(type, id);
+
+    return sys_bpf_map_update(map_fd, &key, &target, BPF_ANY);
+}
+
+/* Let @id fall back to its tgid's, or the default, rate again. */
+int unwind_filter__clear(int map_fd, enum unwind_target_type type, pid_t id)
+{
+    u64 key = unwind_target__key(type, id);
+    int ret = sys_bpf_map_delete(map_fd, &key);
+
+    return ret == -ENOENT ? 0 : ret;
+}
+
+/*
+ * Only ship calls that took at least @ns, see get_unwind_ctx_exit().
+ * @map_fd is the unwind_latency_threshold map, 0 ships every call.
+ */
+int unwind_latency__set_threshold(int map_fd, u64 ns)
+{
+    u32 key = 0;
+
+    return sys_bpf_map_update(map_fd, &key, &ns, BPF_ANY);
+}
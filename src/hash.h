@@ -0,0 +1,33 @@
+#ifndef __HASH_H_
+#define __HASH_H_
+
+#include "types.h"
+
+/*
+ * Multiplicative hashing, see the kernel's include/linux/hash.h. The
+ * high bits of the product are the well mixed ones, so take those.
+ */
+#define GOLDEN_RATIO_32 0x61C88647
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+    return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+static inline u32 hash_64(u64 val, unsigned int bits)
+{
+    return (u32)((val * GOLDEN_RATIO_64) >> (64 - bits));
+}
+
+static inline unsigned int roundup_pow_of_two(unsigned int n)
+{
+    return n <= 1 ? 1 : 1U << (32 - __builtin_clz(n - 1));
+}
+
+static inline unsigned int ilog2(unsigned int n)
+{
+    return 31 - __builtin_clz(n);
+}
+
+#endif // __HASH_H_
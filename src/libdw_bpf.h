@@ -18,13 +18,43 @@ extern "C" {
 #endif
 
 typedef struct machine machine_t;
+typedef struct dsos dsos_t;
 struct map;
 
+/* Why a callchain ends where it does. */
+enum unwind_stop {
+    UNWIND_STOP_END = 0,    /* reached the outermost frame */
+    UNWIND_STOP_DEPTH,      /* filled all of stacktrace.depth */
+    UNWIND_STOP_STACK,      /* needed stack beyond what was captured */
+    UNWIND_STOP_NO_MAP,     /* an ip outside of every known mapping */
+    UNWIND_STOP_NO_CFI,     /* no unwind info for an ip */
+    UNWIND_STOP_BAD_REG,    /* a register the unwind info wants is missing */
+    UNWIND_STOP_ERROR,      /* anything else */
+    UNWIND_STOP__NR,
+};
+
+/* stacktrace.flags */
+#define STACKTRACE_FRAME_POINTERS    (1U << 0)    /* walked without DWARF */
+
+/*
+ * Set up depth and ips, every resolve fills in the frames and the rest.
+ * stack_missing is how many bytes past the captured stack the unwind
+ * wanted to read, whatever it stopped for. Caller ips are return
+ * addresses minus one, so they symbolize to the call.
+ */
 struct stacktrace {
     int depth;
     u64 *ips;
+    enum unwind_stop stop;
+    u32 stack_missing;
+    u32 flags;
 };
 
+/*
+ * Records are only shipped up to the end of the stack that was read,
+ * never look at more than unwind_ctx__size() bytes of one. Copies have
+ * to be made with the size the perf buffer reports, not sizeof().
+ */
 struct unwind_ctx {
     u64 ts;
     u32 tid;
@@ -37,13 +67,328 @@ struct unwind_ctx {
     char data[STACK_SIZE];
 };
 
+#define unwind_ctx__size(uc) \
+    (__builtin_offsetof(struct unwind_ctx, data) + (uc)->size)
+
+/*
+ * A call that took longer than the latency threshold, shipped on
+ * unwind_slow_calls by get_unwind_ctx_exit() with the stack it was
+ * entered with, see UNWIND_CTX_LATENCY in bpf/ebpf_get_unwind_ctx.c.
+ * uc.ts is when the call was entered. Resolve uc like any record.
+ */
+struct unwind_slow_call {
+    u64 latency;    /* ns from entry to exit */
+    struct unwind_ctx uc;
+};
+
+#define unwind_slow_call__size(sc) \
+    (__builtin_offsetof(struct unwind_slow_call, uc) + unwind_ctx__size(&(sc)->uc))
+
 struct dl_phdr_info {
     u64 start_addr;
     u64 end_addr;
     const char *dlpi_name;
 };
 
+#define UNWIND_STATS__FRAMES_BUCKETS     16
+#define UNWIND_STATS__LATENCY_BUCKETS    32
+
+/*
+ * What the unwinds of a machine did. Every resolver thread counts into
+ * its own copy, without locks or shared cache lines, and a read sums
+ * them up. Counters only ever grow, take differences between reads.
+ * Histograms are log2: bucket 0 counts 0 and 1, bucket i [2^i, 2^(i+1)).
+ */
+struct unwind_stats {
+    u64 unwinds;
+    u64 frames;
+    u64 find_proc_info;     /* FDE lookups, libunwind's cache missed */
+    u64 stack_reads;        /* words read from the captured stack */
+    u64 dso_reads;          /* words read from DSO data instead */
+    u64 dso_cache_hits;     /* DSO page cache lookups */
+    u64 dso_cache_misses;
+    u64 dso_cache_bytes;    /* read from DSO files into the cache */
+    u64 maps_find;          /* searches, the last map found is reused */
+    u64 stop[UNWIND_STOP__NR];
+    u64 frames_hist[UNWIND_STATS__FRAMES_BUCKETS];
+    u64 latency_hist[UNWIND_STATS__LATENCY_BUCKETS];    /* ns */
+};
+
+typedef void (*unwind_stats_cb_t)(const struct unwind_stats *stats,
+                                  void *cookie);
+
+typedef void (*unwind_log_cb_t)(const char *msg, void *cookie);
+
+enum machine_threading {
+    /* Only one thread ever touches the machine, nothing is locked. */
+    MACHINE_THREADING_SINGLE = 0,
+    /* Any number of resolver threads may share the machine. */
+    MACHINE_THREADING_CONCURRENT,
+};
+
+struct machine_opts {
+    enum machine_threading threading;
+    /*
+     * DSO store to attach to instead of a private one, see dsos__new().
+     * The machine takes its own reference.
+     */
+    dsos_t *dsos;
+    /*
+     * Called with the summed up stats about every stats_interval ms,
+     * on whichever thread finishes an unwind once that much passed.
+     */
+    unsigned int stats_interval;
+    unwind_stats_cb_t stats_callback;
+    void *stats_cookie;
+};
+
+/*
+ * Sharded resolving: every worker thread owns a machine and the tgids
+ * routed to it, events of one process are always resolved by the same
+ * worker so its maps and unwind caches stay warm on that CPU. Whole
+ * tgids move between workers when the load gets skewed.
+ */
+typedef struct dispatcher dispatcher_t;
+
+typedef void (*dispatcher_cb_t)(const struct unwind_ctx *uc,
+                                struct stacktrace *st, int ret,
+                                void *cookie);
+
+struct dispatcher_opts {
+    unsigned int nr_workers;
+    unsigned int ring_size;    /* events queued per worker, power of two */
+    int max_depth;             /* frames per callchain */
+    dsos_t *dsos;              /* optional, shared by the workers' machines */
+    dispatcher_cb_t callback;  /* called on the worker thread */
+    void *cookie;
+};
+
+/*
+ * Per-thread resolving context that owns the memory of the callchains
+ * it returns, so resolving doesn't allocate. Use one per thread, with
+ * any number of machines.
+ */
+typedef struct resolver resolver_t;
+
+struct resolver_opts {
+    int max_depth;    /* frames per callchain, 0 keeps 64 */
+};
+
+/*
+ * Preallocated record slots for handing records from a capture
+ * callback to resolver threads: perf buffer records are only valid
+ * until the callback returns, copy them into a slot instead of malloc
+ * and free the slot once resolved. Lock-free, any thread may allocate
+ * and free. The ring buffer backends can resolve in place instead.
+ */
+typedef struct unwind_pool unwind_pool_t;
+
+struct unwind_pool_opts {
+    unsigned int nr_slots;    /* 0 keeps 1024 */
+    u32 slot_size;            /* 0 keeps sizeof(struct unwind_ctx) */
+};
+
+/*
+ * Bounded lock-free queue of pointers, any number of threads may push
+ * and pop. Hands records from a poller to a pool of resolver threads,
+ * in batches if they like, see src/unwind_queue.c.
+ */
+typedef struct unwind_queue unwind_queue_t;
+
+/*
+ * Capture to callback in one object, see src/pipeline.c: records are
+ * submitted, or polled from an attached ring buffer, copied into a
+ * pool and resolved by whichever worker is free against one shared
+ * machine. Shuts down in order, every submitted record is called back.
+ */
+typedef struct pipeline pipeline_t;
+
+typedef void (*pipeline_cb_t)(const struct unwind_ctx *uc,
+                              struct stacktrace *st, int ret,
+                              void *cookie);
+
+/*
+ * What a pipeline does once resolving falls behind capture. Memory is
+ * bounded by nr_slots whatever the policy, they only choose which
+ * records are given up, and every one that is shows up in
+ * pipeline_stats.dropped.
+ */
+enum pipeline_policy {
+    PIPELINE_POLICY_DROP_NEWEST = 0,    /* refuse records while full */
+    PIPELINE_POLICY_DROP_OLDEST,        /* evict the oldest queued one */
+    PIPELINE_POLICY_DOWNSAMPLE,         /* over the watermark, keep 1 in
+                                         * downsample records per tid */
+    PIPELINE_POLICY_DEGRADE,            /* over the watermark, only walk
+                                         * frame pointers */
+};
+
+enum pipeline_drop {
+    PIPELINE_DROP_FULL = 0,     /* every slot was taken */
+    PIPELINE_DROP_EVICTED,      /* made room for a newer record */
+    PIPELINE_DROP_SAMPLED,      /* left out by downsampling */
+    PIPELINE_DROP_TOO_BIG,      /* larger than a slot */
+    PIPELINE_DROP_LOST,         /* lost before submit, see pipeline__lost() */
+    PIPELINE_DROP__NR,
+};
+
+/*
+ * Counters only ever grow. Every record submitted is resolved, dropped
+ * or still in flight, lost ones were never submitted. Degraded ones
+ * count as resolved too.
+ */
+struct pipeline_stats {
+    u64 submitted;
+    u64 resolved;
+    u64 degraded;               /* resolved from frame pointers only */
+    u64 dropped[PIPELINE_DROP__NR];
+};
+
+struct pipeline_opts {
+    unsigned int nr_workers;
+    unsigned int nr_slots;     /* records in flight, 0 keeps 1024 */
+    int max_depth;             /* frames per callchain */
+    dsos_t *dsos;              /* optional, shared with other machines */
+    pipeline_cb_t callback;    /* called on a worker thread */
+    void *cookie;
+    enum pipeline_policy policy;
+    unsigned int watermark;    /* % of slots in use, 0 keeps 75 */
+    unsigned int downsample;   /* 0 keeps 4 */
+};
+
+/*
+ * Reader for the BPF_RINGBUF_OUTPUT of bpf/ebpf_get_unwind_ctx_ringbuf.c,
+ * records are passed to the callback in place. A replay ring has the
+ * same layout in plain memory and is filled from userspace, polling it
+ * waits for its submits.
+ */
+typedef struct ringbuf ringbuf_t;
+
+/* @size bytes of @uc are valid, return < 0 to stop consuming. */
+typedef int (*ringbuf_cb_t)(struct unwind_ctx *uc, int size, void *cookie);
+
+/*
+ * Reader for perf.data files recorded with perf record --call-graph
+ * dwarf. Samples come out as struct unwind_ctx records through a
+ * ringbuf_cb_t, the machine is kept up to date from the file alone.
+ */
+typedef struct perf_data perf_data_t;
+
+/*
+ * Called with the cookie of perf_data__process() before a record that
+ * changes maps or threads is applied, if samples went out since the
+ * last call. A callback that hands samples to other threads has to
+ * wait here until they are resolved, or they unwind against the maps
+ * of later in the file.
+ */
+typedef void (*perf_data_barrier_t)(void *cookie);
+
+/*
+ * Record now, unwind later, see src/unwind_file.c. Records are written
+ * to a chunked, deflated file with the maps and DSO build-ids of their
+ * processes, and replayed into a machine from it afterwards.
+ */
+typedef struct unwind_file unwind_file_t;
+
+struct unwind_file_opts {
+    u32 chunk_size;    /* bytes of records per chunk, 0 keeps 1MiB */
+    int level;         /* zlib level, 0 keeps 1, < 0 doesn't deflate */
+    u32 stack_size;    /* keep at most that much stack, 0 keeps it all */
+};
+
+/*
+ * Capture with the precompiled CO-RE program instead of compiling one
+ * with bcc at run time. Only there when the library was built with
+ * -DENABLE_CORE_CAPTURE=ON, needs libbpf and a 5.8+ kernel with BTF.
+ */
+typedef struct capture capture_t;
+struct perf_event_attr;
+
+struct capture_opts {
+    unsigned int ringbuf_pages;    /* power of two, 0 keeps the default 256 */
+};
+
+/*
+ * Sampling without BPF, see src/perf_sampler.c: perf_event_open(2)
+ * copies the user registers and stack, the machine follows the
+ * processes from the same rings. Needs perf_event_paranoid <= 0 for a
+ * whole system, <= 1 for a process of the same user.
+ */
+typedef struct perf_sampler perf_sampler_t;
+
+typedef void (*perf_sampler_cb_t)(pid_t tgid, pid_t tid, u64 time,
+                                  struct stacktrace *st, int ret,
+                                  void *cookie);
+
+struct perf_sampler_opts {
+    u64 sample_freq;          /* Hz, 0 keeps the default 99 */
+    u32 stack_size;           /* bytes per sample, 0 keeps STACK_SIZE */
+    unsigned int mmap_pages;  /* per CPU, power of two, 0 keeps 64 */
+    pid_t pid;                /* with its children, 0 samples everything */
+    int max_depth;            /* frames per callchain */
+    perf_sampler_cb_t callback;
+    void *cookie;
+};
+
+/*
+ * A process sampling itself, see src/self_sampler.c: SIGPROF from a
+ * CPU time timer copies the registers and the stack of whichever
+ * thread it hits, a resolver thread unwinds them. No privileges, no
+ * BPF, for tests and benchmarks of the whole pipeline.
+ */
+typedef struct self_sampler self_sampler_t;
+
+struct self_sampler_opts {
+    u64 sample_freq;          /* Hz of process CPU time, 0 keeps 99 */
+    u32 stack_size;           /* bytes per sample, 0 keeps STACK_SIZE */
+    unsigned int ring_size;   /* samples queued, power of two, 0 keeps 256 */
+    int max_depth;            /* frames per callchain */
+    perf_sampler_cb_t callback;    /* time is CLOCK_MONOTONIC ns */
+    void *cookie;
+};
+
+/*
+ * How the bcc capture programs copy user stacks, see UNWIND_READ_STACK
+ * in bpf/unwind_ctx.h. unwind_read_stack__probe() picks the
+ * best one the running kernel has.
+ */
+enum unwind_read_stack {
+    /* bpf_probe_read_stack() from patches/bpf.patch */
+    UNWIND_READ_STACK_PATCHED = 0,
+    /* stock bpf_probe_read_user(), page by page, 5.5+ */
+    UNWIND_READ_STACK_USER,
+};
+
+/*
+ * Keys of the unwind_targets map, see unwind_target__key() in
+ * bpf/unwind_ctx.h. The id of UNWIND_TARGET_DEFAULT is
+ * ignored, its rate applies to every task without an entry.
+ */
+enum unwind_target_type {
+    UNWIND_TARGET_TGID = 0,
+    UNWIND_TARGET_TID,
+    UNWIND_TARGET_DEFAULT,
+};
+
+/*
+ * In-kernel deduplication, see UNWIND_CTX_DEDUP in
+ * bpf/unwind_ctx.h. Events that repeat a callchain within a
+ * window come out of the unwind_counts output as counts only, merge
+ * them with the full records in a callchain_counts_t.
+ */
+struct unwind_count {
+    u64 hash;     /* unwind_ctx__hash() of the record it belongs to */
+    u32 tid;
+    u32 tgid;
+    u64 count;
+};
+
+typedef struct callchain_counts callchain_counts_t;
+
+typedef int (*callchain_counts_cb_t)(pid_t tgid, const u64 *ips, int depth,
+                                     u64 count, void *cookie);
+
 machine_t *machine__new(void);
+machine_t *machine__new_opts(const struct machine_opts *opts);
 int bpf_unwind_ctx__thread_map(machine_t *machine, pid_t tgid, pid_t tid);
 int bpf_unwind_ctx__resolve_callchain(struct stacktrace *st,
                                       machine_t *machine,
@@ -53,6 +398,125 @@ int bpf_dl_iterate_phdr(machine_t *machine, pid_t tgid,
                         void *ctx);
 void machine__delete(machine_t *machine);
 
+resolver_t *resolver__new(const struct resolver_opts *opts);
+const struct stacktrace *resolver__resolve(resolver_t *resolver,
+                                           machine_t *machine,
+                                           struct unwind_ctx *uc);
+void resolver__delete(resolver_t *resolver);
+
+unwind_pool_t *unwind_pool__new(const struct unwind_pool_opts *opts);
+void *unwind_pool__alloc(unwind_pool_t *pool);
+void *unwind_pool__copy(unwind_pool_t *pool, const void *record, int size);
+void unwind_pool__free(unwind_pool_t *pool, void *record);
+void unwind_pool__delete(unwind_pool_t *pool);
+
+unwind_queue_t *unwind_queue__new(unsigned int size);
+int unwind_queue__push(unwind_queue_t *queue, void *item);
+unsigned int unwind_queue__push_batch(unwind_queue_t *queue,
+                                      void *const *items, unsigned int n);
+void *unwind_queue__pop(unwind_queue_t *queue, int timeout);
+unsigned int unwind_queue__pop_batch(unwind_queue_t *queue,
+                                     void **items, unsigned int n,
+                                     int timeout);
+void unwind_queue__close(unwind_queue_t *queue);
+void unwind_queue__delete(unwind_queue_t *queue);
+
+pipeline_t *pipeline__new(const struct pipeline_opts *opts);
+int pipeline__submit(pipeline_t *pipeline,
+                     const struct unwind_ctx *uc, int size);
+int pipeline__attach_ringbuf(pipeline_t *pipeline, ringbuf_t *rb);
+void pipeline__lost(pipeline_t *pipeline, u64 nr);
+void pipeline__read_stats(pipeline_t *pipeline, struct pipeline_stats *stats);
+machine_t *pipeline__machine(pipeline_t *pipeline);
+void pipeline__delete(pipeline_t *pipeline);
+void machine__read_stats(machine_t *machine, struct unwind_stats *stats);
+void unwind_log__set(unwind_log_cb_t cb, void *cookie, unsigned int rate);
+int machine__publish_stack_sizes(machine_t *machine, int map_fd,
+                                 unsigned int percentile,
+                                 unsigned int headroom);
+
+dsos_t *dsos__new(void);
+void dsos__put(dsos_t *dsos);
+
+dispatcher_t *dispatcher__new(const struct dispatcher_opts *opts);
+int dispatcher__push(dispatcher_t *dispatcher,
+                     const struct unwind_ctx *uc, int size);
+void dispatcher__delete(dispatcher_t *dispatcher);
+
+ringbuf_t *ringbuf__new(int map_fd);
+ringbuf_t *ringbuf__new_replay(size_t size);
+int ringbuf__consume(ringbuf_t *rb, ringbuf_cb_t cb, void *cookie);
+int ringbuf__poll(ringbuf_t *rb, int timeout, ringbuf_cb_t cb, void *cookie);
+struct unwind_ctx *ringbuf__reserve(ringbuf_t *rb, int size);
+void ringbuf__submit(ringbuf_t *rb, struct unwind_ctx *uc);
+void ringbuf__discard(ringbuf_t *rb, struct unwind_ctx *uc);
+int ringbuf__replay(ringbuf_t *rb, const struct unwind_ctx *uc, int size);
+void ringbuf__delete(ringbuf_t *rb);
+
+capture_t *capture__new(const struct capture_opts *opts);
+int capture__attach_kprobe(capture_t *capture, const char *func);
+int capture__attach_uprobe(capture_t *capture, pid_t pid,
+                           const char *binary, const char *func, u64 offset);
+int capture__attach_tracepoint(capture_t *capture,
+                               const char *category, const char *name);
+int capture__attach_perf_event(capture_t *capture,
+                               struct perf_event_attr *attr,
+                               pid_t pid, int cpu);
+int capture__map_fd(capture_t *capture, const char *name);
+ringbuf_t *capture__ringbuf(capture_t *capture);
+int capture__poll(capture_t *capture, int timeout,
+                  ringbuf_cb_t cb, void *cookie);
+void capture__delete(capture_t *capture);
+
+perf_sampler_t *perf_sampler__new(machine_t *machine,
+                                  const struct perf_sampler_opts *opts);
+int perf_sampler__poll(perf_sampler_t *sampler, int timeout);
+u64 perf_sampler__lost(perf_sampler_t *sampler);
+void perf_sampler__delete(perf_sampler_t *sampler);
+
+self_sampler_t *self_sampler__new(machine_t *machine,
+                                  const struct self_sampler_opts *opts);
+u64 self_sampler__lost(self_sampler_t *sampler);
+void self_sampler__delete(self_sampler_t *sampler);
+
+perf_data_t *perf_data__open(const char *path);
+void perf_data__set_barrier(perf_data_t *pd, perf_data_barrier_t barrier);
+int perf_data__process(perf_data_t *pd, machine_t *machine,
+                       ringbuf_cb_t cb, void *cookie);
+void perf_data__close(perf_data_t *pd);
+
+unwind_file_t *unwind_file__create(const char *path,
+                                   const struct unwind_file_opts *opts);
+int unwind_file__write(unwind_file_t *file,
+                       const struct unwind_ctx *uc, int size);
+unwind_file_t *unwind_file__open(const char *path);
+int unwind_file__replay(unwind_file_t *file, machine_t *machine,
+                        ringbuf_cb_t cb, void *cookie);
+int unwind_file__replay_parallel(unwind_file_t *file,
+                                 machine_t *machine, unsigned int nr_threads,
+                                 ringbuf_cb_t cb, void *cookie);
+int unwind_file__close(unwind_file_t *file);
+
+int unwind_read_stack__probe(void);
+const char *unwind_read_stack__cflag(enum unwind_read_stack how);
+
+int unwind_filter__find(const char *name);
+int unwind_filter__set(int map_fd, enum unwind_target_type type,
+                       pid_t id, unsigned int rate);
+int unwind_filter__clear(int map_fd, enum unwind_target_type type, pid_t id);
+int unwind_latency__set_threshold(int map_fd, u64 ns);
+
+u64 unwind_ctx__hash(const struct unwind_ctx *uc);
+callchain_counts_t *callchain_counts__new(void);
+int callchain_counts__add(callchain_counts_t *cc,
+                          const struct unwind_ctx *uc,
+                          const struct stacktrace *st);
+int callchain_counts__add_count(callchain_counts_t *cc,
+                                const struct unwind_count *count);
+int callchain_counts__for_each(callchain_counts_t *cc,
+                               callchain_counts_cb_t cb, void *cookie);
+void callchain_counts__delete(callchain_counts_t *cc);
+
 #ifdef __cplusplus
 }
 #endif
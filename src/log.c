@@ -0,0 +1,80 @@
+#include "log.h"
+#include "libdw_bpf.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#define UNWIND_LOG__RATE    10
+
+static void unwind_log__stderr(const char *msg, void *cookie __maybe_unused)
+{
+    fputs(msg, stderr);
+}
+
+static unwind_log_cb_t unwind_log_cb = unwind_log__stderr;
+static void *unwind_log_cookie;
+static unsigned int unwind_log_rate = UNWIND_LOG__RATE;
+
+/* The second the current budget is for, and how much of it is used. */
+static atomic_uint_least64_t unwind_log_window;
+static atomic_uint unwind_log_used;
+static atomic_uint unwind_log_dropped;
+
+/*
+ * Send the library's warnings to @cb, at most @rate a second, 0 for
+ * the default. What goes over is counted, and the count is added to
+ * the next message that gets through. A NULL @cb drops them all.
+ * Warnings go to stderr at 10 a second until this is called, call it
+ * before resolving.
+ */
+void unwind_log__set(unwind_log_cb_t cb, void *cookie, unsigned int rate)
+{
+    unwind_log_cb = cb;
+    unwind_log_cookie = cookie;
+    unwind_log_rate = rate ? rate : UNWIND_LOG__RATE;
+}
+
+static bool unwind_log__allow(void)
+{
+    struct timespec ts;
+    u64 window;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    window = atomic_load_explicit(&unwind_log_window, memory_order_relaxed);
+    if ((u64)ts.tv_sec != window &&
+         atomic_compare_exchange_strong(&unwind_log_window, &window,
+                                (u64)ts.tv_sec))
+        atomic_store(&unwind_log_used, 0);
+
+    if (atomic_fetch_add(&unwind_log_used, 1) < unwind_log_rate)
+        return true;
+
+    atomic_fetch_add_explicit(&unwind_log_dropped, 1, memory_order_relaxed);
+    return false;
+}
+
+void unwind_log__printf(const char *fmt, ...)
+{
+    char msg[512];
+    unsigned int dropped;
+    va_list ap;
+    int len;
+
+    if (!unwind_log_cb || !unwind_log__allow())
+        return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+
+    dropped = atomic_exchange(&unwind_log_dropped, 0);
+    if (dropped && (size_t)len < sizeof(msg))
+        snprintf(msg + len, sizeof(msg) - len,
+                   "unwind: %u more warnings were dropped\n", dropped);
+
+    unwind_log_cb(msg, unwind_log_cookie);
+}
@@ -0,0 +1,14 @@
+#ifndef __LOG_H_
+#define __LOG_H_
+
+/*
+ * Warnings from paths that can run on every event. They are rate
+ * limited and can be turned off, see unwind_log__set(), so a flood of
+ * bad samples doesn't serialize the resolvers on stderr.
+ */
+void unwind_log__printf(const char *fmt, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+#define pr_warning(fmt, args...)    unwind_log__printf(fmt, ##args)
+
+#endif // __LOG_H_
@@ -3,6 +3,8 @@
 #include "libdw_bpf.h"
 #include "map.h"
 #include "rbtree.h"
+#include "hash.h"
+#include "unwind.h"
 #include <string.h>
 #include <assert.h>
 
@@ -11,44 +13,50 @@
 #define debug(args...)    ""
 #endif
 
-static void dsos__init(struct dsos *dsos)
+#define THREADS__KEY_EMPTY    0ULL
+#define THREADS__KEY_MOVED    (~0ULL)
+#define THREADS__KEY_USED     (1ULL << 32)
+
+/* Set on every slot of a table that is being replaced by a bigger one. */
+#define THREAD__MOVED         ((struct thread *)~0UL)
+
+/* tid 0 and tid -1 are both valid keys, so tag claimed keys. */
+static inline u64 threads__key(pid_t tid)
 {
-    INIT_LIST_HEAD(&dsos->head);
-    dsos->root = RB_ROOT;
-    init_rwsem(&dsos->lock);
+    return (u64)(u32)tid | THREADS__KEY_USED;
 }
 
-static void dsos__purge(struct dsos *dsos)
+static struct threads_table *threads_table__new(unsigned int nr_slots)
 {
-    struct dso *pos, *n;
+    struct threads_table *table;
 
-    down_write(&dsos->lock);
+    table = xcalloc(1, sizeof(*table) + nr_slots * sizeof(table->slots[0]));
+    table->mask = nr_slots - 1;
+    table->limit = nr_slots - nr_slots / 4;
+    atomic_init(&table->used, 0);
 
-    list_for_each_entry_safe(pos, n, &dsos->head, node) {
-        RB_CLEAR_NODE(&pos->rb_node);
-        pos->root = NULL;
-        list_del_init(&pos->node);
-        dso__put(pos);
-    }
+    return table;
+}
 
-    up_write(&dsos->lock);
+static inline struct threads_slot *
+threads_table__first(struct threads_table *table, pid_t tid)
+{
+    return &table->slots[hash_32(tid, ilog2(table->mask + 1))];
 }
 
-static void dsos__exit(struct dsos *dsos)
+static inline struct threads_slot *
+threads_table__next(struct threads_table *table, struct threads_slot *slot)
 {
-    dsos__purge(dsos);
-    exit_rwsem(&dsos->lock);
+    return &table->slots[(slot - table->slots + 1) & table->mask];
 }
 
 static void machine__threads_init(struct machine *machine)
 {
     for (int i = 0; i < THREADS__TABLE_SIZE; i++) {
         struct threads *threads = &machine->threads[i];
-        threads->entries = RB_ROOT;
-        init_rwsem(&threads->lock);
-        threads->nr = 0;
-        INIT_LIST_HEAD(&threads->dead);
-        threads->last_match = NULL;
+        atomic_init(&threads->table, threads_table__new(THREADS__SLOTS_MIN));
+        atomic_init(&threads->nr, 0);
+        mutex_init(&threads->grow_lock, machine->threaded);
     }
 }
 
@@ -59,47 +67,261 @@ struct threads *machine__threads(struct machine *machine, pid_t tid)
     return &machine->threads[(unsigned int)tid % THREADS__TABLE_SIZE];
 }
 
-static void __machine__remove_thread(struct machine *machine, struct thread *th,
-                                     bool lock)
+/*
+ * Somebody is moving @threads to a bigger table, the migration holds
+ * grow_lock for its whole duration so just queue up behind it.
+ */
+static void threads__wait_grow(struct threads *threads)
 {
-     struct threads *threads = machine__threads(machine, th->tid);
+    mutex_lock(&threads->grow_lock);
+    mutex_unlock(&threads->grow_lock);
+}
+
+/*
+ * Replace @old by a table sized for the threads that are still alive.
+ *
+ * Every slot of @old is frozen first: empty keys become
+ * THREADS__KEY_MOVED so nobody claims them any more, and thread
+ * pointers are swapped for THREAD__MOVED so a racing insert or remove
+ * fails its CAS and retries against the new table once it's published.
+ * Lookups may still be walking @old, so it is only freed once they
+ * all left their read sections.
+ */
+static void threads_table__free_rcu(struct epoch_head *head)
+{
+    free(container_of(head, struct threads_table, rcu));
+}
+
+static void threads__grow(struct machine *machine, struct threads *threads,
+                          struct threads_table *old)
+{
+    struct threads_table *table;
+    struct thread **live;
+    unsigned int nr_live = 0, i;
+
+    mutex_lock(&threads->grow_lock);
+
+    if (atomic_load_explicit(&threads->table, memory_order_acquire) != old)
+        goto out;
+
+    live = xmalloc((old->mask + 1) * sizeof(*live));
+
+    for (i = 0; i <= old->mask; i++) {
+        struct threads_slot *slot = &old->slots[i];
+        u64 key = THREADS__KEY_EMPTY;
+        struct thread *th;
+
+        if (atomic_compare_exchange_strong(&slot->key, &key,
+                                           THREADS__KEY_MOVED))
+            continue;
+
+        th = atomic_exchange(&slot->thread, THREAD__MOVED);
+        if (th)
+            live[nr_live++] = th;
+    }
+
+    table = threads_table__new(max(roundup_pow_of_two(nr_live * 4),
+                                   (unsigned int)THREADS__SLOTS_MIN));
+
+    for (i = 0; i < nr_live; i++) {
+        struct threads_slot *slot = threads_table__first(table, live[i]->tid);
+
+        while (atomic_load_explicit(&slot->key, memory_order_relaxed))
+            slot = threads_table__next(table, slot);
+
+        atomic_store_explicit(&slot->key, threads__key(live[i]->tid),
+                              memory_order_relaxed);
+        atomic_store_explicit(&slot->thread, live[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&table->used, nr_live, memory_order_relaxed);
+    free(live);
+
+    atomic_store_explicit(&threads->table, table, memory_order_release);
+
+    epoch__call(&machine->epoch, &old->rcu, threads_table__free_rcu);
+out:
+    mutex_unlock(&threads->grow_lock);
+}
+
+/*
+ * Lock-free lookup, returns the thread published for @tid without
+ * taking a reference. Only valid inside an epoch read section.
+ */
+static struct thread *threads__find(struct threads *threads, pid_t tid)
+{
+    const u64 key = threads__key(tid);
+    struct threads_table *table;
+    struct threads_slot *slot;
+    struct thread *th;
+    u64 k;
+
+again:
+    table = atomic_load_explicit(&threads->table, memory_order_acquire);
+
+    for (slot = threads_table__first(table, tid); ;
+         slot = threads_table__next(table, slot)) {
+        k = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (k == key) {
+            th = atomic_load_explicit(&slot->thread, memory_order_acquire);
+            if (unlikely(th == THREAD__MOVED))
+                break;
+            return th;
+        }
+
+        if (k == THREADS__KEY_EMPTY)
+            return NULL;
+
+        if (unlikely(k == THREADS__KEY_MOVED))
+            break;
+    }
+
+    threads__wait_grow(threads);
+    goto again;
+}
 
-     if (threads->last_match == th)
-          threads->last_match = NULL;
+/*
+ * Publish @th for its tid. Returns @th if it went in, or the thread
+ * that another inserter published first, in which case the caller
+ * still owns @th.
+ */
+static struct thread *threads__insert(struct machine *machine,
+                                      struct threads *threads,
+                                      struct thread *th)
+{
+    const u64 key = threads__key(th->tid);
+    struct threads_table *table;
+    struct threads_slot *slot;
+    struct thread *old;
+    u64 k;
+
+again:
+    table = atomic_load_explicit(&threads->table, memory_order_acquire);
+
+    for (slot = threads_table__first(table, th->tid); ;
+         slot = threads_table__next(table, slot)) {
+        k = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (k == THREADS__KEY_EMPTY) {
+            /*
+             * Reserve room before claiming so that the table can
+             * never fill up, that's what terminates the probe loops.
+             */
+            if (atomic_fetch_add(&table->used, 1) >= table->limit) {
+                atomic_fetch_sub(&table->used, 1);
+                threads__grow(machine, threads, table);
+                goto again;
+            }
+
+            if (atomic_compare_exchange_strong(&slot->key, &k, key))
+                k = key;
+            else
+                atomic_fetch_sub(&table->used, 1);
+        }
+
+        if (unlikely(k == THREADS__KEY_MOVED))
+            break;
+
+        if (k != key)
+            continue;
+
+        old = NULL;
+        if (atomic_compare_exchange_strong(&slot->thread, &old, th)) {
+            atomic_fetch_add(&threads->nr, 1);
+            return th;
+        }
+
+        if (unlikely(old == THREAD__MOVED))
+            break;
+
+        return old;
+    }
+
+    threads__wait_grow(threads);
+    goto again;
+}
+
+/*
+ * Unpublish @th, its slot keeps the key so a later thread reusing the
+ * tid lands in the same place. Returns false if @th wasn't there.
+ */
+static bool threads__remove(struct threads *threads, struct thread *th)
+{
+    const u64 key = threads__key(th->tid);
+    struct threads_table *table;
+    struct threads_slot *slot;
+    struct thread *old;
+    u64 k;
+
+again:
+    table = atomic_load_explicit(&threads->table, memory_order_acquire);
+
+    for (slot = threads_table__first(table, th->tid); ;
+         slot = threads_table__next(table, slot)) {
+        k = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (k == THREADS__KEY_EMPTY)
+            return false;
+
+        if (unlikely(k == THREADS__KEY_MOVED))
+            break;
+
+        if (k != key)
+            continue;
+
+        old = th;
+        if (atomic_compare_exchange_strong(&slot->thread, &old, NULL)) {
+            atomic_fetch_sub(&threads->nr, 1);
+            return true;
+        }
+
+        if (unlikely(old == THREAD__MOVED))
+            break;
+
+        return false;
+    }
+
+    threads__wait_grow(threads);
+    goto again;
+}
+
+static void thread__put_rcu(struct epoch_head *head)
+{
+     thread__put(container_of(head, struct thread, rcu));
+}
+
+static void __machine__remove_thread(struct machine *machine, struct thread *th)
+{
+     struct threads *threads = machine__threads(machine, th->tid);
 
      assert(refcount_read(&th->refcnt) != 0);
-     if (lock)
-          down_write(&threads->lock);
-     rb_erase_init(&th->rb_node, &threads->entries);
-     RB_CLEAR_NODE(&th->rb_node);
-     --threads->nr;
      /*
-      * Move it first to the dead_threads list, then drop the reference,
-      * if this is the last reference, then the thread__delete destructor
-      * will be called and we will remove it from the dead_threads list.
+      * Drop the reference the table held once nobody can be borrowing
+      * it any more, if this is the last one the thread__delete
+      * destructor will be called.
       */
-     list_add_tail(&th->node, &threads->dead);
-     if (lock)
-          up_write(&threads->lock);
-     thread__put(th);
+     if (threads__remove(threads, th))
+          epoch__call(&machine->epoch, &th->rcu, thread__put_rcu);
 }
 
 static void machine__delete_threads(struct machine *machine)
 {
-     struct rb_node *nd;
      int i;
 
      for (i = 0; i < THREADS__TABLE_SIZE; i++) {
           struct threads *threads = &machine->threads[i];
-          down_write(&threads->lock);
-          nd = rb_first(&threads->entries);
-          while (nd) {
-               struct thread *t = rb_entry(nd, struct thread, rb_node);
+          struct threads_table *table;
+          unsigned int j;
+
+          table = atomic_load_explicit(&threads->table, memory_order_acquire);
+          for (j = 0; j <= table->mask; j++) {
+               struct thread *th;
 
-               nd = rb_next(nd);
-               __machine__remove_thread(machine, t, false);
+               th = atomic_load_explicit(&table->slots[j].thread,
+                                         memory_order_acquire);
+               if (th)
+                    __machine__remove_thread(machine, th);
           }
-          up_write(&threads->lock);
      }
 }
 
@@ -110,11 +332,16 @@ static void machine__exit(struct machine *machine)
     if (machine == NULL)
         return;
 
-    dsos__exit(&machine->dsos);
+    /* Runs the deferred thread__put()s of machine__delete_threads(). */
+    epoch__exit(&machine->epoch);
+    dsos__put(machine->dsos);
+    machine_stats__exit(&machine->stats);
 
     for (i = 0; i < THREADS__TABLE_SIZE; i++) {
         struct threads *threads = &machine->threads[i];
-        exit_rwsem(&threads->lock);
+
+        free(atomic_load(&threads->table));
+        mutex_destroy(&threads->grow_lock);
     }
 }
 
@@ -127,159 +354,212 @@ void machine__delete(struct machine *machine)
     }
 }
 
-struct machine *machine__new(void)
+struct machine *machine__new_opts(const struct machine_opts *opts)
 {
-    struct machine *machine = xmalloc(sizeof(*machine));
-    machine__init(machine);
+    struct machine *machine = xzalloc_aligned(alignof(*machine),
+                                              sizeof(*machine));
+    machine__init(machine, opts);
     return machine;
 }
 
-void machine__init(struct machine *machine)
+struct machine *machine__new(void)
+{
+    return machine__new_opts(NULL);
+}
+
+void machine__init(struct machine *machine, const struct machine_opts *opts)
 {
     memset(machine, 0, sizeof(*machine));
-    dsos__init(&machine->dsos);
+    machine->threaded = opts &&
+                        opts->threading == MACHINE_THREADING_CONCURRENT;
+    if (opts && opts->dsos)
+        machine->dsos = dsos__get(opts->dsos);
+    else
+        machine->dsos = __dsos__new(machine->threaded);
+    epoch__init(&machine->epoch, machine->threaded);
+    machine_stats__init(&machine->stats, opts);
     machine__threads_init(machine);
 }
 
-static void machine__update_thread_tgid(struct machine *machine,
-                                       struct thread *th, pid_t tgid)
+static struct thread *____machine__findnew_thread(struct machine *machine,
+                                                  struct threads *threads,
+                                                  pid_t tgid, pid_t tid,
+                                                  bool create)
 {
-    struct thread *leader;
+    struct thread *th, *winner;
 
-    if (tgid == th->tgid)
-        return;
+    th = threads__find(threads, tid);
+    if (th != NULL) {
+        if (th->tgid == tgid || !create)
+            return th;
+        /*
+         * The tid went to another process. A published thread's tgid
+         * and maps never change under its borrowers, it is replaced
+         * by a new thread instead and freed once they are done.
+         */
+        __machine__remove_thread(machine, th);
+    }
 
-    th->tgid = tgid;
+    if (!create)
+        return NULL;
 
-    if (th->tgid == th->tid)
-        return;
+    th = thread__new(tgid, tid);
+    debug("____machine__findnew_thread, tgid: %d, tid: %d\n", tgid, tid);
+    if (th == NULL)
+        return NULL;
 
-    leader = __machine__findnew_thread(machine, th->tgid, th->tgid);
-    if (!leader)
-        goto out_err;
+    /*
+     * Set the maps up before the thread is published, lookups
+     * never see a half initialized thread that way.
+     *
+     * thread__init_maps may call machine__findnew_thread to
+     * find the thread leader, that's fine as we don't hold
+     * anything here.
+     */
+    if (thread__init_maps(th, machine)) {
+        debug("clear thread\n");
+        thread__put(th);
+        return NULL;
+    }
 
-    if (!leader->maps)
-        leader->maps = maps__new(machine);
+    /*
+     * Same for the unwind address space, resolvers sharing the
+     * machine would otherwise race to create it.
+     */
+    if (unwind__prepare_access(th, NULL, NULL)) {
+        thread__put(th);
+        return NULL;
+    }
 
-    if (!leader->maps)
-        goto out_err;
+    /*
+     * The reference from thread__new is the table's, we lost the
+     * race if someone else published the tid in the meantime.
+     */
+    winner = threads__insert(machine, threads, th);
+    if (winner != th) {
+        thread__put(th);
+        th = winner;
+    }
 
-    if (th->maps == leader->maps)
-        return;
+    return th;
+}
 
-    if (th->maps) {
-        if (!maps__empty(th->maps))
-            assert(0);
-        maps__put(th->maps);
-    }
+/**
+ * machine__borrow_thread - Find or create a thread without a reference
+ * @machine: machine object
+ * @tgid: thread group id
+ * @tid: thread id
+ *
+ * The thread stays valid until the caller leaves the epoch read section
+ * it has to be in, that spares the resolve hot path two atomics on the
+ * thread's refcount.
+ */
+struct thread *
+machine__borrow_thread(struct machine *machine, pid_t tgid, pid_t tid)
+{
+    return ____machine__findnew_thread(machine, machine__threads(machine, tid),
+                                       tgid, tid, true);
+}
 
-    th->maps = maps__get(leader->maps);
+struct thread *__machine__findnew_thread(struct machine *machine,
+                                         pid_t tgid, pid_t tid)
+{
+    struct thread *th;
 
-    thread__put(leader);
-    return;
+    epoch__read_lock(&machine->epoch);
+    th = thread__get(machine__borrow_thread(machine, tgid, tid));
+    epoch__read_unlock(&machine->epoch);
 
-out_err:
-    assert(0);
+    return th;
+}
 
-    return;
+struct thread *
+machine__findnew_thread(struct machine *machine, pid_t tgid, pid_t tid)
+{
+    return __machine__findnew_thread(machine, tgid, tid);
 }
 
-static struct thread *____machine__findnew_thread(struct machine *machine,
-                                                  struct threads *threads,
-                                                  pid_t tgid, pid_t tid,
-                                                  bool create)
+/*
+ * The thread exited, forget it. Whoever still borrows or holds it can
+ * go on using it, it's freed once they're done.
+ */
+void machine__remove_thread(struct machine *machine, pid_t tgid, pid_t tid)
 {
-    struct rb_node **p = &threads->entries.rb_node;
-    struct rb_node *parent = NULL;
     struct thread *th;
 
-    /*
-     * Front-end cache - TID lookups come in blocks,
-     * so most of the time we dont have to look up
-     * the full rbtree:
-     */
-    th = threads->last_match;
-    if (th != NULL) {
-        if (th->tid == tid) {
-            machine__update_thread_tgid(machine, th, tgid);
-            return thread__get(th);
-        }
-
-        threads->last_match = NULL;
-    }
-
-    while (*p != NULL) {
-        parent = *p;
-        th = rb_entry(parent, struct thread, rb_node);
+    epoch__read_lock(&machine->epoch);
+    th = ____machine__findnew_thread(machine, machine__threads(machine, tid),
+                                     tgid, tid, false);
+    if (th)
+        __machine__remove_thread(machine, th);
+    epoch__read_unlock(&machine->epoch);
+}
 
-        if (th->tid == tid) {
-            threads->last_match = th;
-            machine__update_thread_tgid(machine, th, tgid);
-            return thread__get(th);
-        }
+/*
+ * Call @fn on every thread of @machine until it returns non-zero, which
+ * is then passed on. The threads are borrowed, @fn runs inside an epoch
+ * read section and must not hang on to them. Threads of a bucket that
+ * is being grown at the same time may be skipped.
+ */
+int machine__for_each_thread(struct machine *machine,
+                             int (*fn)(struct thread *thread, void *priv),
+                             void *priv)
+{
+    int i, ret = 0;
 
-        if (tid < th->tid)
-            p = &(*p)->rb_left;
-        else
-            p = &(*p)->rb_right;
-    }
+    epoch__read_lock(&machine->epoch);
 
-    if (!create)
-        return NULL;
+    for (i = 0; i < THREADS__TABLE_SIZE && !ret; i++) {
+        struct threads_table *table;
+        unsigned int j;
 
-    th = thread__new(tgid, tid);
-    debug("____machine__findnew_thread, tgid: %d, tid: %d\n", tgid, tid);
-    if (th != NULL) {
-        rb_link_node(&th->rb_node, parent, p);
-        rb_insert_color(&th->rb_node, &threads->entries);
+        table = atomic_load_explicit(&machine->threads[i].table,
+                                     memory_order_acquire);
+        for (j = 0; j <= table->mask && !ret; j++) {
+            struct thread *th;
 
-        /*
-         * We have to initialize maps separately
-         * after rb tree is updated.
-         *
-         * The reason is that we call machine__findnew_thread
-         * within thread__init_maps to find the thread
-         * leader and that would screwed the rb tree.
-         */
-        if (thread__init_maps(th, machine)) {
-            debug("clear thread\n");
-            rb_erase_init(&th->rb_node, &threads->entries);
-            RB_CLEAR_NODE(&th->rb_node);
-            thread__put(th);
-            return NULL;
+            th = atomic_load_explicit(&table->slots[j].thread,
+                                      memory_order_acquire);
+            if (th && th != THREAD__MOVED)
+                ret = fn(th, priv);
         }
-        /*
-         * It is now in the rbtree, get a ref
-         */
-        thread__get(th);
-        threads->last_match = th;
-        ++threads->nr;
     }
 
-    return th;
+    epoch__read_unlock(&machine->epoch);
+
+    return ret;
 }
 
-struct thread *__machine__findnew_thread(struct machine *machine,
-                                         pid_t tgid, pid_t tid)
+struct machine__remove_process_args {
+    struct machine *machine;
+    pid_t tgid;
+};
+
+static int machine__remove_if_tgid(struct thread *th, void *priv)
 {
-    return ____machine__findnew_thread(machine, machine__threads(machine, tid),
-                                       tgid, tid, true);
+    struct machine__remove_process_args *args = priv;
+
+    if (th->tgid == args->tgid)
+        __machine__remove_thread(args->machine, th);
+    return 0;
 }
 
-struct thread *
-machine__findnew_thread(struct machine *machine, pid_t tgid, pid_t tid)
+/*
+ * Forget every thread of @tgid, and with them its maps. Like
+ * machine__for_each_thread(), threads that a concurrent grow is moving
+ * may be missed.
+ */
+void machine__remove_process(struct machine *machine, pid_t tgid)
 {
-    struct threads *threads = machine__threads(machine, tid);
-    struct thread *th;
+    struct machine__remove_process_args args = {
+        .machine = machine,
+        .tgid    = tgid,
+    };
 
-    down_write(&threads->lock);
-    th = __machine__findnew_thread(machine, tgid, tid);
-    up_write(&threads->lock);
-
-    return th;
+    machine__for_each_thread(machine, machine__remove_if_tgid, &args);
 }
 
 struct dso *machine__findnew_dso(struct machine *machine, const char *fname)
 {
-    return dsos__findnew(&machine->dsos, fname);
+    return dsos__findnew(machine->dsos, fname);
 }
@@ -4,30 +4,80 @@
 #include "rbtree.h"
 #include "list.h"
 #include "rwsem.h"
+#include "mutex.h"
 #include "dso.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include "libdw_bpf.h"
+#include "epoch.h"
+#include "stats.h"
 
 #define THREADS__TABLE_BITS    8
 #define THREADS__TABLE_SIZE    (1 << THREADS__TABLE_BITS)
 
+/* Initial number of slots in each bucket's open addressing table. */
+#define THREADS__SLOTS_MIN     16
+
+struct thread;
+
+typedef _Atomic(struct thread *) atomic_thread_ptr;
+
+/*
+ * A slot is claimed for a tid by CAS'ing its key from empty and is
+ * never handed to another tid afterwards, the thread pointer is what
+ * comes and goes. Lookups only ever load, so they don't need a lock.
+ */
+struct threads_slot {
+    atomic_uint_least64_t key;
+    atomic_thread_ptr thread;
+};
+
+struct threads_table {
+    unsigned int mask;
+    unsigned int limit;        /* grow once this many keys are claimed */
+    atomic_uint used;
+    struct epoch_head rcu;     /* retired tables, see threads__grow() */
+    struct threads_slot slots[0];
+};
+
+typedef _Atomic(struct threads_table *) atomic_threads_table_ptr;
+
+/*
+ * Each bucket sits on its own cache line, so inserting into one
+ * doesn't bounce the line that lookups in its neighbours are reading.
+ */
 struct threads {
-    struct rb_root entries;
-    struct rw_semaphore lock;
-    unsigned int nr;
-    struct list_head  dead;
-    struct thread *last_match;
+    cache_aligned(atomic_threads_table_ptr table);
+    atomic_uint nr;
+    struct mutex grow_lock;
 };
 
 struct machine {
     struct threads threads[THREADS__TABLE_SIZE];
-    struct dsos dsos;
+    struct dsos *dsos;  /* private, or shared through machine_opts */
+    struct epoch epoch;
+    struct machine_stats stats;
+    bool threaded;     /* MACHINE_THREADING_CONCURRENT */
 };
 
-void machine__init(struct machine *machine);
+void machine__init(struct machine *machine, const struct machine_opts *opts);
 
 struct thread *
 __machine__findnew_thread(struct machine *machine, pid_t pid, pid_t tid);
 struct thread *
 machine__findnew_thread(struct machine *machine, pid_t tgid, pid_t tid);
+struct thread *
+machine__borrow_thread(struct machine *machine, pid_t tgid, pid_t tid);
+void machine__remove_thread(struct machine *machine, pid_t tgid, pid_t tid);
+void machine__remove_process(struct machine *machine, pid_t tgid);
+static inline struct unwind_stats *machine__stats(struct machine *machine)
+{
+    return machine_stats__get(&machine->stats);
+}
+
 struct dso *machine__findnew_dso(struct machine *machine, const char *fname);
+int machine__for_each_thread(struct machine *machine,
+                             int (*fn)(struct thread *thread, void *priv),
+                             void *priv);
 
 #endif // __MACHINE_H_
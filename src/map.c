@@ -4,6 +4,7 @@
 #include "machine.h"
 #include "utility.h"
 #include <assert.h>
+#include <string.h>
 
 
 void map__init(struct map *map, struct mmap2_event *event, struct dso *dso)
@@ -76,8 +77,51 @@ static void maps__init(struct maps *maps, struct machine *machine)
 {
 	maps->entries = RB_ROOT;
 	INIT_LIST_HEAD(&maps->head);
-	init_rwsem(&maps->lock);
+	init_rwsem(&maps->lock, machine->threaded);
+	atomic_init(&maps->index, NULL);
+	maps->nr = 0;
+	maps->batch = 0;
+	maps->stale = false;
 	maps->machine = machine;
+	stack_usage__init(&maps->stack_usage);
+	atomic_init(&maps->synthesized, 0);
+}
+
+static void maps_index__free(struct maps_index *index)
+{
+	unsigned int i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->nr; i++)
+		map__put(index->entries[i]);
+	free(index);
+}
+
+static void maps_index__free_rcu(struct epoch_head *head)
+{
+	maps_index__free(container_of(head, struct maps_index, rcu));
+}
+
+/* Called with maps->lock held for writing. */
+static void __maps__update_index(struct maps *maps)
+{
+	struct maps_index *index, *old;
+	struct rb_node *nd;
+
+	index = xmalloc(sizeof(*index) + maps->nr * sizeof(index->entries[0]));
+	index->nr = 0;
+
+	for (nd = rb_first(&maps->entries); nd; nd = rb_next(nd))
+		index->entries[index->nr++] = map__get(rb_entry(nd, struct map,
+								rb_node));
+
+	old = atomic_exchange_explicit(&maps->index, index,
+				       memory_order_acq_rel);
+	if (old)
+		epoch__call(&maps->machine->epoch, &old->rcu,
+			    maps_index__free_rcu);
 }
 
 static void __maps__purge(struct maps *maps)
@@ -99,6 +143,9 @@ static void maps__exit(struct maps *maps)
 	down_write(&maps->lock);
 	__maps__purge(maps);
 	up_write(&maps->lock);
+
+	/* Last reference, nobody can be searching it any more. */
+	maps_index__free(atomic_load(&maps->index));
 }
 
 struct maps *maps__new(struct machine *machine)
@@ -140,32 +187,39 @@ struct map *maps__first(struct maps *maps)
 	return NULL;
 }
 
+/**
+ * maps__find - Find the map covering @ip
+ * @maps: maps object
+ * @ip: virtual address
+ *
+ * Lock-free, the caller has to be inside an epoch read section of the
+ * machine and the map it gets back is borrowed, no reference is taken.
+ */
 struct map *maps__find(struct maps *maps, u64 ip)
 {
-	struct rb_node **p, *parent = NULL;
-	struct map *m;
+	struct maps_index *index;
+	unsigned int lo = 0, hi;
 
-	down_read(&maps->lock);
+	index = atomic_load_explicit(&maps->index, memory_order_acquire);
+	if (!index)
+		return NULL;
 
-	p = &maps->entries.rb_node;
-	while (*p != NULL) {
-		parent = *p;
-		m = rb_entry(parent, struct map, rb_node);
-		if (ip < m->start)
-			p = &(*p)->rb_left;
-		else if (ip >= m->end)
-			p = &(*p)->rb_right;
+	/* The last map starting at or below ip is the only candidate. */
+	hi = index->nr;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (ip < index->entries[mid]->start)
+			hi = mid;
 		else
-			goto out;
+			lo = mid + 1;
 	}
 
-	m = NULL;
-out:
-	up_read(&maps->lock);
-	return m;
+	if (lo && ip < index->entries[lo - 1]->end)
+		return index->entries[lo - 1];
+	return NULL;
 }
 
-
 static void __maps__insert(struct maps *maps, struct map *map)
 {
 	struct rb_node **p = &maps->entries.rb_node;
@@ -186,11 +240,141 @@ static void __maps__insert(struct maps *maps, struct map *map)
 	rb_insert_color(&map->rb_node, &maps->entries);
 	list_add_tail(&map->node, &maps->head);
 	map__get(map);
+	++maps->nr;
+}
+
+static struct map *map__clone(struct map *map)
+{
+	struct map *clone = xmalloc(sizeof(*clone));
+
+	memcpy(clone, map, sizeof(*clone));
+	dso__get(clone->dso);
+	RB_CLEAR_NODE(&clone->rb_node);
+	INIT_LIST_HEAD(&clone->node);
+	refcount_set(&clone->refcnt, 1);
+
+	return clone;
+}
+
+/*
+ * Called with maps->lock held for writing. The index still holds a
+ * reference, lock-free readers can go on using @map until it's retired.
+ */
+static void __maps__remove(struct maps *maps, struct map *map)
+{
+	rb_erase_init(&map->rb_node, &maps->entries);
+	list_del_init(&map->node);
+	--maps->nr;
+	map__put(map);
+}
+
+/*
+ * Make room for @map like the kernel does for a new mapping: whatever
+ * it covers goes, maps it only partly covers keep the pieces outside.
+ */
+static void __maps__fixup_overlaps(struct maps *maps, struct map *map)
+{
+	struct rb_node *next = rb_first(&maps->entries);
+
+	while (next) {
+		struct map *pos = rb_entry(next, struct map, rb_node);
+		struct map *before = NULL, *after = NULL;
+
+		next = rb_next(&pos->rb_node);
+
+		if (pos->start >= map->end)
+			break;
+		if (pos->end <= map->start)
+			continue;
+
+		if (pos->start < map->start) {
+			before = map__clone(pos);
+			before->end = map->start;
+		}
+		if (pos->end > map->end) {
+			after = map__clone(pos);
+			after->pgoff += map->end - pos->start;
+			after->start = map->end;
+		}
+
+		__maps__remove(maps, pos);
+		if (before) {
+			__maps__insert(maps, before);
+			map__put(before);
+		}
+		if (after) {
+			__maps__insert(maps, after);
+			map__put(after);
+			break;
+		}
+	}
 }
 
 void maps__insert(struct maps *maps, struct map *map)
 {
 	down_write(&maps->lock);
+	__maps__fixup_overlaps(maps, map);
 	__maps__insert(maps, map);
+	if (maps->batch)
+		maps->stale = true;
+	else
+		__maps__update_index(maps);
+	up_write(&maps->lock);
+}
+
+/*
+ * Rebuilding the index is O(n), a batch of inserts, like the whole
+ * /proc snapshot of a process, only publishes it once at the end.
+ * Lookups keep finding the maps from before the batch meanwhile.
+ */
+void maps__begin_batch(struct maps *maps)
+{
+	down_write(&maps->lock);
+	maps->batch++;
+	up_write(&maps->lock);
+}
+
+void maps__end_batch(struct maps *maps)
+{
+	down_write(&maps->lock);
+	if (!--maps->batch && maps->stale) {
+		__maps__update_index(maps);
+		maps->stale = false;
+	}
+	up_write(&maps->lock);
+}
+
+/* A forked process starts out with copies of its parent's mappings. */
+void maps__clone(struct maps *maps, struct maps *parent)
+{
+	struct map *pos, *clone;
+
+	down_read(&parent->lock);
+	down_write(&maps->lock);
+	list_for_each_entry(pos, &parent->head, node) {
+		clone = map__clone(pos);
+		__maps__fixup_overlaps(maps, clone);
+		__maps__insert(maps, clone);
+		map__put(clone);
+	}
+	__maps__update_index(maps);
+	up_write(&maps->lock);
+	up_read(&parent->lock);
+}
+
+/* The process replaced its image, drop every mapping. */
+void maps__remove_all(struct maps *maps)
+{
+	struct rb_node *next;
+
+	down_write(&maps->lock);
+	next = rb_first(&maps->entries);
+	while (next) {
+		struct map *pos = rb_entry(next, struct map, rb_node);
+
+		next = rb_next(&pos->rb_node);
+		__maps__remove(maps, pos);
+	}
+	__maps__update_index(maps);
 	up_write(&maps->lock);
 }
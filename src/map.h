@@ -6,6 +6,8 @@
 #include "types.h"
 #include "rwsem.h"
 #include "refcount.h"
+#include "epoch.h"
+#include "stack_usage.h"
 
 struct dso;
 struct maps;
@@ -64,12 +66,35 @@ static inline struct map *map__get(struct map *map)
 void map__put(struct map *map);
 struct map *map__next(struct map *map);
 
+/*
+ * Sorted snapshot of the maps that maps__find() searches without
+ * taking the lock. Every insert outside a batch publishes a new one,
+ * the old one and the references it holds go away after a grace
+ * period.
+ */
+struct maps_index {
+     struct epoch_head rcu;
+     unsigned int nr;
+     struct map *entries[0];
+};
+
+typedef _Atomic(struct maps_index *) atomic_maps_index_ptr;
+
 struct maps {
      struct rb_root entries;
      struct list_head head;
      struct rw_semaphore lock;
+     atomic_maps_index_ptr index;
+     unsigned int nr;
+     /* under lock, see maps__begin_batch() */
+     unsigned int batch;
+     bool stale;        /* inserted into while batching */
      struct machine *machine;
      refcount_t refcnt;
+     /* shared by the whole process, like the maps themselves */
+     struct stack_usage stack_usage;
+     /* when /proc was last read, see machine__prepare_thread() */
+     atomic_uint_least64_t synthesized;
 };
 
 struct maps *maps__new(struct machine *machine);
@@ -88,5 +113,9 @@ bool maps__empty(struct maps *maps);
 struct map *maps__first(struct maps *maps);
 struct map *maps__find(struct maps *maps, u64 ip);
 void maps__insert(struct maps *maps, struct map *map);
+void maps__begin_batch(struct maps *maps);
+void maps__end_batch(struct maps *maps);
+void maps__remove_all(struct maps *maps);
+void maps__clone(struct maps *maps, struct maps *parent);
 
 #endif // __MAP_H_
@@ -0,0 +1,22 @@
+#include "mutex.h"
+
+int mutex_init(struct mutex *mtx, bool threaded)
+{
+     mtx->threaded = threaded;
+     return pthread_mutex_init(&mtx->lock, NULL);
+}
+
+int mutex_destroy(struct mutex *mtx)
+{
+     return pthread_mutex_destroy(&mtx->lock);
+}
+
+int mutex_lock(struct mutex *mtx)
+{
+     return mtx->threaded ? pthread_mutex_lock(&mtx->lock) : 0;
+}
+
+int mutex_unlock(struct mutex *mtx)
+{
+     return mtx->threaded ? pthread_mutex_unlock(&mtx->lock) : 0;
+}
@@ -0,0 +1,19 @@
+#ifndef __MUTEX_H_
+#define __MUTEX_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Same deal as struct rw_semaphore, a no-op unless @threaded. */
+struct mutex {
+        pthread_mutex_t lock;
+        bool threaded;
+};
+
+int mutex_init(struct mutex *mtx, bool threaded);
+int mutex_destroy(struct mutex *mtx);
+
+int mutex_lock(struct mutex *mtx);
+int mutex_unlock(struct mutex *mtx);
+
+#endif // __MUTEX_H_
@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+#include "libdw_bpf.h"
+#include "machine.h"
+#include "thread.h"
+#include "event.h"
+#include "utility.h"
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * Reader for perf.data files recorded with perf record --call-graph
+ * dwarf. The file is mapped whole and read in place: side band records
+ * are applied to the machine, every sample with user registers and
+ * stack is turned into a struct unwind_ctx and handed to the callback,
+ * which can resolve it right away or queue it for resolver threads.
+ *
+ * perf writes the data in rounds, each ended by a FINISHED_ROUND
+ * record, and records within a round aren't in time order. Nor are the
+ * rounds: the next one can still hold records older than the end of
+ * this one, from a CPU whose buffer was read late. So like perf's
+ * ordered events, when the records carry a time, a FINISHED_ROUND only
+ * processes what is older than anything the previous round queued, in
+ * time order, and the rest waits for later rounds.
+ *
+ * Samples handed to resolver threads are unwound while the file goes
+ * on, so before a record that changes maps or threads the barrier
+ * waits for them to be done with the machine as it was.
+ *
+ * Only native endian files written to disk are read, not pipe output
+ * or compressed records.
+ */
+
+#define PERF_DATA__MAGIC              0x32454c4946524550ULL    /* PERFILE2 */
+
+/* User record types, see tools/lib/perf/include/perf/event.h. */
+#define PERF_RECORD_FINISHED_ROUND    68
+#define PERF_RECORD_AUXTRACE          71
+#define PERF_RECORD_COMPRESSED        81
+
+struct perf_file_section {
+    u64 offset;
+    u64 size;
+};
+
+struct perf_file_header {
+    u64 magic;
+    u64 size;
+    u64 attr_size;
+    struct perf_file_section attrs;
+    struct perf_file_section data;
+    struct perf_file_section event_types;
+    u64 adds_features[4];
+};
+
+struct perf_data_event {
+    u64 time;
+    u64 idx;    /* keeps records of the same time in file order */
+    struct perf_event_header *hdr;
+};
+
+struct perf_data {
+    char *base;
+    size_t size;
+    u64 data_offset;
+    u64 data_size;
+
+    struct perf_event_attr attr;
+    int time_pos;    /* of samples, -1 without PERF_SAMPLE_TIME */
+    int id_time;     /* from the end of other records, 0 without */
+
+    /* Records queued but not processed yet, see perf_data__flush(). */
+    struct perf_data_event *events;
+    size_t nr_events;
+    size_t max_events;
+    u64 next_idx;
+    u64 max_time;      /* the newest record queued so far */
+    u64 flush_time;    /* the newest one when the last round finished */
+
+    perf_data_barrier_t barrier;
+    bool unsynced;     /* samples went out since the last barrier */
+
+    struct mmap2_event mmap2;
+    struct unwind_ctx uc;
+};
+
+void perf_data__close(struct perf_data *pd)
+{
+    if (!pd)
+        return;
+
+    if (pd->base)
+        munmap(pd->base, pd->size);
+    free(pd->events);
+    free(pd);
+}
+
+/* Every attr has to sample the same way, there's no IDENTIFIER parsing. */
+static int perf_data__read_attrs(struct perf_data *pd,
+                                 const struct perf_file_header *header)
+{
+    u64 attr_size = header->attr_size - sizeof(struct perf_file_section);
+    u64 nr = header->attrs.size / header->attr_size;
+    u64 i;
+
+    if (!nr || attr_size > header->attr_size ||
+        header->attrs.offset + header->attrs.size > pd->size)
+        return -EINVAL;
+
+    for (i = 0; i < nr; i++) {
+        struct perf_event_attr attr = { 0 };
+
+        memcpy(&attr, pd->base + header->attrs.offset + i * header->attr_size,
+               attr_size < sizeof(attr) ? attr_size : sizeof(attr));
+
+        if (i && (attr.sample_type != pd->attr.sample_type ||
+                  attr.sample_regs_user != pd->attr.sample_regs_user ||
+                  attr.sample_id_all != pd->attr.sample_id_all))
+            return -ENOTSUP;
+        pd->attr = attr;
+    }
+
+    if (pd->attr.sample_type & PERF_SAMPLE_READ)
+        return -ENOTSUP;
+
+    return 0;
+}
+
+static void perf_data__init_positions(struct perf_data *pd)
+{
+    u64 type = pd->attr.sample_type;
+    int pos = 0;
+
+    pd->time_pos = -1;
+    if (type & PERF_SAMPLE_IDENTIFIER)
+        pos += 8;
+    if (type & PERF_SAMPLE_IP)
+        pos += 8;
+    if (type & PERF_SAMPLE_TID)
+        pos += 8;
+    if (type & PERF_SAMPLE_TIME)
+        pd->time_pos = pos;
+
+    /* sample_id_all trailer: TID TIME ID STREAM_ID CPU IDENTIFIER */
+    pd->id_time = 0;
+    if (!pd->attr.sample_id_all || !(type & PERF_SAMPLE_TIME))
+        return;
+    pd->id_time = 8;
+    if (type & PERF_SAMPLE_ID)
+        pd->id_time += 8;
+    if (type & PERF_SAMPLE_STREAM_ID)
+        pd->id_time += 8;
+    if (type & PERF_SAMPLE_CPU)
+        pd->id_time += 8;
+    if (type & PERF_SAMPLE_IDENTIFIER)
+        pd->id_time += 8;
+}
+
+/* Map @path and check it's a perf.data file this reader understands. */
+struct perf_data *perf_data__open(const char *path)
+{
+    struct perf_data *pd = xcalloc(1, sizeof(*pd));
+    struct perf_file_header *header;
+    struct stat st;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto out_err;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+        errno = errno ?: EINVAL;
+        goto out_close;
+    }
+
+    pd->size = st.st_size;
+    pd->base = mmap(NULL, pd->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pd->base == MAP_FAILED) {
+        pd->base = NULL;
+        goto out_close;
+    }
+    close(fd);
+    madvise(pd->base, pd->size, MADV_SEQUENTIAL);
+
+    header = (struct perf_file_header *)pd->base;
+    if (header->magic != PERF_DATA__MAGIC ||
+        header->size != sizeof(*header)) {
+        errno = ENOTSUP;
+        goto out_err;
+    }
+
+    pd->data_offset = header->data.offset;
+    pd->data_size = header->data.size;
+    if (pd->data_offset + pd->data_size > pd->size) {
+        errno = EINVAL;
+        goto out_err;
+    }
+
+    ret = perf_data__read_attrs(pd, header);
+    if (ret) {
+        errno = -ret;
+        goto out_err;
+    }
+    perf_data__init_positions(pd);
+
+    return pd;
+
+out_close:
+    close(fd);
+out_err:
+    ret = errno;
+    perf_data__close(pd);
+    errno = ret;
+    return NULL;
+}
+
+/*
+ * Fill pd->uc from a sample, returns false if it has no user stack.
+ * Fields are laid out in the order of the PERF_SAMPLE_* bits.
+ */
+static bool perf_data__parse_sample(struct perf_data *pd,
+                                    struct perf_event_header *hdr)
+{
+    const u64 type = pd->attr.sample_type;
+    struct unwind_ctx *uc = &pd->uc;
+    char *p = (char *)(hdr + 1);
+    char *end = (char *)hdr + hdr->size;
+    u64 nr, size, dyn_size;
+
+    if (!(type & PERF_SAMPLE_REGS_USER) || !(type & PERF_SAMPLE_STACK_USER))
+        return false;
+
+    memset(&uc->uregs, 0, sizeof(uc->uregs));
+    uc->ts = 0;
+    uc->tgid = uc->tid = 0;
+
+    if (type & PERF_SAMPLE_IDENTIFIER)
+        p += 8;
+    if (type & PERF_SAMPLE_IP)
+        p += 8;
+    if (type & PERF_SAMPLE_TID) {
+        uc->tgid = ((u32 *)p)[0];
+        uc->tid = ((u32 *)p)[1];
+        p += 8;
+    }
+    if (type & PERF_SAMPLE_TIME) {
+        uc->ts = *(u64 *)p;
+        p += 8;
+    }
+    if (type & PERF_SAMPLE_ADDR)
+        p += 8;
+    if (type & PERF_SAMPLE_ID)
+        p += 8;
+    if (type & PERF_SAMPLE_STREAM_ID)
+        p += 8;
+    if (type & PERF_SAMPLE_CPU)
+        p += 8;
+    if (type & PERF_SAMPLE_PERIOD)
+        p += 8;
+    if (type & PERF_SAMPLE_CALLCHAIN) {
+        nr = *(u64 *)p;
+        p += 8 + nr * 8;
+    }
+    if (type & PERF_SAMPLE_RAW)
+        p += 4 + *(u32 *)p;    /* padded so the next field is aligned */
+    if (type & PERF_SAMPLE_BRANCH_STACK) {
+        nr = *(u64 *)p;
+        p += 8;
+        if (pd->attr.branch_sample_type & PERF_SAMPLE_BRANCH_HW_INDEX)
+            p += 8;
+        p += nr * 3 * sizeof(u64);
+    }
+    if (p + 8 > end)
+        return false;
+
+    /* REGS_USER */
+    if (*(u64 *)p != PERF_SAMPLE_REGS_ABI_64)
+        return false;    /* a kernel thread, or 32 bit code */
+    p += 8;
+    p += 8 * pt_regs__from_perf(&uc->uregs, pd->attr.sample_regs_user,
+                                (u64 *)p);
+
+    /* STACK_USER */
+    if (p + 8 > end)
+        return false;
+    size = *(u64 *)p;
+    p += 8;
+    if (!size || p + size + 8 > end)
+        return false;
+    dyn_size = *(u64 *)(p + size);
+    if (dyn_size < size)
+        size = dyn_size;
+    if (size > sizeof(uc->data))
+        size = sizeof(uc->data);
+
+    memcpy(uc->data, p, size);
+    uc->size = size;
+
+    return true;
+}
+
+/* Samples carry no comm, take the one the COMM records gave. */
+static void perf_data__set_name(struct perf_data *pd, machine_t *machine)
+{
+    struct thread *thread;
+
+    epoch__read_lock(&machine->epoch);
+    thread = machine__borrow_thread(machine, pd->uc.tgid, pd->uc.tid);
+    if (thread)
+        thread__comm(thread, pd->uc.name);
+    epoch__read_unlock(&machine->epoch);
+}
+
+static void perf_data__mmap(struct perf_data *pd, machine_t *machine,
+                            struct perf_event_header *hdr)
+{
+    struct mmap2_event *event = &pd->mmap2;
+    const char *filename;
+    u32 *ids = (u32 *)(hdr + 1);
+    u64 *p = (u64 *)(ids + 2);
+
+    memset(event, 0, offsetof(struct mmap2_event, filename));
+    event->tgid = ids[0];
+    event->tid = ids[1];
+    event->start = p[0];
+    event->len = p[1];
+    event->pgoff = p[2];
+
+    if (hdr->type == PERF_RECORD_MMAP2) {
+        struct {
+            u32 maj, min;
+            u64 ino, ino_generation;
+            u32 prot, flags;
+        } *rec = (void *)(p + 3);
+
+        /* Only code matters for unwinding. */
+        if (!(rec->prot & PROT_EXEC))
+            return;
+        if (!(hdr->misc & PERF_RECORD_MISC_MMAP_BUILD_ID)) {
+            event->maj = rec->maj;
+            event->min = rec->min;
+            event->ino = rec->ino;
+            event->ino_generation = rec->ino_generation;
+        }
+        event->prot = rec->prot;
+        event->flags = rec->flags;
+        filename = (const char *)(rec + 1);
+    } else {
+        if (hdr->misc & PERF_RECORD_MISC_MMAP_DATA)
+            return;
+        event->prot = PROT_READ | PROT_EXEC;
+        event->flags = MAP_PRIVATE;
+        filename = (const char *)(p + 3);
+    }
+
+    strncpy(event->filename, filename, sizeof(event->filename) - 1);
+    event->filename[sizeof(event->filename) - 1] = '\0';
+
+    machine__process_mmap2_event(machine, event);
+}
+
+void perf_data__set_barrier(struct perf_data *pd, perf_data_barrier_t barrier)
+{
+    pd->barrier = barrier;
+}
+
+/* Whether @hdr unmaps, replaces or takes away what samples unwind with. */
+static bool perf_data__changes_maps(struct perf_event_header *hdr)
+{
+    switch (hdr->type) {
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_EXIT:
+        return true;
+    case PERF_RECORD_COMM:
+        return hdr->misc & PERF_RECORD_MISC_COMM_EXEC;
+    default:
+        return false;
+    }
+}
+
+static int perf_data__deliver(struct perf_data *pd, machine_t *machine,
+                              struct perf_event_header *hdr,
+                              ringbuf_cb_t cb, void *cookie)
+{
+    u32 *ids = (u32 *)(hdr + 1);
+
+    if (pd->unsynced && pd->barrier && perf_data__changes_maps(hdr)) {
+        pd->barrier(cookie);
+        pd->unsynced = false;
+    }
+
+    switch (hdr->type) {
+    case PERF_RECORD_SAMPLE:
+        if (!perf_data__parse_sample(pd, hdr))
+            break;
+        perf_data__set_name(pd, machine);
+        pd->unsynced = true;
+        return cb(&pd->uc, unwind_ctx__size(&pd->uc), cookie);
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+        perf_data__mmap(pd, machine, hdr);
+        break;
+    case PERF_RECORD_COMM:
+        machine__process_comm_event(machine, ids[0], ids[1],
+                                    (const char *)(ids + 2),
+                                    hdr->misc & PERF_RECORD_MISC_COMM_EXEC);
+        break;
+    case PERF_RECORD_FORK:
+        /* pid, ppid, tid, ptid */
+        machine__process_fork_event(machine, ids[1], ids[3], ids[0], ids[2]);
+        break;
+    case PERF_RECORD_EXIT:
+        machine__process_exit_event(machine, ids[0], ids[2]);
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static u64 perf_data__time(struct perf_data *pd, struct perf_event_header *hdr)
+{
+    if (hdr->type == PERF_RECORD_SAMPLE)
+        return *(u64 *)((char *)(hdr + 1) + pd->time_pos);
+    if (hdr->type >= PERF_RECORD_MAX)
+        return 0;
+    return *(u64 *)((char *)hdr + hdr->size - pd->id_time);
+}
+
+static int perf_data_event__cmp(const void *a, const void *b)
+{
+    const struct perf_data_event *ea = a, *eb = b;
+
+    if (ea->time != eb->time)
+        return ea->time < eb->time ? -1 : 1;
+    return ea->idx < eb->idx ? -1 : 1;
+}
+
+/* Process the queued records up to @limit in time order, keep the rest. */
+static int perf_data__flush(struct perf_data *pd, machine_t *machine,
+                            u64 limit, ringbuf_cb_t cb, void *cookie)
+{
+    size_t i;
+    int ret = 0;
+
+    qsort(pd->events, pd->nr_events, sizeof(*pd->events),
+          perf_data_event__cmp);
+
+    for (i = 0; i < pd->nr_events && pd->events[i].time <= limit; i++) {
+        ret = perf_data__deliver(pd, machine, pd->events[i].hdr, cb, cookie);
+        if (ret < 0)
+            break;
+    }
+
+    pd->nr_events -= i;
+    memmove(pd->events, pd->events + i, pd->nr_events * sizeof(*pd->events));
+
+    return ret;
+}
+
+/*
+ * Everything the finished round queued may still be preceded by the
+ * next one's, only what the rounds before queued is safe to process.
+ */
+static int perf_data__flush_round(struct perf_data *pd, machine_t *machine,
+                                  ringbuf_cb_t cb, void *cookie)
+{
+    int ret = perf_data__flush(pd, machine, pd->flush_time, cb, cookie);
+
+    pd->flush_time = pd->max_time;
+    return ret;
+}
+
+static void perf_data__queue(struct perf_data *pd,
+                             struct perf_event_header *hdr)
+{
+    struct perf_data_event *event;
+
+    if (pd->nr_events == pd->max_events) {
+        pd->max_events = pd->max_events ? 2 * pd->max_events : 4096;
+        pd->events = xrealloc(pd->events,
+                              pd->max_events * sizeof(*pd->events));
+    }
+
+    event = &pd->events[pd->nr_events++];
+    event->time = perf_data__time(pd, hdr);
+    event->idx = pd->next_idx++;
+    event->hdr = hdr;
+    if (event->time > pd->max_time)
+        pd->max_time = event->time;
+}
+
+/*
+ * Apply the file's records to @machine and call @cb with every sample
+ * that has a user stack, in time order. The record is only valid until
+ * @cb returns, processing stops when it returns < 0, which is passed
+ * on. Can be called again, with a fresh machine, to read the file anew.
+ */
+int perf_data__process(struct perf_data *pd, machine_t *machine,
+                       ringbuf_cb_t cb, void *cookie)
+{
+    bool ordered = pd->time_pos >= 0 && pd->id_time;
+    char *p = pd->base + pd->data_offset;
+    char *end = p + pd->data_size;
+    struct perf_event_header *hdr;
+    int ret = 0;
+
+    pd->nr_events = 0;
+    pd->next_idx = 0;
+    pd->max_time = pd->flush_time = 0;
+    pd->unsynced = false;
+
+    while (p + sizeof(*hdr) <= end) {
+        hdr = (struct perf_event_header *)p;
+        if (hdr->size < sizeof(*hdr) || p + hdr->size > end)
+            return -EINVAL;
+        p += hdr->size;
+
+        switch (hdr->type) {
+        case PERF_RECORD_COMPRESSED:
+            return -ENOTSUP;
+        case PERF_RECORD_AUXTRACE:
+            /* The trace data follows the record. */
+            p += *(u64 *)(hdr + 1);
+            continue;
+        case PERF_RECORD_FINISHED_ROUND:
+            ret = perf_data__flush_round(pd, machine, cb, cookie);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        if (ordered) {
+            perf_data__queue(pd, hdr);
+            continue;
+        }
+
+        ret = perf_data__deliver(pd, machine, hdr, cb, cookie);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = perf_data__flush(pd, machine, ~0ULL, cb, cookie);
+
+    return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "libdw_bpf.h"
+#include "machine.h"
+#include "thread.h"
+#include "map.h"
+#include "event.h"
+#include "resolver.h"
+#include "unwind.h"
+#include "utility.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Samples user stacks with perf_event_open(2) alone, no BPF: a CPU
+ * clock event per CPU asks the kernel for the user registers and a
+ * copy of the stack, PERF_SAMPLE_REGS_USER and PERF_SAMPLE_STACK_USER,
+ * the way perf record --call-graph dwarf does. MMAP2, COMM and EXIT
+ * records from the same ring keep the machine's maps current, so only
+ * processes that were running before the sampler started are read from
+ * /proc.
+ *
+ * Rings are drained one after the other, side band records of one CPU
+ * aren't ordered against samples of another. A sample racing a mapping
+ * it needs may not unwind, nothing worse.
+ */
+
+#define PERF_SAMPLER__FREQ         99
+#define PERF_SAMPLER__STACK_SIZE   STACK_SIZE
+#define PERF_SAMPLER__MMAP_PAGES   64
+#define PERF_SAMPLER__MAX_DEPTH    128
+#define PERF_SAMPLER__WAKEUP       (1U << 16)
+
+/* pt_regs has no ds, es, fs and gs, see pt_regs_offset[]. */
+#define PERF_SAMPLER__REGS_MASK \
+    (((1ULL << X86_64_MAX) - 1) & \
+     ~(1ULL << X86_DS | 1ULL << X86_ES | 1ULL << X86_FS | 1ULL << X86_GS))
+
+#define load_acquire(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct perf_ring {
+    int fd;
+    struct perf_event_mmap_page *page;
+    char *data;
+    u64 mask;
+};
+
+struct perf_sampler {
+    struct machine *machine;
+    struct perf_sampler_opts opts;
+    struct perf_ring *rings;
+    int nr_rings;
+    int epoll_fd;
+    size_t page_size;
+    size_t mmap_size;
+
+    u64 lost;
+    struct resolver *resolver;
+    struct mmap2_event mmap2;
+    /* A record that wraps at the end of its ring is copied here. */
+    char record[1U << 16];
+};
+
+struct sample_regs {
+    u64 abi;
+    u64 regs[];
+};
+
+struct sample_stack {
+    u64 size;
+    char data[];
+};
+
+void perf_sampler__delete(struct perf_sampler *sampler)
+{
+    int i;
+
+    if (!sampler)
+        return;
+
+    for (i = 0; i < sampler->nr_rings; i++) {
+        struct perf_ring *ring = &sampler->rings[i];
+
+        if (ring->page)
+            munmap(ring->page, sampler->mmap_size);
+        close(ring->fd);
+    }
+    if (sampler->epoll_fd >= 0)
+        close(sampler->epoll_fd);
+    free(sampler->rings);
+    resolver__delete(sampler->resolver);
+    free(sampler);
+}
+
+static int perf_sampler__open(struct perf_sampler *sampler, int cpu)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_CPU_CLOCK,
+        .freq = 1,
+        .sample_freq = sampler->opts.sample_freq,
+        .sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                       PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER,
+        .sample_regs_user = PERF_SAMPLER__REGS_MASK,
+        .sample_stack_user = sampler->opts.stack_size,
+        .mmap = 1,
+        .mmap2 = 1,
+        .comm = 1,
+        .comm_exec = 1,
+        .task = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .watermark = 1,
+        .wakeup_watermark = PERF_SAMPLER__WAKEUP,
+    };
+    struct perf_ring *ring;
+    pid_t pid = -1;
+    int fd;
+
+    if (sampler->opts.pid > 0) {
+        pid = sampler->opts.pid;
+        attr.inherit = 1;
+    }
+
+    /* Don't wait for more than a quarter of the ring. */
+    if (attr.wakeup_watermark > sampler->mmap_size / 4)
+        attr.wakeup_watermark = sampler->mmap_size / 4;
+
+    fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    ring = &sampler->rings[sampler->nr_rings++];
+    ring->fd = fd;
+    ring->page = mmap(NULL, sampler->mmap_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (ring->page == MAP_FAILED) {
+        ring->page = NULL;
+        return -errno;
+    }
+    ring->data = (char *)ring->page + sampler->page_size;
+    ring->mask = sampler->mmap_size - sampler->page_size - 1;
+
+    ev.data.ptr = ring;
+    if (epoll_ctl(sampler->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -errno;
+
+    return 0;
+}
+
+/*
+ * Start sampling, the machine has to outlive the sampler. Offline
+ * CPUs are skipped. Returns NULL, with errno set, if no event could be
+ * opened, see perf_event_paranoid.
+ */
+struct perf_sampler *perf_sampler__new(struct machine *machine,
+                                       const struct perf_sampler_opts *opts)
+{
+    struct perf_sampler *sampler = xcalloc(1, sizeof(*sampler));
+    int nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    unsigned int pages;
+    int cpu, ret = 0;
+
+    sampler->machine = machine;
+    sampler->epoll_fd = -1;
+    if (opts)
+        sampler->opts = *opts;
+    if (!sampler->opts.sample_freq)
+        sampler->opts.sample_freq = PERF_SAMPLER__FREQ;
+    if (!sampler->opts.stack_size)
+        sampler->opts.stack_size = PERF_SAMPLER__STACK_SIZE;
+    /* The whole sample has to fit the u16 size of its record. */
+    if (sampler->opts.stack_size > 0xfff0 - 0x400)
+        sampler->opts.stack_size = 0xfff0 - 0x400;
+    sampler->opts.stack_size &= ~7U;
+    if (sampler->opts.max_depth < 1)
+        sampler->opts.max_depth = PERF_SAMPLER__MAX_DEPTH;
+
+    pages = sampler->opts.mmap_pages;
+    if (!pages)
+        pages = PERF_SAMPLER__MMAP_PAGES;
+    if (pages & (pages - 1)) {
+        errno = EINVAL;
+        goto out_err;
+    }
+
+    sampler->page_size = sysconf(_SC_PAGESIZE);
+    sampler->mmap_size = (1 + pages) * sampler->page_size;
+    sampler->resolver = __resolver__new(sampler->opts.max_depth);
+
+    sampler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sampler->epoll_fd < 0)
+        goto out_err;
+
+    sampler->rings = xcalloc(nr_cpus, sizeof(*sampler->rings));
+    for (cpu = 0; cpu < nr_cpus; cpu++) {
+        ret = perf_sampler__open(sampler, cpu);
+        if (ret == -ENODEV)
+            ret = 0;
+        else if (ret)
+            break;
+    }
+
+    if (ret || !sampler->nr_rings) {
+        errno = ret ? -ret : ENODEV;
+        goto out_err;
+    }
+
+    return sampler;
+
+out_err:
+    ret = errno;
+    perf_sampler__delete(sampler);
+    errno = ret;
+    return NULL;
+}
+
+static void perf_sampler__sample(struct perf_sampler *sampler, char *p)
+{
+    struct unwind_sample sample = { 0 };
+    const struct sample_regs *regs;
+    const struct sample_stack *stack;
+    struct pt_regs uregs = { 0 };
+    u32 tgid, tid;
+    u64 time, dyn_size;
+    int nr, ret;
+
+    tgid = *(u32 *)p;
+    tid = *(u32 *)(p + 4);
+    p += 8;
+    time = *(u64 *)p;
+    p += 8;
+
+    regs = (const struct sample_regs *)p;
+    if (regs->abi != PERF_SAMPLE_REGS_ABI_64)
+        return;    /* a kernel thread, or 32 bit code */
+
+    nr = pt_regs__from_perf(&uregs, PERF_SAMPLER__REGS_MASK, regs->regs);
+    p += sizeof(*regs) + nr * sizeof(u64);
+
+    stack = (const struct sample_stack *)p;
+    if (!stack->size)
+        return;
+    dyn_size = *(u64 *)(stack->data + stack->size);
+
+    sample.regs = &uregs;
+    sample.stack = stack->data;
+    sample.size = dyn_size < stack->size ? dyn_size : stack->size;
+
+    /*
+     * Processes that were already running when sampling started have
+     * had no MMAP2 records.
+     */
+    machine__prepare_thread(sampler->machine, tgid, tid, uregs.ip);
+
+    ret = resolver__resolve_sample(sampler->resolver, sampler->machine,
+                                   tgid, tid, NULL, &sample);
+
+    if (sampler->opts.callback)
+        sampler->opts.callback(tgid, tid, time, &sampler->resolver->st,
+                               ret, sampler->opts.cookie);
+}
+
+static void perf_sampler__mmap2(struct perf_sampler *sampler, char *p,
+                                size_t len)
+{
+    struct mmap2_event *event = &sampler->mmap2;
+    struct {
+        u32 pid, tid;
+        u64 addr, len, pgoff;
+        u32 maj, min;
+        u64 ino, ino_generation;
+        u32 prot, flags;
+        char filename[];
+    } *rec = (void *)p;
+
+    /* Anything but code is of no use for unwinding. */
+    if (!(rec->prot & PROT_EXEC))
+        return;
+
+    event->tgid = rec->pid;
+    event->tid = rec->tid;
+    event->start = rec->addr;
+    event->len = rec->len;
+    event->pgoff = rec->pgoff;
+    event->maj = rec->maj;
+    event->min = rec->min;
+    event->ino = rec->ino;
+    event->ino_generation = rec->ino_generation;
+    event->prot = rec->prot;
+    event->flags = rec->flags;
+
+    len -= sizeof(*rec);
+    if (len >= sizeof(event->filename))
+        len = sizeof(event->filename) - 1;
+    memcpy(event->filename, rec->filename, len);
+    event->filename[len] = '\0';
+
+    machine__process_mmap2_event(sampler->machine, event);
+}
+
+static void perf_sampler__record(struct perf_sampler *sampler,
+                                 struct perf_event_header *hdr)
+{
+    char *p = (char *)(hdr + 1);
+    u32 *ids = (u32 *)p;
+
+    switch (hdr->type) {
+    case PERF_RECORD_SAMPLE:
+        perf_sampler__sample(sampler, p);
+        break;
+    case PERF_RECORD_MMAP2:
+        perf_sampler__mmap2(sampler, p, hdr->size - sizeof(*hdr));
+        break;
+    case PERF_RECORD_COMM:
+        machine__process_comm_event(sampler->machine, ids[0], ids[1],
+                                    p + 8,
+                                    hdr->misc & PERF_RECORD_MISC_COMM_EXEC);
+        break;
+    case PERF_RECORD_FORK:
+        /* pid, ppid, tid, ptid, the child gets the parent's maps */
+        machine__process_fork_event(sampler->machine, ids[1], ids[3],
+                                    ids[0], ids[2]);
+        break;
+    case PERF_RECORD_EXIT:
+        /* pid, ppid, tid, ptid */
+        machine__process_exit_event(sampler->machine, ids[0], ids[2]);
+        break;
+    case PERF_RECORD_LOST:
+        sampler->lost += ((u64 *)p)[1];
+        break;
+    default:
+        break;
+    }
+}
+
+/* Handle the records between the kernel's head and our tail. */
+static int perf_sampler__drain(struct perf_sampler *sampler,
+                               struct perf_ring *ring)
+{
+    struct perf_event_header *hdr;
+    u64 head, tail, off;
+    int nr = 0;
+
+    head = load_acquire(&ring->page->data_head);
+    tail = ring->page->data_tail;
+
+    while (tail < head) {
+        off = tail & ring->mask;
+        hdr = (struct perf_event_header *)(ring->data + off);
+
+        /* Headers are 8 byte aligned and never wrap, records may. */
+        if (off + hdr->size > ring->mask + 1) {
+            size_t first = ring->mask + 1 - off;
+
+            memcpy(sampler->record, hdr, first);
+            memcpy(sampler->record + first, ring->data, hdr->size - first);
+            hdr = (struct perf_event_header *)sampler->record;
+        }
+
+        perf_sampler__record(sampler, hdr);
+        tail += hdr->size;
+        nr++;
+    }
+
+    store_release(&ring->page->data_tail, tail);
+
+    return nr;
+}
+
+/*
+ * Wait up to @timeout ms for a ring to fill up to its watermark, then
+ * handle what every ring has, samples go to the callback on this
+ * thread. Returns the number of records.
+ */
+int perf_sampler__poll(struct perf_sampler *sampler, int timeout)
+{
+    struct epoll_event ev;
+    int i, nr = 0;
+
+    if (epoll_wait(sampler->epoll_fd, &ev, 1, timeout) < 0 && errno != EINTR)
+        return -errno;
+
+    for (i = 0; i < sampler->nr_rings; i++)
+        nr += perf_sampler__drain(sampler, &sampler->rings[i]);
+
+    return nr;
+}
+
+/* Samples the kernel dropped because the rings were full. */
+u64 perf_sampler__lost(struct perf_sampler *sampler)
+{
+    return sampler->lost;
+}
@@ -0,0 +1,346 @@
+#include "libdw_bpf.h"
+#include "machine.h"
+#include "event.h"
+#include "resolver.h"
+#include "stats.h"
+#include "hash.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+
+/*
+ * The whole way from capture to callback in one object: records are
+ * copied into a pool slot on submit and queued, any of the workers
+ * takes them, resolves them against one shared machine with its own
+ * resolver and calls back. An attached ring buffer is polled on a
+ * thread of the pipeline. Unlike the dispatcher nothing is routed, so
+ * a single busy process keeps every worker busy.
+ *
+ * Memory is the pool and nothing else. Once resolving falls behind the
+ * policy decides what is given up, see enum pipeline_policy, and every
+ * record that is, is counted with the reason.
+ */
+
+#define PIPELINE__NR_SLOTS    1024
+#define PIPELINE__BATCH       16
+#define PIPELINE__POLL_MS     100
+#define PIPELINE__WATERMARK   75
+#define PIPELINE__DOWNSAMPLE  4
+#define PIPELINE__TID_BITS    8
+
+struct pipeline_worker {
+    cache_aligned(struct pipeline *pipeline);
+    struct resolver *resolver;
+    pthread_t thread;
+    /* Only the worker writes these, see unwind_stats__add(). */
+    u64 resolved;
+    u64 degraded;
+};
+
+struct pipeline {
+    struct pipeline_opts opts;
+    struct machine *machine;
+    struct unwind_pool *pool;
+    struct unwind_queue *queue;
+
+    /* Source, see pipeline__attach_ringbuf(). */
+    struct ringbuf *rb;
+    pthread_t poller;
+    atomic_bool stop;
+
+    /* Backpressure, see pipeline__busy(). */
+    unsigned int high;
+    unsigned int downsample;
+    cache_aligned(atomic_uint in_flight);
+    atomic_uint_least64_t submitted;
+    atomic_uint_least64_t dropped[PIPELINE_DROP__NR];
+    atomic_uint sampled[1 << PIPELINE__TID_BITS];   /* per tid hash */
+
+    unsigned int nr_workers;
+    struct pipeline_worker workers[0];
+};
+
+/* More than the watermark of slots are taken. */
+static inline bool pipeline__busy(struct pipeline *pipeline)
+{
+    return atomic_load_explicit(&pipeline->in_flight,
+                                memory_order_relaxed) >= pipeline->high;
+}
+
+static inline void pipeline__drop(struct pipeline *pipeline,
+                                  enum pipeline_drop why, u64 nr)
+{
+    atomic_fetch_add_explicit(&pipeline->dropped[why], nr,
+                              memory_order_relaxed);
+}
+
+static void pipeline_worker__resolve(struct pipeline_worker *worker,
+                                     struct unwind_ctx *uc)
+{
+    struct pipeline *pipeline = worker->pipeline;
+    int ret;
+
+    if (pipeline->opts.policy == PIPELINE_POLICY_DEGRADE &&
+        pipeline__busy(pipeline)) {
+        ret = __resolver__resolve_fp(worker->resolver, uc);
+        unwind_stats__add(&worker->degraded, 1);
+    } else {
+        machine__prepare_thread(pipeline->machine, uc->tgid, uc->tid,
+                                uc->uregs.ip);
+        ret = __resolver__resolve(worker->resolver, pipeline->machine, uc);
+    }
+
+    if (pipeline->opts.callback)
+        pipeline->opts.callback(uc, &worker->resolver->st, ret,
+                                pipeline->opts.cookie);
+    unwind_stats__add(&worker->resolved, 1);
+}
+
+static void *pipeline_worker__run(void *arg)
+{
+    struct pipeline_worker *worker = arg;
+    struct pipeline *pipeline = worker->pipeline;
+    void *ucs[PIPELINE__BATCH];
+    unsigned int nr, i;
+
+    /* Returns nothing only once the queue is closed and drained. */
+    while ((nr = unwind_queue__pop_batch(pipeline->queue, ucs,
+                                         PIPELINE__BATCH, -1))) {
+        for (i = 0; i < nr; i++) {
+            pipeline_worker__resolve(worker, ucs[i]);
+            unwind_pool__free(pipeline->pool, ucs[i]);
+            atomic_fetch_sub_explicit(&pipeline->in_flight, 1,
+                                      memory_order_relaxed);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Keep one in downsample records of each tid. Tids that hash alike
+ * share a count, which only shifts which of their records are kept.
+ */
+static bool pipeline__sample(struct pipeline *pipeline, pid_t tid)
+{
+    atomic_uint *count = &pipeline->sampled[hash_32(tid,
+                                                     PIPELINE__TID_BITS)];
+
+    return !(atomic_fetch_add_explicit(count, 1, memory_order_relaxed) %
+             pipeline->downsample);
+}
+
+/*
+ * Overwrite the oldest queued record with @uc and queue it again, its
+ * slot changes hands without going back to the pool. Fails if the
+ * workers hold every slot.
+ */
+static int pipeline__evict(struct pipeline *pipeline,
+                           const struct unwind_ctx *uc, int size)
+{
+    void *slot = unwind_queue__pop(pipeline->queue, 0);
+
+    if (!slot)
+        return -ENOBUFS;
+
+    pipeline__drop(pipeline, PIPELINE_DROP_EVICTED, 1);
+    memcpy(slot, uc, size);
+    unwind_queue__push(pipeline->queue, slot);
+    return 0;
+}
+
+/*
+ * Queue a copy of the first @size bytes of @uc, from any thread.
+ * Returns -ENOBUFS if the policy dropped it, e.g. every slot is taken,
+ * and -E2BIG for records that don't fit a slot.
+ */
+int pipeline__submit(struct pipeline *pipeline,
+                     const struct unwind_ctx *uc, int size)
+{
+    enum pipeline_policy policy = pipeline->opts.policy;
+    void *slot;
+
+    atomic_fetch_add_explicit(&pipeline->submitted, 1, memory_order_relaxed);
+    if (size < 0 || (size_t)size > sizeof(*uc)) {
+        pipeline__drop(pipeline, PIPELINE_DROP_TOO_BIG, 1);
+        return -E2BIG;
+    }
+
+    if (policy == PIPELINE_POLICY_DOWNSAMPLE && pipeline__busy(pipeline) &&
+        !pipeline__sample(pipeline, uc->tid)) {
+        pipeline__drop(pipeline, PIPELINE_DROP_SAMPLED, 1);
+        return -ENOBUFS;
+    }
+
+    slot = unwind_pool__copy(pipeline->pool, uc, size);
+    if (!slot) {
+        if (policy == PIPELINE_POLICY_DROP_OLDEST &&
+            !pipeline__evict(pipeline, uc, size))
+            return 0;
+        pipeline__drop(pipeline, PIPELINE_DROP_FULL, 1);
+        return -ENOBUFS;
+    }
+
+    atomic_fetch_add_explicit(&pipeline->in_flight, 1, memory_order_relaxed);
+    /* The queue has room for every slot, this can't fail. */
+    unwind_queue__push(pipeline->queue, slot);
+    return 0;
+}
+
+/*
+ * Count @nr records that were lost before they could be submitted,
+ * e.g. from the lost callback of a perf buffer.
+ */
+void pipeline__lost(struct pipeline *pipeline, u64 nr)
+{
+    pipeline__drop(pipeline, PIPELINE_DROP_LOST, nr);
+}
+
+/* Any thread, any time. */
+void pipeline__read_stats(struct pipeline *pipeline,
+                          struct pipeline_stats *stats)
+{
+    unsigned int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->submitted = atomic_load(&pipeline->submitted);
+    for (i = 0; i < PIPELINE_DROP__NR; i++)
+        stats->dropped[i] = atomic_load(&pipeline->dropped[i]);
+    for (i = 0; i < pipeline->nr_workers; i++) {
+        struct pipeline_worker *worker = &pipeline->workers[i];
+
+        stats->resolved += __atomic_load_n(&worker->resolved,
+                                           __ATOMIC_RELAXED);
+        stats->degraded += __atomic_load_n(&worker->degraded,
+                                           __ATOMIC_RELAXED);
+    }
+}
+
+static int pipeline__ringbuf_cb(struct unwind_ctx *uc, int size, void *cookie)
+{
+    pipeline__submit(cookie, uc, size);
+    return 0;
+}
+
+static void *pipeline__poll(void *arg)
+{
+    struct pipeline *pipeline = arg;
+
+    while (!atomic_load_explicit(&pipeline->stop, memory_order_relaxed))
+        ringbuf__poll(pipeline->rb, PIPELINE__POLL_MS,
+                      pipeline__ringbuf_cb, pipeline);
+
+    return NULL;
+}
+
+/*
+ * Poll @rb on a thread of the pipeline and submit every record, e.g.
+ * ringbuf__new() of a capture program's ring buffer, or the one of a
+ * capture_t. One source per pipeline, -EBUSY for a second one. @rb is
+ * still the caller's, but must outlive the pipeline.
+ */
+int pipeline__attach_ringbuf(struct pipeline *pipeline, struct ringbuf *rb)
+{
+    int ret;
+
+    if (pipeline->rb)
+        return -EBUSY;
+
+    pipeline->rb = rb;
+    ret = pthread_create(&pipeline->poller, NULL, pipeline__poll, pipeline);
+    if (ret) {
+        pipeline->rb = NULL;
+        return -ret;
+    }
+
+    return 0;
+}
+
+machine_t *pipeline__machine(struct pipeline *pipeline)
+{
+    return pipeline->machine;
+}
+
+/*
+ * Starts the workers. Processes are mapped from /proc on their first
+ * record, after that keep the machine up to date through
+ * pipeline__machine() if they map more. Returns NULL with errno set.
+ */
+struct pipeline *pipeline__new(const struct pipeline_opts *opts)
+{
+    struct machine_opts machine_opts = {
+        .threading = MACHINE_THREADING_CONCURRENT,
+        .dsos      = opts->dsos,
+    };
+    struct unwind_pool_opts pool_opts = {
+        .nr_slots = opts->nr_slots ? opts->nr_slots : PIPELINE__NR_SLOTS,
+    };
+    unsigned int i, nr_workers = opts->nr_workers ? opts->nr_workers : 1;
+    struct pipeline *pipeline;
+    int ret = 0;
+
+    pipeline = xzalloc_aligned(alignof(*pipeline),
+                               sizeof(*pipeline) +
+                               nr_workers * sizeof(pipeline->workers[0]));
+    pipeline->opts = *opts;
+    atomic_init(&pipeline->stop, false);
+    pipeline->high = (u64)pool_opts.nr_slots *
+                     (opts->watermark ? min(opts->watermark, 100U) :
+                      PIPELINE__WATERMARK) / 100;
+    pipeline->downsample = opts->downsample ? opts->downsample :
+                           PIPELINE__DOWNSAMPLE;
+    pipeline->machine = machine__new_opts(&machine_opts);
+    pipeline->pool = unwind_pool__new(&pool_opts);
+    pipeline->queue = unwind_queue__new(pool_opts.nr_slots);
+
+    for (i = 0; i < nr_workers; i++) {
+        struct pipeline_worker *worker = &pipeline->workers[i];
+
+        worker->pipeline = pipeline;
+        worker->resolver = __resolver__new(opts->max_depth);
+        ret = pthread_create(&worker->thread, NULL, pipeline_worker__run,
+                             worker);
+        if (ret) {
+            resolver__delete(worker->resolver);
+            break;
+        }
+        pipeline->nr_workers++;
+    }
+
+    if (ret) {
+        pipeline__delete(pipeline);
+        errno = ret;
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/*
+ * Stops polling, resolves and calls back every record submitted so
+ * far, then stops the workers. Nothing may be submitted concurrently.
+ */
+void pipeline__delete(struct pipeline *pipeline)
+{
+    unsigned int i;
+
+    if (!pipeline)
+        return;
+
+    atomic_store(&pipeline->stop, true);
+    if (pipeline->rb)
+        pthread_join(pipeline->poller, NULL);
+
+    unwind_queue__close(pipeline->queue);
+    for (i = 0; i < pipeline->nr_workers; i++) {
+        pthread_join(pipeline->workers[i].thread, NULL);
+        resolver__delete(pipeline->workers[i].resolver);
+    }
+
+    unwind_queue__delete(pipeline->queue);
+    unwind_pool__delete(pipeline->pool);
+    machine__delete(pipeline->machine);
+    free(pipeline);
+}
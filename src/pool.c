@@ -0,0 +1,122 @@
+#include "libdw_bpf.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * A fixed number of record slots, allocated and touched up front, for
+ * handing records from a capture callback to resolver threads without
+ * malloc. Free slots are a lock-free stack of indexes: the head holds
+ * the index of the top slot + 1 in its low half and a count of pops in
+ * its high half, so a slot that was popped and pushed back in between
+ * can't make a stale compare-and-swap succeed.
+ */
+
+#define UNWIND_POOL__NR_SLOTS    1024
+
+struct unwind_pool {
+    cache_aligned(atomic_uint_least64_t head);
+    atomic_uint *next;          /* slot -> the one below it + 1, 0 ends */
+    u32 slot_size;
+    unsigned int nr_slots;
+    char *slots;
+};
+
+static inline u32 unwind_pool__index(struct unwind_pool *pool, void *record)
+{
+    size_t off = (char *)record - pool->slots;
+
+    assert(off < (size_t)pool->nr_slots * pool->slot_size &&
+           !(off % pool->slot_size));
+    return off / pool->slot_size;
+}
+
+/*
+ * @opts->nr_slots records of @opts->slot_size bytes each, slot_size 0
+ * for a struct unwind_ctx. All of them are allocated here.
+ */
+struct unwind_pool *unwind_pool__new(const struct unwind_pool_opts *opts)
+{
+    struct unwind_pool *pool = xzalloc_aligned(alignof(*pool), sizeof(*pool));
+    unsigned int i;
+
+    pool->nr_slots = opts && opts->nr_slots ? opts->nr_slots :
+                     UNWIND_POOL__NR_SLOTS;
+    pool->slot_size = ALIGN(opts && opts->slot_size ? opts->slot_size :
+                            sizeof(struct unwind_ctx), CACHE_LINE_SIZE);
+    pool->slots = xzalloc_aligned(CACHE_LINE_SIZE,
+                                  (size_t)pool->nr_slots * pool->slot_size);
+    pool->next = xcalloc(pool->nr_slots, sizeof(*pool->next));
+
+    /* Lowest slots on top, the ones in use stay close together. */
+    for (i = 0; i < pool->nr_slots; i++)
+        atomic_init(&pool->next[i], i + 2 <= pool->nr_slots ? i + 2 : 0);
+    atomic_init(&pool->head, 1);
+
+    return pool;
+}
+
+void unwind_pool__delete(struct unwind_pool *pool)
+{
+    if (!pool)
+        return;
+
+    free(pool->next);
+    free(pool->slots);
+    free(pool);
+}
+
+/* A free slot, or NULL if all of them are in use. Any thread. */
+void *unwind_pool__alloc(struct unwind_pool *pool)
+{
+    u64 head, new;
+    u32 top;
+
+    head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    do {
+        top = (u32)head;
+        if (!top)
+            return NULL;
+        new = ((head >> 32) + 1) << 32 |
+              atomic_load_explicit(&pool->next[top - 1], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+
+    return pool->slots + (size_t)(top - 1) * pool->slot_size;
+}
+
+/*
+ * Copy the first @size bytes of @record, the size its ring reported,
+ * into a free slot. NULL if it doesn't fit or nothing is free.
+ */
+void *unwind_pool__copy(struct unwind_pool *pool, const void *record,
+                        int size)
+{
+    void *slot;
+
+    if (size < 0 || (u32)size > pool->slot_size)
+        return NULL;
+
+    slot = unwind_pool__alloc(pool);
+    if (slot)
+        memcpy(slot, record, size);
+    return slot;
+}
+
+/* Give back a slot of @pool, on any thread. */
+void unwind_pool__free(struct unwind_pool *pool, void *record)
+{
+    u32 slot = unwind_pool__index(pool, record) + 1;
+    u64 head, new;
+
+    head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&pool->next[slot - 1], (u32)head,
+                              memory_order_relaxed);
+        new = (head >> 32) << 32 | slot;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
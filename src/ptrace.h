@@ -106,13 +106,34 @@ static unsigned int pt_regs_offset[X86_MAX] = {
         PT_REGS_OFFSET(X86_R15, r15),
 };
 
-static inline u64 reg_value(struct pt_regs *regs, int idx)
+static inline u64 reg_value(const struct pt_regs *regs, int idx)
 {
         unsigned int offset;
 
         assert(idx < ARRAY_SIZE(pt_regs_offset));
         offset = pt_regs_offset[idx];
-        return *(u64*)((u64)regs + offset);
+        return *(const u64*)((u64)regs + offset);
+}
+
+/*
+ * Fill @regs from the PERF_SAMPLE_REGS_USER values of a sample taken
+ * with sample_regs_user @mask, perf numbers registers like enum
+ * x86_regs. Returns the number of values consumed.
+ */
+static inline int pt_regs__from_perf(struct pt_regs *regs, u64 mask,
+                                     const u64 *values)
+{
+        int i, nr = 0;
+
+        for (i = 0; i < 64; i++) {
+                if (!(mask & (1ULL << i)))
+                        continue;
+                if (i < X86_MAX && pt_regs_offset[i] != (unsigned int) -1)
+                        *(u64 *)((char *)regs + pt_regs_offset[i]) = values[nr];
+                nr++;
+        }
+
+        return nr;
 }
 
 #endif // __PTRACE_H_
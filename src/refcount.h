@@ -28,11 +28,14 @@ static inline void refcount_inc(refcount_t *r)
      atomic_fetch_add(&r->refs, 1);
 }
 
+/*
+ * The value fetch_sub returns is the only one we may look at, loading
+ * the count again lets two racing puts both see zero.
+ */
 static inline __refcount_check
 bool refcount_dec_and_test(refcount_t *r)
 {
-     atomic_fetch_sub(&r->refs, 1);
-     return !atomic_load(&r->refs);
+     return atomic_fetch_sub(&r->refs, 1) == 1;
 }
 
 #endif // __REFCOUNT_H_
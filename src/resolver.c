@@ -0,0 +1,113 @@
+#include "resolver.h"
+#include "event.h"
+#include "utility.h"
+#include <string.h>
+
+struct resolver *__resolver__new(int max_depth)
+{
+    struct resolver *resolver;
+
+    if (max_depth < 1)
+        max_depth = RESOLVER__MAX_DEPTH;
+
+    resolver = xcalloc(1, sizeof(*resolver) +
+                          max_depth * sizeof(resolver->ips[0]));
+    resolver->max_depth = max_depth;
+    resolver->st.ips = resolver->ips;
+
+    return resolver;
+}
+
+struct resolver *resolver__new(const struct resolver_opts *opts)
+{
+    return __resolver__new(opts ? opts->max_depth : 0);
+}
+
+void resolver__delete(struct resolver *resolver)
+{
+    free(resolver);
+}
+
+/* Unwind @sample into the resolver's own stacktrace. */
+int resolver__resolve_sample(struct resolver *resolver,
+                             struct machine *machine, pid_t tgid, pid_t tid,
+                             const char *comm,
+                             const struct unwind_sample *sample)
+{
+    resolver->st.depth = resolver->max_depth;
+    return machine__resolve_sample(machine, tgid, tid, comm, sample,
+                                   &resolver->st);
+}
+
+int __resolver__resolve(struct resolver *resolver, struct machine *machine,
+                        struct unwind_ctx *uc)
+{
+    resolver->st.depth = resolver->max_depth;
+    return bpf_unwind_ctx__resolve_callchain(&resolver->st, machine, uc);
+}
+
+/*
+ * Follow the saved frame pointers through the captured stack, no maps,
+ * no unwind info. Cheap, but code built without frame pointers loses
+ * its callers or yields garbage, a fallback for when the full unwind
+ * can't keep up.
+ */
+int __resolver__resolve_fp(struct resolver *resolver,
+                           const struct unwind_ctx *uc)
+{
+    struct stacktrace *st = &resolver->st;
+    u64 sp = uc->uregs.sp, bp = uc->uregs.bp, frame[2];
+    u64 size = uc->size > 0 ? uc->size : 0;
+
+    st->depth = 0;
+    st->stack_missing = 0;
+    st->flags = STACKTRACE_FRAME_POINTERS;
+    st->ips[st->depth++] = uc->uregs.ip;
+
+    for (;;) {
+        if (st->depth == resolver->max_depth) {
+            st->stop = UNWIND_STOP_DEPTH;
+            break;
+        }
+        if (!bp) {
+            st->stop = UNWIND_STOP_END;
+            break;
+        }
+        if (bp < sp || size < sizeof(frame) ||
+            bp - sp > size - sizeof(frame)) {
+            st->stop = bp < sp ? UNWIND_STOP_ERROR : UNWIND_STOP_STACK;
+            break;
+        }
+
+        /* The caller's frame pointer, then the return address. */
+        memcpy(frame, uc->data + (bp - sp), sizeof(frame));
+        if (!frame[1]) {
+            st->stop = UNWIND_STOP_END;
+            break;
+        }
+        /* Like the unwinder, point into the call rather than after it. */
+        st->ips[st->depth++] = frame[1] - 1;
+
+        /* Frames only ever go up the stack, anything else is a loop. */
+        if (frame[0] && frame[0] <= bp) {
+            st->stop = UNWIND_STOP_ERROR;
+            break;
+        }
+        bp = frame[0];
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve @uc without allocating: the callchain lives in @resolver and
+ * is overwritten by its next call. Its stop says why it ended, frames
+ * found before a failure are kept.
+ */
+const struct stacktrace *resolver__resolve(struct resolver *resolver,
+                                           struct machine *machine,
+                                           struct unwind_ctx *uc)
+{
+    __resolver__resolve(resolver, machine, uc);
+    return &resolver->st;
+}
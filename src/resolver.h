@@ -0,0 +1,32 @@
+#ifndef __RESOLVER_H_
+#define __RESOLVER_H_
+
+#include "types.h"
+#include "unwind.h"
+#include "libdw_bpf.h"
+
+#define RESOLVER__MAX_DEPTH    64
+
+struct machine;
+
+/*
+ * Everything a resolving thread needs per event, allocated once: the
+ * callchain of the last event and the ips it points into.
+ */
+struct resolver {
+    struct stacktrace st;
+    int max_depth;
+    u64 ips[0];
+};
+
+struct resolver *__resolver__new(int max_depth);
+int __resolver__resolve(struct resolver *resolver, struct machine *machine,
+                        struct unwind_ctx *uc);
+int __resolver__resolve_fp(struct resolver *resolver,
+                           const struct unwind_ctx *uc);
+int resolver__resolve_sample(struct resolver *resolver,
+                             struct machine *machine, pid_t tgid, pid_t tid,
+                             const char *comm,
+                             const struct unwind_sample *sample);
+
+#endif // __RESOLVER_H_
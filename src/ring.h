@@ -0,0 +1,292 @@
+#ifndef __RING_H_
+#define __RING_H_
+
+#include "types.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include "hash.h"
+#include <string.h>
+
+/*
+ * Bounded single-producer single-consumer ring of fixed size entries.
+ *
+ * The producer reserves the next entry, fills it in place and commits
+ * it, the consumer peeks at the oldest entry, works on it in place and
+ * consumes it. Each side only ever stores its own index, and keeps a
+ * cached copy of the other one so it only touches the other side's
+ * cache line when the ring looks full (or empty).
+ */
+struct spsc_ring {
+    /* Consumer side. */
+    cache_aligned(atomic_uint_least64_t head);
+    u64 tail_cache;
+
+    /* Producer side. */
+    cache_aligned(atomic_uint_least64_t tail);
+    u64 head_cache;
+
+    u64 mask;
+    size_t entry_size;
+    cache_aligned(char data[0]);
+};
+
+static inline struct spsc_ring *spsc_ring__new(unsigned int nr_entries,
+                                               size_t entry_size)
+{
+    struct spsc_ring *ring;
+
+    entry_size = (entry_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    ring = xzalloc_aligned(alignof(*ring),
+                           sizeof(*ring) + (size_t)nr_entries * entry_size);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask = nr_entries - 1;
+    ring->entry_size = entry_size;
+
+    return ring;
+}
+
+static inline void spsc_ring__delete(struct spsc_ring *ring)
+{
+    free(ring);
+}
+
+static inline void *spsc_ring__entry(struct spsc_ring *ring, u64 idx)
+{
+    return ring->data + (idx & ring->mask) * ring->entry_size;
+}
+
+/* Producer: next free entry, or NULL if the ring is full. */
+static inline void *spsc_ring__reserve(struct spsc_ring *ring)
+{
+    u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache = atomic_load_explicit(&ring->head,
+                                                memory_order_acquire);
+        if (tail - ring->head_cache > ring->mask)
+            return NULL;
+    }
+
+    return spsc_ring__entry(ring, tail);
+}
+
+/* Producer: hand the entry returned by spsc_ring__reserve() over. */
+static inline void spsc_ring__commit(struct spsc_ring *ring)
+{
+    u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Consumer: oldest committed entry, or NULL if the ring is empty. */
+static inline void *spsc_ring__peek(struct spsc_ring *ring)
+{
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head == ring->tail_cache) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail,
+                                                memory_order_acquire);
+        if (head == ring->tail_cache)
+            return NULL;
+    }
+
+    return spsc_ring__entry(ring, head);
+}
+
+/* Consumer: give the entry returned by spsc_ring__peek() back. */
+static inline void spsc_ring__consume(struct spsc_ring *ring)
+{
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Either side: a snapshot of how many entries are queued. */
+static inline unsigned int spsc_ring__count(struct spsc_ring *ring)
+{
+    /* head first, tail can only have moved further by then */
+    u64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+}
+
+/*
+ * Bounded multi-producer multi-consumer ring of fixed size entries,
+ * after Dmitry Vyukov's bounded queue. Every entry carries a sequence
+ * number that says whose turn it is: producers claim entries with a
+ * CAS on tail and hand them over by bumping their sequence, consumers
+ * claim them with a CAS on head and give them back the same way. Runs
+ * of consecutive entries can be claimed with one CAS. Nothing blocks
+ * and nothing allocates, so it is fine to produce from a signal handler.
+ */
+struct mpmc_ring_entry {
+    atomic_uint_least64_t seq;
+    char data[0];
+};
+
+struct mpmc_ring {
+    /* Producer side. */
+    cache_aligned(atomic_uint_least64_t tail);
+
+    /* Consumer side. */
+    cache_aligned(atomic_uint_least64_t head);
+
+    u64 mask;
+    size_t entry_size;
+    cache_aligned(char data[0]);
+};
+
+static inline struct mpmc_ring_entry *
+mpmc_ring__entry(struct mpmc_ring *ring, u64 pos)
+{
+    return (struct mpmc_ring_entry *)
+        (ring->data + (pos & ring->mask) * ring->entry_size);
+}
+
+/* The data of the entry at @pos, as claimed by a run. */
+static inline void *mpmc_ring__data(struct mpmc_ring *ring, u64 pos)
+{
+    return mpmc_ring__entry(ring, pos)->data;
+}
+
+/*
+ * Small entries are packed, a queue of pointers would waste most of
+ * every cache line otherwise. Large ones start on a cache line.
+ */
+static inline struct mpmc_ring *mpmc_ring__new(unsigned int nr_entries,
+                                               size_t entry_size)
+{
+    struct mpmc_ring *ring;
+    u64 i;
+
+    entry_size += sizeof(struct mpmc_ring_entry);
+    if (entry_size < CACHE_LINE_SIZE)
+        entry_size = roundup_pow_of_two(entry_size);
+    else
+        entry_size = ALIGN(entry_size, CACHE_LINE_SIZE);
+    ring = xzalloc_aligned(alignof(*ring),
+                           sizeof(*ring) + (size_t)nr_entries * entry_size);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    ring->mask = nr_entries - 1;
+    ring->entry_size = entry_size;
+    for (i = 0; i < nr_entries; i++)
+        atomic_init(&mpmc_ring__entry(ring, i)->seq, i);
+
+    return ring;
+}
+
+static inline void mpmc_ring__delete(struct mpmc_ring *ring)
+{
+    free(ring);
+}
+
+/*
+ * Claim up to @n consecutive entries at @index whose sequence is @pos
+ * plus @ready, the first one at *@pos. An entry in that state stays in
+ * it until someone moves @index past it, so checking them first and
+ * then moving @index over the run in one CAS is enough.
+ */
+static inline unsigned int __mpmc_ring__claim(struct mpmc_ring *ring,
+                                              atomic_uint_least64_t *index,
+                                              u64 ready, unsigned int n,
+                                              u64 *pos)
+{
+    u64 first = atomic_load_explicit(index, memory_order_relaxed);
+    struct mpmc_ring_entry *entry;
+    unsigned int nr;
+    s64 diff = 0;
+
+    if (!n)
+        return 0;
+
+    for (;;) {
+        for (nr = 0; nr < n; nr++) {
+            entry = mpmc_ring__entry(ring, first + nr);
+            diff = (s64)(atomic_load_explicit(&entry->seq,
+                                              memory_order_acquire) -
+                         (first + nr + ready));
+            if (diff)
+                break;
+        }
+
+        if (!nr) {
+            if (diff < 0)
+                return 0;
+            /* Someone else claimed it, try their successor. */
+            first = atomic_load_explicit(index, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(index, &first,
+                                                         first + nr,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+            *pos = first;
+            return nr;
+        }
+    }
+}
+
+/* Producer: claim up to @n free entries, fill them and commit each. */
+static inline unsigned int mpmc_ring__reserve_n(struct mpmc_ring *ring,
+                                                unsigned int n, u64 *pos)
+{
+    return __mpmc_ring__claim(ring, &ring->tail, 0, n, pos);
+}
+
+/* Producer: claim the next free entry, or NULL if the ring is full. */
+static inline void *mpmc_ring__reserve(struct mpmc_ring *ring)
+{
+    u64 pos;
+
+    return mpmc_ring__reserve_n(ring, 1, &pos) ?
+           mpmc_ring__data(ring, pos) : NULL;
+}
+
+/* Producer: hand an entry that was reserved over. */
+static inline void mpmc_ring__commit(struct mpmc_ring *ring __maybe_unused,
+                                     void *data)
+{
+    struct mpmc_ring_entry *entry = container_of(data, struct mpmc_ring_entry,
+                                                 data);
+    u64 seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_release);
+}
+
+/* Consumer: claim up to @n committed entries, release each when done. */
+static inline unsigned int mpmc_ring__claim_n(struct mpmc_ring *ring,
+                                              unsigned int n, u64 *pos)
+{
+    return __mpmc_ring__claim(ring, &ring->head, 1, n, pos);
+}
+
+/* Consumer: the oldest committed entry, or NULL if there is none yet. */
+static inline void *mpmc_ring__claim(struct mpmc_ring *ring)
+{
+    u64 pos;
+
+    return mpmc_ring__claim_n(ring, 1, &pos) ?
+           mpmc_ring__data(ring, pos) : NULL;
+}
+
+/* Consumer: give an entry that was claimed back to the producers. */
+static inline void mpmc_ring__release(struct mpmc_ring *ring, void *data)
+{
+    struct mpmc_ring_entry *entry = container_of(data, struct mpmc_ring_entry,
+                                                 data);
+    u64 seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    /* seq is its position + 1, the next lap's producer wants + size. */
+    atomic_store_explicit(&entry->seq, seq + ring->mask, memory_order_release);
+}
+
+/* Either side: whether the oldest entry is committed yet. */
+static inline bool mpmc_ring__ready(struct mpmc_ring *ring)
+{
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    return atomic_load_explicit(&mpmc_ring__entry(ring, head)->seq,
+                                memory_order_acquire) == head + 1;
+}
+
+#endif // __RING_H_
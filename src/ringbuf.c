@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include "ringbuf.h"
+#include "bpf_syscall.h"
+#include "utility.h"
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/*
+ * The positions and headers live in memory the kernel writes to, so
+ * they are accessed with the builtins rather than through atomic types,
+ * the same acquire/release pairs libbpf uses.
+ */
+#define load_acquire(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int ringbuf__map_size(int map_fd, u32 *size)
+{
+    struct bpf_map_info info;
+    int ret = sys_bpf_obj_info(map_fd, &info, sizeof(info));
+
+    if (ret)
+        return ret;
+
+    *size = info.max_entries;
+    return 0;
+}
+
+void ringbuf__delete(struct ringbuf *rb)
+{
+    if (!rb)
+        return;
+
+    if (rb->consumer_map)
+        munmap(rb->consumer_map, rb->page_size);
+    if (rb->producer_map)
+        munmap(rb->producer_map, rb->producer_map_size);
+    if (rb->epoll_fd >= 0)
+        close(rb->epoll_fd);
+    if (rb->event_fd >= 0)
+        close(rb->event_fd);
+    free(rb);
+}
+
+static struct ringbuf *ringbuf__alloc(void)
+{
+    struct ringbuf *rb = xcalloc(1, sizeof(*rb));
+
+    rb->map_fd = -1;
+    rb->epoll_fd = -1;
+    rb->event_fd = -1;
+    rb->page_size = sysconf(_SC_PAGESIZE);
+
+    return rb;
+}
+
+/*
+ * Map the BPF_MAP_TYPE_RINGBUF behind @map_fd: the consumer page
+ * read-write, the producer page and the data area, which the kernel
+ * maps twice so that no record ever wraps, read-only.
+ */
+struct ringbuf *ringbuf__new(int map_fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct ringbuf *rb = ringbuf__alloc();
+    u32 size;
+
+    if (ringbuf__map_size(map_fd, &size))
+        goto out_err;
+
+    rb->map_fd = map_fd;
+    rb->mask = size - 1;
+
+    rb->consumer_map = mmap(NULL, rb->page_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, map_fd, 0);
+    if (rb->consumer_map == MAP_FAILED) {
+        rb->consumer_map = NULL;
+        goto out_err;
+    }
+
+    rb->producer_map_size = rb->page_size + 2 * (size_t)size;
+    rb->producer_map = mmap(NULL, rb->producer_map_size, PROT_READ,
+                            MAP_SHARED, map_fd, rb->page_size);
+    if (rb->producer_map == MAP_FAILED) {
+        rb->producer_map = NULL;
+        goto out_err;
+    }
+
+    rb->consumer_pos = rb->consumer_map;
+    rb->producer_pos = rb->producer_map;
+    rb->data = (char *)rb->producer_map + rb->page_size;
+
+    rb->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (rb->epoll_fd < 0 ||
+        epoll_ctl(rb->epoll_fd, EPOLL_CTL_ADD, map_fd, &ev) < 0)
+        goto out_err;
+
+    return rb;
+
+out_err:
+    ringbuf__delete(rb);
+    return NULL;
+}
+
+/*
+ * A ring with the kernel's layout that lives in plain memory, filled
+ * with ringbuf__reserve()/ringbuf__submit() or ringbuf__replay(). It
+ * lets recorded events be fed through the same consumer, in tests or
+ * when replaying a capture, without loading a BPF program. Submits
+ * signal an eventfd, ringbuf__poll() waits on it like on the kernel's.
+ */
+struct ringbuf *ringbuf__new_replay(size_t size)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct ringbuf *rb = ringbuf__alloc();
+    size_t page_size = rb->page_size;
+    char *base;
+    int fd;
+
+    if (size < page_size || (size & (size - 1)))
+        goto out_err;
+
+    fd = memfd_create("libdw_bpf-ringbuf", MFD_CLOEXEC);
+    if (fd < 0)
+        goto out_err;
+
+    /* [consumer page][producer page][data] */
+    if (ftruncate(fd, 2 * page_size + size) < 0)
+        goto out_close;
+
+    rb->mask = size - 1;
+    rb->consumer_map = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    if (rb->consumer_map == MAP_FAILED) {
+        rb->consumer_map = NULL;
+        goto out_close;
+    }
+
+    /* Reserve the whole range first, then map the data over it twice. */
+    rb->producer_map_size = page_size + 2 * size;
+    base = mmap(NULL, rb->producer_map_size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto out_close;
+    rb->producer_map = base;
+
+    if (mmap(base, page_size + size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, page_size) == MAP_FAILED ||
+        mmap(base + page_size + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 2 * page_size) == MAP_FAILED)
+        goto out_close;
+
+    close(fd);
+
+    rb->consumer_pos = rb->consumer_map;
+    rb->producer_pos = rb->producer_map;
+    rb->data = base + page_size;
+
+    rb->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    rb->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ev.data.fd = rb->event_fd;
+    if (rb->event_fd < 0 || rb->epoll_fd < 0 ||
+        epoll_ctl(rb->epoll_fd, EPOLL_CTL_ADD, rb->event_fd, &ev) < 0)
+        goto out_err;
+
+    return rb;
+
+out_close:
+    close(fd);
+out_err:
+    ringbuf__delete(rb);
+    return NULL;
+}
+
+/*
+ * Replay producer, the userspace twin of bpf_ringbuf_reserve(). Only
+ * one thread may produce. Returns NULL if the consumer hasn't made
+ * room for @size bytes yet.
+ */
+struct unwind_ctx *ringbuf__reserve(struct ringbuf *rb, int size)
+{
+    unsigned long cons, prod, total;
+    struct ringbuf_hdr *hdr;
+
+    if (rb->map_fd >= 0 || size <= 0)
+        return NULL;
+
+    total = ALIGN(size + RINGBUF__HDR_SZ, 8);
+    if (total > rb->mask + 1)
+        return NULL;
+
+    cons = load_acquire(rb->consumer_pos);
+    prod = *rb->producer_pos;
+    if (prod - cons + total > rb->mask + 1)
+        return NULL;
+
+    hdr = (struct ringbuf_hdr *)(rb->data + (prod & rb->mask));
+    hdr->len = size | RINGBUF__BUSY_BIT;
+    hdr->pg_off = 0;
+    store_release(rb->producer_pos, prod + total);
+
+    return (struct unwind_ctx *)(hdr + 1);
+}
+
+static void ringbuf__commit(struct ringbuf *rb, struct unwind_ctx *uc,
+                            u32 flags)
+{
+    struct ringbuf_hdr *hdr = (struct ringbuf_hdr *)uc - 1;
+    u64 one = 1;
+
+    store_release(&hdr->len, (hdr->len & ~RINGBUF__BUSY_BIT) | flags);
+    /* Only fails if the count would overflow, it is still signalled. */
+    write(rb->event_fd, &one, sizeof(one));
+}
+
+void ringbuf__submit(struct ringbuf *rb, struct unwind_ctx *uc)
+{
+    ringbuf__commit(rb, uc, 0);
+}
+
+void ringbuf__discard(struct ringbuf *rb, struct unwind_ctx *uc)
+{
+    ringbuf__commit(rb, uc, RINGBUF__DISCARD_BIT);
+}
+
+/* Copy the first @size bytes of @uc in as one record. */
+int ringbuf__replay(struct ringbuf *rb, const struct unwind_ctx *uc, int size)
+{
+    struct unwind_ctx *rec = ringbuf__reserve(rb, size);
+
+    if (!rec)
+        return -ENOSPC;
+
+    memcpy(rec, uc, size);
+    ringbuf__submit(rb, rec);
+
+    return 0;
+}
+
+/*
+ * Hand every committed record to @cb in place, it must be done with
+ * the record when it returns since the slot is given back right after.
+ * Stops at the first record that is still being written, or when @cb
+ * returns an error, which is passed on. Returns the number of records
+ * otherwise.
+ */
+int ringbuf__consume(struct ringbuf *rb, ringbuf_cb_t cb, void *cookie)
+{
+    unsigned long cons, prod;
+    struct ringbuf_hdr *hdr;
+    bool progress;
+    int nr = 0, ret;
+    u32 len;
+
+    cons = load_acquire(rb->consumer_pos);
+    do {
+        progress = false;
+        prod = load_acquire(rb->producer_pos);
+
+        while (cons < prod) {
+            hdr = (struct ringbuf_hdr *)(rb->data + (cons & rb->mask));
+            len = load_acquire(&hdr->len);
+            if (len & RINGBUF__BUSY_BIT)
+                goto out;
+
+            progress = true;
+            cons += ALIGN((len & ~RINGBUF__DISCARD_BIT) + RINGBUF__HDR_SZ, 8);
+
+            if (!(len & RINGBUF__DISCARD_BIT)) {
+                ret = cb((struct unwind_ctx *)(hdr + 1),
+                         len & ~RINGBUF__DISCARD_BIT, cookie);
+                if (ret < 0) {
+                    store_release(rb->consumer_pos, cons);
+                    return ret;
+                }
+                nr++;
+            }
+
+            store_release(rb->consumer_pos, cons);
+        }
+    } while (progress);
+
+out:
+    return nr;
+}
+
+/*
+ * Wait up to @timeout ms for the kernel, or a replay ring's producer,
+ * to signal new data, then consume.
+ */
+int ringbuf__poll(struct ringbuf *rb, int timeout,
+                  ringbuf_cb_t cb, void *cookie)
+{
+    struct epoll_event ev;
+    u64 count;
+
+    if (epoll_wait(rb->epoll_fd, &ev, 1, timeout) < 0 && errno != EINTR)
+        return -errno;
+
+    /* Reset before consuming, later submits signal it again. */
+    if (rb->event_fd >= 0 && read(rb->event_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN)
+        return -errno;
+
+    return ringbuf__consume(rb, cb, cookie);
+}
@@ -0,0 +1,38 @@
+#ifndef __RINGBUF_H_
+#define __RINGBUF_H_
+
+#include "types.h"
+#include "libdw_bpf.h"
+
+/*
+ * Layout of BPF_MAP_TYPE_RINGBUF as mapped into userspace, see
+ * kernel/bpf/ringbuf.c. Every record starts with an 8 byte header,
+ * len keeps the busy bit set until the producer committed it.
+ */
+#define RINGBUF__BUSY_BIT       (1U << 31)
+#define RINGBUF__DISCARD_BIT    (1U << 30)
+#define RINGBUF__HDR_SZ         8
+
+struct ringbuf_hdr {
+    u32 len;
+    u32 pg_off;
+};
+
+struct ringbuf {
+    unsigned long *consumer_pos;
+    unsigned long *producer_pos;
+    char *data;          /* mapped twice back to back */
+    u64 mask;
+
+    int map_fd;          /* -1 for a replay ring */
+    int epoll_fd;
+    int event_fd;        /* a replay ring's submits signal it */
+    size_t page_size;
+
+    /* Whole mappings, for unmapping. */
+    void *consumer_map;
+    void *producer_map;
+    size_t producer_map_size;
+};
+
+#endif // __RINGBUF_H_
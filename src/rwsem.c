@@ -1,8 +1,9 @@
 #include "rwsem.h"
 #include "utility.h"
 
-int init_rwsem(struct rw_semaphore *sem)
+int init_rwsem(struct rw_semaphore *sem, bool threaded)
 {
+     sem->threaded = threaded;
      return pthread_rwlock_init(&sem->lock, NULL);
 }
 
@@ -13,20 +14,20 @@ int exit_rwsem(struct rw_semaphore *sem)
 
 int down_read(struct rw_semaphore *sem)
 {
-     return singlethreaded ? 0 : pthread_rwlock_rdlock(&sem->lock);
+     return sem->threaded ? pthread_rwlock_rdlock(&sem->lock) : 0;
 }
 
 int up_read(struct rw_semaphore *sem)
 {
-     return singlethreaded ? 0 : pthread_rwlock_unlock(&sem->lock);
+     return sem->threaded ? pthread_rwlock_unlock(&sem->lock) : 0;
 }
 
 int down_write(struct rw_semaphore *sem)
 {
-     return singlethreaded ? 0 : pthread_rwlock_wrlock(&sem->lock);
+     return sem->threaded ? pthread_rwlock_wrlock(&sem->lock) : 0;
 }
 
 int up_write(struct rw_semaphore *sem)
 {
-     return singlethreaded ? 0 : pthread_rwlock_unlock(&sem->lock);
+     return sem->threaded ? pthread_rwlock_unlock(&sem->lock) : 0;
 }
@@ -2,12 +2,19 @@
 #define __RWSEM_H_
 
 #include <pthread.h>
+#include <stdbool.h>
 
+/*
+ * Locks are only taken when the owning machine was created with
+ * MACHINE_THREADING_CONCURRENT, otherwise they compile down to a
+ * branch on @threaded.
+ */
 struct rw_semaphore {
         pthread_rwlock_t lock;
+        bool threaded;
 };
 
-int init_rwsem(struct rw_semaphore *sem);
+int init_rwsem(struct rw_semaphore *sem, bool threaded);
 int exit_rwsem(struct rw_semaphore *sem);
 
 int down_read(struct rw_semaphore *sem);
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include "libdw_bpf.h"
+#include "machine.h"
+#include "thread.h"
+#include "map.h"
+#include "event.h"
+#include "resolver.h"
+#include "ring.h"
+#include "unwind.h"
+#include "utility.h"
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Samples the calling process itself, no privileges needed: a
+ * CLOCK_PROCESS_CPUTIME_ID timer raises SIGPROF, the handler copies the
+ * interrupted registers and the top of the stack into an unwind_ctx on
+ * a lock-free ring, and a resolver thread unwinds them against the
+ * process's own /proc/self/maps. The resolver blocks SIGPROF, so it is
+ * never sampled itself.
+ *
+ * Only one sampler can run in a process at a time, the signal handler
+ * is process wide.
+ */
+
+#define SELF_SAMPLER__FREQ          99
+#define SELF_SAMPLER__RING_SIZE     256
+#define SELF_SAMPLER__MAX_DEPTH     128
+#define SELF_SAMPLER__PAGE          4096
+#define SELF_SAMPLER__CHUNKS        (STACK_SIZE / SELF_SAMPLER__PAGE + 1)
+
+struct self_sampler {
+    struct machine *machine;
+    struct self_sampler_opts opts;
+    struct mpmc_ring *ring;
+    pid_t tgid;
+    timer_t timer;
+    bool timer_created;
+    struct sigaction old_action;
+    bool action_set;
+
+    pthread_t resolver_thread;
+    bool resolver_started;
+    int event_fd;
+    atomic_bool sleeping;
+    atomic_bool stop;
+
+    atomic_uint_least64_t lost;
+    struct resolver *resolver;
+};
+
+static _Atomic(struct self_sampler *) self_sampler;
+static atomic_int self_sampler_handlers;    /* handlers running */
+
+static u64 self_sampler__now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pt_regs__from_ucontext(struct pt_regs *regs, const ucontext_t *uc)
+{
+    const greg_t *gregs = uc->uc_mcontext.gregs;
+
+    regs->r15 = gregs[REG_R15];
+    regs->r14 = gregs[REG_R14];
+    regs->r13 = gregs[REG_R13];
+    regs->r12 = gregs[REG_R12];
+    regs->bp = gregs[REG_RBP];
+    regs->bx = gregs[REG_RBX];
+    regs->r11 = gregs[REG_R11];
+    regs->r10 = gregs[REG_R10];
+    regs->r9 = gregs[REG_R9];
+    regs->r8 = gregs[REG_R8];
+    regs->ax = gregs[REG_RAX];
+    regs->cx = gregs[REG_RCX];
+    regs->dx = gregs[REG_RDX];
+    regs->si = gregs[REG_RSI];
+    regs->di = gregs[REG_RDI];
+    regs->ip = gregs[REG_RIP];
+    regs->sp = gregs[REG_RSP];
+    regs->flags = gregs[REG_EFL];
+}
+
+/*
+ * Copy up to @len bytes of our own stack from @sp. Reading past the
+ * end of the stack mapping must not fault, so it goes through
+ * process_vm_readv() page by page like the BPF side does: the copy
+ * stops at the first page that isn't there.
+ */
+static int self_sampler__read_stack(struct self_sampler *sampler,
+                                    char *dst, u32 len, u64 sp)
+{
+    struct iovec local[SELF_SAMPLER__CHUNKS], remote[SELF_SAMPLER__CHUNKS];
+    u32 off = 0, chunk;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < SELF_SAMPLER__CHUNKS && off < len; i++) {
+        chunk = SELF_SAMPLER__PAGE - ((sp + off) & (SELF_SAMPLER__PAGE - 1));
+        if (chunk > len - off)
+            chunk = len - off;
+        local[i].iov_base = dst + off;
+        local[i].iov_len = chunk;
+        remote[i].iov_base = (void *)(sp + off);
+        remote[i].iov_len = chunk;
+        off += chunk;
+    }
+
+    ret = syscall(SYS_process_vm_readv, sampler->tgid, local, i, remote, i, 0);
+    return ret < 0 ? 0 : ret;
+}
+
+static void self_sampler__wake(struct self_sampler *sampler)
+{
+    u64 one = 1;
+
+    /* Pairs with the fence in self_sampler__park(). */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sampler->sleeping, memory_order_relaxed))
+        write(sampler->event_fd, &one, sizeof(one));
+}
+
+/* Async signal safe from here on: syscalls and atomics only. */
+static void self_sampler__signal(int sig __maybe_unused,
+                                 siginfo_t *info __maybe_unused, void *ctx)
+{
+    struct self_sampler *sampler;
+    struct unwind_ctx *uc;
+    int saved_errno = errno;
+
+    atomic_fetch_add(&self_sampler_handlers, 1);
+    sampler = atomic_load(&self_sampler);
+    if (!sampler)
+        goto out;
+
+    uc = mpmc_ring__reserve(sampler->ring);
+    if (!uc) {
+        atomic_fetch_add_explicit(&sampler->lost, 1, memory_order_relaxed);
+        goto out;
+    }
+
+    uc->ts = self_sampler__now();
+    uc->tgid = sampler->tgid;
+    uc->tid = syscall(SYS_gettid);
+    uc->name[0] = '\0';
+    memset(&uc->uregs, 0, sizeof(uc->uregs));
+    pt_regs__from_ucontext(&uc->uregs, ctx);
+    uc->size = self_sampler__read_stack(sampler, uc->data,
+                                        sampler->opts.stack_size,
+                                        uc->uregs.sp);
+
+    mpmc_ring__commit(sampler->ring, uc);
+    self_sampler__wake(sampler);
+
+out:
+    atomic_fetch_sub(&self_sampler_handlers, 1);
+    errno = saved_errno;
+}
+
+static void self_sampler__resolve(struct self_sampler *sampler,
+                                  struct unwind_ctx *uc)
+{
+    struct unwind_sample sample = {
+        .regs = &uc->uregs,
+        .stack = uc->data,
+        .size = uc->size,
+    };
+    int ret;
+
+    machine__prepare_thread(sampler->machine, uc->tgid, uc->tid,
+                            uc->uregs.ip);
+
+    ret = resolver__resolve_sample(sampler->resolver, sampler->machine,
+                                   uc->tgid, uc->tid, NULL, &sample);
+
+    if (sampler->opts.callback)
+        sampler->opts.callback(uc->tgid, uc->tid, uc->ts,
+                               &sampler->resolver->st, ret,
+                               sampler->opts.cookie);
+}
+
+static void self_sampler__park(struct self_sampler *sampler)
+{
+    struct pollfd pfd = { .fd = sampler->event_fd, .events = POLLIN };
+    u64 count;
+
+    atomic_store(&sampler->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!mpmc_ring__ready(sampler->ring) && !atomic_load(&sampler->stop))
+        poll(&pfd, 1, -1);
+    atomic_store(&sampler->sleeping, false);
+
+    if (pfd.revents & POLLIN)
+        read(sampler->event_fd, &count, sizeof(count));
+}
+
+static void *self_sampler__resolver(void *arg)
+{
+    struct self_sampler *sampler = arg;
+    struct unwind_ctx *uc;
+
+    for (;;) {
+        uc = mpmc_ring__claim(sampler->ring);
+        if (uc) {
+            self_sampler__resolve(sampler, uc);
+            mpmc_ring__release(sampler->ring, uc);
+            continue;
+        }
+        if (atomic_load(&sampler->stop))
+            break;
+        self_sampler__park(sampler);
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop sampling and wait for the handlers still running on other
+ * threads, then resolve what is still queued.
+ */
+void self_sampler__delete(struct self_sampler *sampler)
+{
+    u64 one = 1;
+
+    if (!sampler)
+        return;
+
+    if (sampler->timer_created)
+        timer_delete(sampler->timer);
+    if (atomic_load(&self_sampler) == sampler) {
+        atomic_store(&self_sampler, NULL);
+        while (atomic_load(&self_sampler_handlers))
+            sched_yield();
+    }
+    if (sampler->action_set)
+        sigaction(SIGPROF, &sampler->old_action, NULL);
+
+    if (sampler->resolver_started) {
+        atomic_store(&sampler->stop, true);
+        write(sampler->event_fd, &one, sizeof(one));
+        pthread_join(sampler->resolver_thread, NULL);
+    }
+
+    if (sampler->event_fd >= 0)
+        close(sampler->event_fd);
+    if (sampler->ring)
+        mpmc_ring__delete(sampler->ring);
+    resolver__delete(sampler->resolver);
+    free(sampler);
+}
+
+static int self_sampler__start_resolver(struct self_sampler *sampler)
+{
+    sigset_t mask, old;
+    int ret;
+
+    /* Inherited by the resolver, SIGPROF always goes elsewhere. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    ret = pthread_create(&sampler->resolver_thread, NULL,
+                         self_sampler__resolver, sampler);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret)
+        return -ret;
+
+    sampler->resolver_started = true;
+    return 0;
+}
+
+/*
+ * Start sampling this process every 1/sample_freq s of its CPU time,
+ * the machine has to outlive the sampler. Callbacks run on the
+ * sampler's own resolver thread. Returns NULL with errno set, EBUSY if
+ * a sampler is running already.
+ */
+struct self_sampler *self_sampler__new(struct machine *machine,
+                                       const struct self_sampler_opts *opts)
+{
+    struct self_sampler *sampler = xcalloc(1, sizeof(*sampler));
+    struct self_sampler *expected = NULL;
+    struct sigevent sev = { 0 };
+    struct sigaction action = { 0 };
+    struct itimerspec its = { 0 };
+    unsigned int ring_size;
+    int ret;
+
+    sampler->machine = machine;
+    sampler->tgid = getpid();
+    sampler->event_fd = -1;
+    if (opts)
+        sampler->opts = *opts;
+    if (!sampler->opts.sample_freq)
+        sampler->opts.sample_freq = SELF_SAMPLER__FREQ;
+    if (!sampler->opts.stack_size || sampler->opts.stack_size > STACK_SIZE)
+        sampler->opts.stack_size = STACK_SIZE;
+    if (sampler->opts.max_depth < 1)
+        sampler->opts.max_depth = SELF_SAMPLER__MAX_DEPTH;
+
+    ring_size = sampler->opts.ring_size;
+    if (!ring_size)
+        ring_size = SELF_SAMPLER__RING_SIZE;
+    if (ring_size & (ring_size - 1)) {
+        ret = -EINVAL;
+        goto out_err;
+    }
+
+    sampler->resolver = __resolver__new(sampler->opts.max_depth);
+    sampler->ring = mpmc_ring__new(ring_size, sizeof(struct unwind_ctx));
+    sampler->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sampler->event_fd < 0) {
+        ret = -errno;
+        goto out_err;
+    }
+
+    if (!atomic_compare_exchange_strong(&self_sampler, &expected, sampler)) {
+        ret = -EBUSY;
+        goto out_err;
+    }
+
+    ret = self_sampler__start_resolver(sampler);
+    if (ret)
+        goto out_err;
+
+    action.sa_sigaction = self_sampler__signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &sampler->old_action)) {
+        ret = -errno;
+        goto out_err;
+    }
+    sampler->action_set = true;
+
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGPROF;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &sampler->timer)) {
+        ret = -errno;
+        goto out_err;
+    }
+    sampler->timer_created = true;
+
+    its.it_interval.tv_sec = 1 / sampler->opts.sample_freq;
+    its.it_interval.tv_nsec = 1000000000ULL / sampler->opts.sample_freq %
+                              1000000000ULL;
+    its.it_value = its.it_interval;
+    if (timer_settime(sampler->timer, 0, &its, NULL)) {
+        ret = -errno;
+        goto out_err;
+    }
+
+    return sampler;
+
+out_err:
+    self_sampler__delete(sampler);
+    errno = -ret;
+    return NULL;
+}
+
+/* Samples dropped because the resolver fell behind and the ring was full. */
+u64 self_sampler__lost(struct self_sampler *sampler)
+{
+    return atomic_load(&sampler->lost);
+}
@@ -0,0 +1,110 @@
+#include "stack_usage.h"
+#include "machine.h"
+#include "thread.h"
+#include "map.h"
+#include "bpf_syscall.h"
+#include "utility.h"
+
+void stack_usage__init(struct stack_usage *su)
+{
+     int i;
+
+     for (i = 0; i < STACK_USAGE__BUCKETS; i++)
+          atomic_init(&su->buckets[i], 0);
+}
+
+void stack_usage__add(struct stack_usage *su, u64 bytes)
+{
+     u64 i = bytes / STACK_USAGE__BUCKET;
+
+     if (!bytes)
+          return;
+     if (i >= STACK_USAGE__BUCKETS)
+          i = STACK_USAGE__BUCKETS - 1;
+
+     atomic_fetch_add_explicit(&su->buckets[i], 1, memory_order_relaxed);
+}
+
+/*
+ * Upper bound of the bucket the @pct'th percentile falls in, 0 without
+ * samples. Every count is halved on the way, so old unwinds fade out
+ * and the size follows the process when it changes behaviour.
+ */
+u64 stack_usage__percentile(struct stack_usage *su, unsigned int pct)
+{
+     unsigned int counts[STACK_USAGE__BUCKETS];
+     u64 total = 0, seen = 0;
+     int i;
+
+     for (i = 0; i < STACK_USAGE__BUCKETS; i++) {
+          counts[i] = atomic_load_explicit(&su->buckets[i],
+                                           memory_order_relaxed);
+          atomic_fetch_sub_explicit(&su->buckets[i], counts[i] / 2,
+                                    memory_order_relaxed);
+          total += counts[i];
+     }
+
+     if (!total)
+          return 0;
+
+     for (i = 0; i < STACK_USAGE__BUCKETS; i++) {
+          seen += counts[i];
+          if (seen * 100 >= total * min(pct, 100U))
+               break;
+     }
+
+     return (u64)(i + 1) * STACK_USAGE__BUCKET;
+}
+
+struct stack_sizes_args {
+     int map_fd;
+     unsigned int percentile;
+     unsigned int headroom;
+     int err;
+};
+
+static int stack_usage__publish(struct thread *thread, void *priv)
+{
+     struct stack_sizes_args *args = priv;
+     u32 tgid = thread->tgid, size;
+     u64 used;
+     int err;
+
+     /* One entry per process, its maps are shared by all threads. */
+     if (thread->tid != thread->tgid || !thread->maps)
+          return 0;
+
+     used = stack_usage__percentile(&thread->maps->stack_usage,
+                                    args->percentile);
+     if (!used)
+          return 0;
+
+     size = ALIGN(used + args->headroom, 64);
+     err = sys_bpf_map_update(args->map_fd, &tgid, &size, BPF_ANY);
+     if (err && !args->err)
+          args->err = err;
+
+     return 0;
+}
+
+/*
+ * Tell the capture program behind @map_fd (its stack_sizes map) how
+ * much stack to copy for each process: the @percentile'th percentile of
+ * what its unwinds needed, plus @headroom bytes. The program caps it
+ * at STACK_SIZE. Meant to be called every now and then, each call
+ * also ages the samples it looked at.
+ */
+int machine__publish_stack_sizes(struct machine *machine, int map_fd,
+                                 unsigned int percentile,
+                                 unsigned int headroom)
+{
+     struct stack_sizes_args args = {
+          .map_fd     = map_fd,
+          .percentile = percentile,
+          .headroom   = headroom,
+     };
+
+     machine__for_each_thread(machine, stack_usage__publish, &args);
+
+     return args.err;
+}
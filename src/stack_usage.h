@@ -0,0 +1,25 @@
+#ifndef __STACK_USAGE_H_
+#define __STACK_USAGE_H_
+
+#include "types.h"
+#include "stdatomic.h"
+
+/*
+ * How many bytes above the sampled sp the unwinds of one process had
+ * to read, kept per process so the capture program can be told to copy
+ * just about that much. Accesses further away than the window are not
+ * taken for stack reads.
+ */
+#define STACK_USAGE__BUCKET     512
+#define STACK_USAGE__WINDOW     (64 * 1024)
+#define STACK_USAGE__BUCKETS    (STACK_USAGE__WINDOW / STACK_USAGE__BUCKET)
+
+struct stack_usage {
+     atomic_uint buckets[STACK_USAGE__BUCKETS];
+};
+
+void stack_usage__init(struct stack_usage *su);
+void stack_usage__add(struct stack_usage *su, u64 bytes);
+u64 stack_usage__percentile(struct stack_usage *su, unsigned int pct);
+
+#endif // __STACK_USAGE_H_
@@ -0,0 +1,107 @@
+#include "stats.h"
+#include "machine.h"
+#include <string.h>
+
+__thread struct machine_stats_cache machine_stats_cache;
+
+/* Starts at 1, a zeroed cache never matches. */
+static atomic_uint_least64_t machine_stats_serial = ATOMIC_VAR_INIT(1);
+
+void machine_stats__init(struct machine_stats *ms,
+                         const struct machine_opts *opts)
+{
+    atomic_init(&ms->slots, NULL);
+    ms->serial = atomic_fetch_add(&machine_stats_serial, 1);
+    if (opts && opts->stats_callback && opts->stats_interval) {
+        ms->interval = opts->stats_interval * 1000000ULL;
+        ms->callback = opts->stats_callback;
+        ms->cookie = opts->stats_cookie;
+        atomic_init(&ms->next, unwind_stats__now() + ms->interval);
+    }
+}
+
+void machine_stats__exit(struct machine_stats *ms)
+{
+    struct unwind_stats_slot *slot, *next;
+
+    for (slot = atomic_load(&ms->slots); slot; slot = next) {
+        next = slot->next;
+        free(slot);
+    }
+}
+
+/*
+ * Slow path of machine_stats__get(): this thread's slot of another
+ * machine was cached. Slots are never taken away while the machine
+ * lives, so a thread finds its own again, and pushing a new one races
+ * only with other pushes.
+ */
+struct unwind_stats *__machine_stats__get(struct machine_stats *ms)
+{
+    struct unwind_stats_slot *slot, *head;
+    pthread_t self = pthread_self();
+
+    head = atomic_load_explicit(&ms->slots, memory_order_acquire);
+    for (slot = head; slot; slot = slot->next) {
+        if (pthread_equal(slot->owner, self))
+            goto out;
+    }
+
+    slot = xzalloc_aligned(alignof(*slot), sizeof(*slot));
+    slot->owner = self;
+    do {
+        slot->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&ms->slots, &head, slot,
+                                                    memory_order_release,
+                                                    memory_order_acquire));
+
+out:
+    machine_stats_cache.serial = ms->serial;
+    machine_stats_cache.stats = &slot->stats;
+    return &slot->stats;
+}
+
+static void machine_stats__read(struct machine_stats *ms,
+                                struct unwind_stats *stats)
+{
+    struct unwind_stats_slot *slot;
+    u64 *sum = (u64 *)stats;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    slot = atomic_load_explicit(&ms->slots, memory_order_acquire);
+    for (; slot; slot = slot->next) {
+        const u64 *counters = (const u64 *)&slot->stats;
+
+        for (i = 0; i < sizeof(*stats) / sizeof(u64); i++)
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* After every unwind, calls back if it's due. One thread wins the CAS. */
+void machine_stats__tick(struct machine_stats *ms, u64 now)
+{
+    struct unwind_stats stats;
+    u64 next;
+
+    if (!ms->callback)
+        return;
+
+    next = atomic_load_explicit(&ms->next, memory_order_relaxed);
+    if (now < next ||
+        !atomic_compare_exchange_strong(&ms->next, &next, now + ms->interval))
+        return;
+
+    machine_stats__read(ms, &stats);
+    ms->callback(&stats, ms->cookie);
+}
+
+/*
+ * Sum up what every thread that unwound with @machine counted so far.
+ * Safe to call while they keep going, counters of a running unwind may
+ * or may not be in yet.
+ */
+void machine__read_stats(struct machine *machine, struct unwind_stats *stats)
+{
+    machine_stats__read(&machine->stats, stats);
+}
@@ -0,0 +1,77 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include "types.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include "libdw_bpf.h"
+#include <pthread.h>
+
+struct machine;
+
+/*
+ * One per thread that unwinds with a machine. Only the owner writes
+ * its counters, with relaxed stores rather than read-modify-writes, so
+ * readers summing them up concurrently see whole values and nobody
+ * pays for a locked instruction.
+ */
+struct unwind_stats_slot {
+    cache_aligned(struct unwind_stats stats);
+    pthread_t owner;
+    struct unwind_stats_slot *next;
+};
+
+typedef _Atomic(struct unwind_stats_slot *) atomic_unwind_stats_slot_ptr;
+
+struct machine_stats {
+    atomic_unwind_stats_slot_ptr slots;
+    u64 serial;                 /* tells machines at the same address apart */
+    u64 interval;               /* ns, for the callback */
+    unwind_stats_cb_t callback;
+    void *cookie;
+    atomic_uint_least64_t next; /* when the callback is due */
+};
+
+void machine_stats__init(struct machine_stats *ms,
+                         const struct machine_opts *opts);
+void machine_stats__exit(struct machine_stats *ms);
+struct unwind_stats *__machine_stats__get(struct machine_stats *ms);
+void machine_stats__tick(struct machine_stats *ms, u64 now);
+
+extern __thread struct machine_stats_cache {
+    u64 serial;
+    struct unwind_stats *stats;
+} machine_stats_cache;
+
+/* The calling thread's counters. */
+static inline struct unwind_stats *machine_stats__get(struct machine_stats *ms)
+{
+    if (likely(machine_stats_cache.serial == ms->serial))
+        return machine_stats_cache.stats;
+    return __machine_stats__get(ms);
+}
+
+static inline void unwind_stats__add(u64 *counter, u64 n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int unwind_stats__bucket(u64 value, unsigned int nr)
+{
+    unsigned int bucket = value > 1 ? 63 - __builtin_clzll(value) : 0;
+
+    return bucket < nr ? bucket : nr - 1;
+}
+
+#define unwind_stats__hist(hist, value) \
+    unwind_stats__add(&(hist)[unwind_stats__bucket(value, ARRAY_SIZE(hist))], 1)
+
+static inline u64 unwind_stats__now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif // __STATS_H_
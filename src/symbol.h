@@ -7,6 +7,7 @@
 
 Elf_Scn *elf_section_by_name(Elf *elf, GElf_Ehdr *ep,
                              GElf_Shdr *shp, const char *name, size_t *idx);
+int filename__read_build_id(const char *filename, void *bf, size_t size);
 
 static inline int __symbol__join_symfs(char *bf, size_t size, const char *path)
 {
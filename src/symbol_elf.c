@@ -1,6 +1,8 @@
 #include "symbol.h"
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 Elf_Scn *elf_section_by_name(Elf *elf, GElf_Ehdr *ep,
                              GElf_Shdr *shp, const char *name, size_t *idx)
@@ -27,3 +29,52 @@ Elf_Scn *elf_section_by_name(Elf *elf, GElf_Ehdr *ep,
 
     return NULL;
 }
+
+/*
+ * Copy the GNU build-id note of @filename into @bf, returns its size or
+ * -1 if there's none.
+ */
+int filename__read_build_id(const char *filename, void *bf, size_t size)
+{
+    size_t offset = 0, name_off, desc_off;
+    GElf_Ehdr ehdr;
+    GElf_Shdr shdr;
+    GElf_Nhdr nhdr;
+    Elf_Data *data;
+    Elf_Scn *sec;
+    Elf *elf;
+    int fd, err = -1;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+    if (elf == NULL)
+        goto out_close;
+
+    if (gelf_getehdr(elf, &ehdr) == NULL)
+        goto out_elf_end;
+
+    sec = elf_section_by_name(elf, &ehdr, &shdr, ".note.gnu.build-id", NULL);
+    if (!sec)
+        sec = elf_section_by_name(elf, &ehdr, &shdr, ".notes", NULL);
+    if (!sec || !(data = elf_getdata(sec, NULL)))
+        goto out_elf_end;
+
+    while ((offset = gelf_getnote(data, offset, &nhdr,
+                                  &name_off, &desc_off)) > 0) {
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+            !memcmp((char *)data->d_buf + name_off, "GNU", 4)) {
+            err = nhdr.n_descsz < size ? nhdr.n_descsz : size;
+            memcpy(bf, (char *)data->d_buf + desc_off, err);
+            break;
+        }
+    }
+
+out_elf_end:
+    elf_end(elf);
+out_close:
+    close(fd);
+    return err;
+}
@@ -5,6 +5,7 @@
 #include "unwind.h"
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
 
 #ifdef debug
 #undef debug
@@ -19,15 +20,12 @@ struct thread *thread__new(pid_t tgid, pid_t tid)
      thread->tid = tid;
 
      refcount_set(&thread->refcnt, 1);
-     RB_CLEAR_NODE(&thread->rb_node);
 
      return thread;
 }
 
 void thread__delete(struct thread *thread)
 {
-     assert(RB_EMPTY_NODE(&thread->rb_node));
-
      if (thread->maps) {
           maps__put(thread->maps);
           thread->maps = NULL;
@@ -49,14 +47,8 @@ struct thread *thread__get(struct thread *thread)
 
 void thread__put(struct thread *thread)
 {
-     if (thread && refcount_dec_and_test(&thread->refcnt)) {
-          /*
-           * Remove it from the dead_threads list, as last reference
-           * is gone.
-           */
-          list_del_init(&thread->node);
+     if (thread && refcount_dec_and_test(&thread->refcnt))
           thread__delete(thread);
-     }
      debug("dec thread %d:%d's ref to: %d\n",
            thread->tgid, thread->tid,
            refcount_read(&thread->refcnt));
@@ -88,16 +80,55 @@ int thread__insert_map(struct thread *thread, struct map *map)
      if (ret)
           return ret;
 
-     /* TODO: handle overlapping maps? */
+     /* Replaces whatever @map overlaps. */
      maps__insert(thread->maps, map);
 
      return 0;
 }
 
+/*
+ * Copy the name into @buf, TASK_COMM_LEN bytes. Names change under
+ * readers, e.g. a COMM event racing with a resolver of the same thread,
+ * so they are a seqlock: copies are retried until comm_seq was even and
+ * unchanged across them.
+ */
+void thread__comm(struct thread *thread, char *buf)
+{
+     unsigned int seq;
+
+     do {
+          seq = atomic_load_explicit(&thread->comm_seq, memory_order_acquire);
+          memcpy(buf, thread->name, TASK_COMM_LEN);
+          atomic_thread_fence(memory_order_acquire);
+     } while ((seq & 1) ||
+              seq != atomic_load_explicit(&thread->comm_seq,
+                                          memory_order_relaxed));
+}
+
 void thread__set_comm(struct thread *thread, const char *str)
 {
-     if (!strncmp(str, thread->name, TASK_COMM_LEN)) {
-          strncpy(thread->name, str, TASK_COMM_LEN);
-          unwind__flush_access(thread);
-     }
+     char name[TASK_COMM_LEN];
+     unsigned int seq;
+
+     thread__comm(thread, name);
+     if (!strncmp(str, name, TASK_COMM_LEN))
+          return;
+
+     /* Writers take turns by making comm_seq odd. */
+     seq = atomic_load_explicit(&thread->comm_seq, memory_order_relaxed);
+     do {
+          while (seq & 1) {
+               sched_yield();
+               seq = atomic_load_explicit(&thread->comm_seq,
+                                          memory_order_relaxed);
+          }
+     } while (!atomic_compare_exchange_weak_explicit(&thread->comm_seq,
+                                                     &seq, seq + 1,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed));
+     atomic_thread_fence(memory_order_release);
+     strncpy(thread->name, str, TASK_COMM_LEN);
+     atomic_store_explicit(&thread->comm_seq, seq + 2, memory_order_release);
+
+     unwind__flush_access(thread);
 }
@@ -4,6 +4,8 @@
 #include "rbtree.h"
 #include "list.h"
 #include "refcount.h"
+#include "epoch.h"
+#include "stdatomic.h"
 
 #ifndef TASK_COMM_LEN
 # define TASK_COMM_LEN    16
@@ -15,17 +17,15 @@ struct machine;
 struct unwind_libunwind_ops;
 
 struct thread {
-     union {
-          struct rb_node rb_node;
-          struct list_head node;
-     };
      struct maps *maps;
      pid_t tgid;
      pid_t tid;
-     char name[TASK_COMM_LEN];
+     char name[TASK_COMM_LEN];    /* see thread__comm() */
+     atomic_uint comm_seq;
      void *addr_space;
      struct unwind_libunwind_ops *ulops;
      refcount_t refcnt;
+     struct epoch_head rcu;
 };
 
 struct thread *thread__new(pid_t tgid, pid_t tid);
@@ -35,5 +35,6 @@ void thread__put(struct thread *thread);
 int thread__init_maps(struct thread *thread, struct machine *machine);
 int thread__insert_map(struct thread *thread, struct map *map);
 void thread__set_comm(struct thread *thread, const char *str);
+void thread__comm(struct thread *thread, char *buf);
 
 #endif // __THREAD_H_
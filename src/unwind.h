@@ -7,9 +7,19 @@
 struct map;
 struct symbol;
 struct thread;
-struct unwind_ctx;
 struct stacktrace;
 
+/*
+ * What an unwind reads: the user registers and a copy of the stack
+ * from their sp up. It only points at the stack, which stays wherever
+ * the capture put it, a BPF record or a perf ring.
+ */
+struct unwind_sample {
+	const struct pt_regs *regs;
+	const char *stack;
+	u64 size;
+};
+
 struct unwind_entry {
 	struct map	*map;
 	struct symbol	*sym;
@@ -24,13 +34,13 @@ struct unwind_libunwind_ops {
 	void (*finish_access)(struct thread *thread);
 	int (*get_entries)(unwind_entry_cb_t cb, void *arg,
 					   struct thread *thread,
-					   struct unwind_ctx *data,
+					   const struct unwind_sample *sample,
 					   struct stacktrace *st);
 };
 
 int unwind__get_entries(unwind_entry_cb_t cb, void *arg,
 					   struct thread *thread,
-					   struct unwind_ctx *data,
+					   const struct unwind_sample *sample,
 					   struct stacktrace *st);
 
 #ifndef LIBUNWIND__ARCH_REG_SP
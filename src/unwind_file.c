@@ -0,0 +1,779 @@
+#define _GNU_SOURCE
+#include "libdw_bpf.h"
+#include "machine.h"
+#include "event.h"
+#include "symbol.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+
+/*
+ * Record now, unwind later: records are appended to a file as they
+ * come and resolved from it afterwards, on as many threads as wanted.
+ *
+ *   header | chunk | chunk | ... | index | trailer
+ *
+ * A chunk is a struct unwind_file_chunk followed by its records,
+ * deflated unless that didn't make them any smaller, and padded to 8
+ * bytes. Every record is
+ * a struct unwind_file_rec and an 8 byte aligned payload: a record cut
+ * right after its stack, an MMAP2 event cut after its filename, or the
+ * build-id of a DSO. The maps of a process are snapshotted from /proc
+ * into the chunk its first record goes to, with the build-ids of their
+ * DSOs before them. The index at the end lists the chunks, a file
+ * whose writer died has none and is read by walking the chunks.
+ */
+
+#define UNWIND_FILE__MAGIC          0x31574e554257444cULL    /* LDWBUNW1 */
+#define UNWIND_FILE__INDEX_MAGIC    0x315844494257444cULL    /* LDWBIDX1 */
+#define UNWIND_FILE__CHUNK_MAGIC    0x43574e55               /* UNWC */
+#define UNWIND_FILE__VERSION        1
+
+#define UNWIND_FILE__CHUNK_SIZE     (1U << 20)
+#define UNWIND_FILE__MIN_CHUNK_SIZE (1U << 16)
+#define UNWIND_FILE__LEVEL          Z_BEST_SPEED
+#define UNWIND_FILE__BUILD_ID_SIZE  20
+
+enum unwind_file_rec_type {
+    UNWIND_FILE_REC_CTX = 1,
+    UNWIND_FILE_REC_MMAP,
+    UNWIND_FILE_REC_BUILD_ID,
+};
+
+#define UNWIND_FILE_CHUNK_DEFLATED  (1U << 0)
+#define UNWIND_FILE_CHUNK_MAPS      (1U << 1)    /* has MMAP records */
+
+struct unwind_file_header {
+    u64 magic;
+    u32 version;
+    u32 stack_size;    /* STACK_SIZE of the writer */
+};
+
+struct unwind_file_chunk {
+    u32 magic;
+    u32 flags;
+    u32 raw_size;      /* of the records */
+    u32 size;          /* as stored */
+    u32 nr_records;
+    u32 reserved;
+    u64 first_ts;
+    u64 last_ts;
+};
+
+struct unwind_file_index {
+    u64 offset;
+    struct unwind_file_chunk chunk;
+};
+
+struct unwind_file_trailer {
+    u64 magic;
+    u64 index_offset;
+    u64 nr_chunks;
+};
+
+struct unwind_file_rec {
+    u16 type;
+    u16 reserved;
+    u32 size;          /* of the payload, without padding */
+};
+
+struct unwind_file_build_id {
+    u8 size;
+    u8 reserved[3];
+    u8 id[UNWIND_FILE__BUILD_ID_SIZE];
+    char filename[];
+};
+
+/* tgids and DSO name hashes, 0 is never stored. */
+struct u64_set {
+    u64 *slots;
+    u32 mask;
+    u32 nr;
+};
+
+struct unwind_file {
+    bool writing;
+    struct unwind_file_index *index;
+    u64 nr_chunks;
+    u64 max_chunks;
+    struct mmap2_event mmap2;
+    struct u64_set dsos;       /* build-id written, or stale on replay */
+
+    /* Writing */
+    int fd;
+    int err;                   /* first write error, sticks */
+    struct unwind_file_opts opts;
+    struct unwind_file_chunk chunk;
+    char *raw;                 /* the chunk being filled */
+    char *deflated;
+    size_t deflated_size;
+    u64 offset;                /* where it goes */
+    struct u64_set tgids;
+
+    /* Reading */
+    char *base;
+    size_t size;
+    u32 max_raw_size;
+};
+
+static u64 unwind_file__name_hash(const char *name)
+{
+    u64 hash = 0xcbf29ce484222325ULL;
+
+    while (*name)
+        hash = (hash ^ (u8)*name++) * 0x100000001b3ULL;
+
+    return hash ?: 1;
+}
+
+/* Returns true if @key wasn't there yet. */
+static bool u64_set__add(struct u64_set *set, u64 key)
+{
+    u32 i;
+
+    if (4 * (set->nr + 1) > 3 * (set->mask + 1)) {
+        struct u64_set grown = { .mask = set->mask ? 2 * set->mask + 1 : 255 };
+
+        grown.slots = xcalloc(grown.mask + 1, sizeof(u64));
+        for (i = 0; set->mask && i <= set->mask; i++)
+            if (set->slots[i])
+                u64_set__add(&grown, set->slots[i]);
+        free(set->slots);
+        *set = grown;
+    }
+
+    for (i = key & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+        if (set->slots[i] == key)
+            return false;
+
+    set->slots[i] = key;
+    set->nr++;
+    return true;
+}
+
+static bool u64_set__has(const struct u64_set *set, u64 key)
+{
+    u32 i;
+
+    if (!set->nr)
+        return false;
+
+    for (i = key & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+        if (set->slots[i] == key)
+            return true;
+
+    return false;
+}
+
+static void unwind_file__add_index(struct unwind_file *file, u64 offset,
+                                   const struct unwind_file_chunk *chunk)
+{
+    if (file->nr_chunks == file->max_chunks) {
+        file->max_chunks = file->max_chunks ? 2 * file->max_chunks : 64;
+        file->index = xrealloc(file->index,
+                               file->max_chunks * sizeof(*file->index));
+    }
+
+    file->index[file->nr_chunks].offset = offset;
+    file->index[file->nr_chunks].chunk = *chunk;
+    file->nr_chunks++;
+}
+
+static int unwind_file__write_all(struct unwind_file *file,
+                                  const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(file->fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return file->err = n < 0 ? -errno : -EIO;
+        buf = (const char *)buf + n;
+        len -= n;
+        file->offset += n;
+    }
+
+    return 0;
+}
+
+/* Write out the chunk being filled, if there's anything in it. */
+static int unwind_file__flush(struct unwind_file *file)
+{
+    static const char zeroes[8];
+    struct unwind_file_chunk *chunk = &file->chunk;
+    const char *payload = file->raw;
+    uLongf size = file->deflated_size;
+    u64 offset = file->offset;
+    int ret;
+
+    if (file->err || !chunk->raw_size)
+        return file->err;
+
+    chunk->magic = UNWIND_FILE__CHUNK_MAGIC;
+    chunk->size = chunk->raw_size;
+    if (file->opts.level > 0 &&
+        compress2((Bytef *)file->deflated, &size, (const Bytef *)file->raw,
+                  chunk->raw_size, file->opts.level) == Z_OK &&
+        size < chunk->raw_size) {
+        chunk->flags |= UNWIND_FILE_CHUNK_DEFLATED;
+        chunk->size = size;
+        payload = file->deflated;
+    }
+
+    ret = unwind_file__write_all(file, chunk, sizeof(*chunk));
+    if (!ret)
+        ret = unwind_file__write_all(file, payload, chunk->size);
+    /* Keep the next chunk header aligned. */
+    if (!ret && chunk->size % 8)
+        ret = unwind_file__write_all(file, zeroes, 8 - chunk->size % 8);
+    if (!ret)
+        unwind_file__add_index(file, offset, chunk);
+
+    memset(chunk, 0, sizeof(*chunk));
+    return ret;
+}
+
+/* Room for a record of @size bytes in the chunk being filled. */
+static void *unwind_file__reserve(struct unwind_file *file, u16 type,
+                                  u32 size)
+{
+    u32 total = ALIGN(sizeof(struct unwind_file_rec) + size, 8);
+    struct unwind_file_rec *rec;
+
+    if (file->chunk.raw_size + total > file->opts.chunk_size &&
+        unwind_file__flush(file))
+        return NULL;
+
+    rec = (struct unwind_file_rec *)(file->raw + file->chunk.raw_size);
+    rec->type = type;
+    rec->reserved = 0;
+    rec->size = size;
+    memset((char *)(rec + 1) + size, 0, total - sizeof(*rec) - size);
+
+    file->chunk.raw_size += total;
+    file->chunk.nr_records++;
+
+    return rec + 1;
+}
+
+static void unwind_file__write_build_id(struct unwind_file *file,
+                                        const char *filename)
+{
+    struct unwind_file_build_id *bid;
+    u8 id[UNWIND_FILE__BUILD_ID_SIZE];
+    size_t len = strlen(filename) + 1;
+    int size;
+
+    if (!u64_set__add(&file->dsos, unwind_file__name_hash(filename)))
+        return;
+
+    size = filename__read_build_id(filename, id, sizeof(id));
+    if (size <= 0)
+        return;
+
+    bid = unwind_file__reserve(file, UNWIND_FILE_REC_BUILD_ID,
+                               sizeof(*bid) + len);
+    if (!bid)
+        return;
+
+    memset(bid, 0, sizeof(*bid));
+    bid->size = size;
+    memcpy(bid->id, id, size);
+    memcpy(bid->filename, filename, len);
+}
+
+static int unwind_file__synthesized_mmap2(void *priv,
+                                          struct mmap2_event *event)
+{
+    const size_t head = offsetof(struct mmap2_event, filename);
+    size_t len = strlen(event->filename) + 1;
+    struct unwind_file *file = priv;
+    char *rec;
+
+    unwind_file__write_build_id(file, event->filename);
+
+    rec = unwind_file__reserve(file, UNWIND_FILE_REC_MMAP, head + len);
+    if (!rec)
+        return file->err;
+
+    memcpy(rec, event, head);
+    memcpy(rec + head, event->filename, len);
+    file->chunk.flags |= UNWIND_FILE_CHUNK_MAPS;
+
+    return 0;
+}
+
+/*
+ * Create @path and record to it. Returns NULL, with errno set, if it
+ * can't be written.
+ */
+struct unwind_file *unwind_file__create(const char *path,
+                                        const struct unwind_file_opts *opts)
+{
+    struct unwind_file_header header = {
+        .magic = UNWIND_FILE__MAGIC,
+        .version = UNWIND_FILE__VERSION,
+        .stack_size = STACK_SIZE,
+    };
+    struct unwind_file *file = xcalloc(1, sizeof(*file));
+    int ret;
+
+    file->writing = true;
+    if (opts)
+        file->opts = *opts;
+    if (!file->opts.chunk_size)
+        file->opts.chunk_size = UNWIND_FILE__CHUNK_SIZE;
+    if (file->opts.chunk_size < UNWIND_FILE__MIN_CHUNK_SIZE)
+        file->opts.chunk_size = UNWIND_FILE__MIN_CHUNK_SIZE;
+    if (!file->opts.level)
+        file->opts.level = UNWIND_FILE__LEVEL;
+
+    file->raw = xmalloc(file->opts.chunk_size);
+    file->deflated_size = compressBound(file->opts.chunk_size);
+    file->deflated = xmalloc(file->deflated_size);
+
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd < 0 || unwind_file__write_all(file, &header, sizeof(header))) {
+        ret = errno;
+        unwind_file__close(file);
+        errno = ret;
+        return NULL;
+    }
+
+    return file;
+}
+
+/*
+ * Append the first @size bytes of @uc, only up to the end of its stack
+ * or opts.stack_size bytes of it. The maps of a process are recorded
+ * along with its first record, while it's still there to read them
+ * from. Not thread safe. Returns the first write error, if any.
+ */
+int unwind_file__write(struct unwind_file *file,
+                       const struct unwind_ctx *uc, int size)
+{
+    const int head = offsetof(struct unwind_ctx, data);
+    struct unwind_ctx *rec;
+    int stack;
+
+    if (file->err)
+        return file->err;
+    if (size < head)
+        return -EINVAL;
+
+    stack = uc->size < size - head ? uc->size : size - head;
+    if (stack < 0)
+        stack = 0;
+    if (file->opts.stack_size && (u32)stack > file->opts.stack_size)
+        stack = file->opts.stack_size;
+
+    if (u64_set__add(&file->tgids, uc->tgid))
+        mmap2_events__synthesize(&file->mmap2, uc->tgid, uc->tid,
+                                 unwind_file__synthesized_mmap2, file);
+
+    rec = unwind_file__reserve(file, UNWIND_FILE_REC_CTX, head + stack);
+    if (!rec)
+        return file->err;
+
+    memcpy(rec, uc, head + stack);
+    rec->size = stack;
+
+    if (!file->chunk.first_ts || uc->ts < file->chunk.first_ts)
+        file->chunk.first_ts = uc->ts;
+    if (uc->ts > file->chunk.last_ts)
+        file->chunk.last_ts = uc->ts;
+
+    return 0;
+}
+
+static int unwind_file__finish(struct unwind_file *file)
+{
+    struct unwind_file_trailer trailer = {
+        .magic = UNWIND_FILE__INDEX_MAGIC,
+        .nr_chunks = file->nr_chunks,
+    };
+    int ret;
+
+    ret = unwind_file__flush(file);
+    if (ret)
+        return ret;
+
+    trailer.index_offset = file->offset;
+    ret = unwind_file__write_all(file, file->index,
+                                 file->nr_chunks * sizeof(*file->index));
+    if (!ret)
+        ret = unwind_file__write_all(file, &trailer, sizeof(trailer));
+
+    return ret;
+}
+
+/*
+ * Finish a file being written, or let go of one being read. Returns
+ * the first write error, the file may be incomplete then.
+ */
+int unwind_file__close(struct unwind_file *file)
+{
+    int ret = 0;
+
+    if (!file)
+        return 0;
+
+    if (file->writing && file->fd >= 0) {
+        ret = unwind_file__finish(file);
+        if (close(file->fd) && !ret)
+            ret = -errno;
+    }
+    if (file->base)
+        munmap(file->base, file->size);
+
+    free(file->raw);
+    free(file->deflated);
+    free(file->index);
+    free(file->tgids.slots);
+    free(file->dsos.slots);
+    free(file);
+
+    return ret;
+}
+
+/* Index the chunks of a file that has no index, up to the first bad one. */
+static void unwind_file__scan(struct unwind_file *file)
+{
+    u64 offset = sizeof(struct unwind_file_header);
+    struct unwind_file_chunk *chunk;
+
+    while (offset + sizeof(*chunk) <= file->size) {
+        chunk = (struct unwind_file_chunk *)(file->base + offset);
+        if (chunk->magic != UNWIND_FILE__CHUNK_MAGIC ||
+            offset + sizeof(*chunk) + chunk->size > file->size)
+            break;
+
+        unwind_file__add_index(file, offset, chunk);
+        offset += sizeof(*chunk) + ALIGN(chunk->size, 8);
+    }
+}
+
+static bool unwind_file__read_index(struct unwind_file *file)
+{
+    const struct unwind_file_trailer *trailer;
+    u64 end;
+
+    /* A complete file is all 8 byte aligned pieces. */
+    if (file->size < sizeof(struct unwind_file_header) + sizeof(*trailer) ||
+        file->size % 8)
+        return false;
+
+    trailer = (void *)(file->base + file->size - sizeof(*trailer));
+    end = trailer->index_offset +
+          trailer->nr_chunks * sizeof(struct unwind_file_index);
+    if (trailer->magic != UNWIND_FILE__INDEX_MAGIC ||
+        end != file->size - sizeof(*trailer))
+        return false;
+
+    file->nr_chunks = file->max_chunks = trailer->nr_chunks;
+    file->index = xmalloc(file->nr_chunks * sizeof(*file->index) + 1);
+    memcpy(file->index, file->base + trailer->index_offset,
+           file->nr_chunks * sizeof(*file->index));
+
+    return true;
+}
+
+/* Map a recorded file for replaying. Returns NULL, with errno set. */
+struct unwind_file *unwind_file__open(const char *path)
+{
+    struct unwind_file *file = xcalloc(1, sizeof(*file));
+    const struct unwind_file_header *header;
+    struct stat st;
+    u64 i;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto out_err;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+        errno = errno ?: EINVAL;
+        close(fd);
+        goto out_err;
+    }
+
+    file->size = st.st_size;
+    file->base = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->base == MAP_FAILED) {
+        file->base = NULL;
+        goto out_err;
+    }
+
+    header = (const struct unwind_file_header *)file->base;
+    if (header->magic != UNWIND_FILE__MAGIC ||
+        header->version != UNWIND_FILE__VERSION) {
+        errno = ENOTSUP;
+        goto out_err;
+    }
+
+    if (!unwind_file__read_index(file))
+        unwind_file__scan(file);
+
+    for (i = 0; i < file->nr_chunks; i++) {
+        const struct unwind_file_chunk *chunk = &file->index[i].chunk;
+
+        if (file->index[i].offset + sizeof(*chunk) + chunk->size > file->size) {
+            errno = EINVAL;
+            goto out_err;
+        }
+        if (chunk->raw_size > file->max_raw_size)
+            file->max_raw_size = chunk->raw_size;
+    }
+
+    return file;
+
+out_err:
+    ret = errno;
+    unwind_file__close(file);
+    errno = ret;
+    return NULL;
+}
+
+/*
+ * The records of chunk @i, inflated into @buf, which has room for the
+ * largest chunk, unless they're stored as they are.
+ */
+static const char *unwind_file__chunk(struct unwind_file *file, u64 i,
+                                      char *buf)
+{
+    const struct unwind_file_index *index = &file->index[i];
+    const char *payload = file->base + index->offset + sizeof(index->chunk);
+    uLongf size = file->max_raw_size;
+
+    if (!(index->chunk.flags & UNWIND_FILE_CHUNK_DEFLATED))
+        return payload;
+
+    if (uncompress((Bytef *)buf, &size, (const Bytef *)payload,
+                   index->chunk.size) != Z_OK ||
+        size != index->chunk.raw_size)
+        return NULL;
+
+    return buf;
+}
+
+/*
+ * A DSO whose build-id differs from the recorded one, or that can't be
+ * read any more, would only unwind to garbage. Its maps are skipped.
+ */
+static void unwind_file__check_build_id(struct unwind_file *file,
+                                        const struct unwind_file_build_id *bid)
+{
+    u8 id[UNWIND_FILE__BUILD_ID_SIZE];
+    int size;
+
+    size = filename__read_build_id(bid->filename, id, sizeof(id));
+    if (size == bid->size && !memcmp(id, bid->id, size))
+        return;
+
+    pr_warning("%s doesn't match the recorded build-id, skipping it\n",
+               bid->filename);
+    u64_set__add(&file->dsos, unwind_file__name_hash(bid->filename));
+}
+
+static void unwind_file__process_mmap(struct unwind_file *file,
+                                      machine_t *machine,
+                                      const struct unwind_file_rec *rec)
+{
+    const size_t head = offsetof(struct mmap2_event, filename);
+    const char *filename = (const char *)(rec + 1) + head;
+    size_t len;
+
+    /* The filename has to be there and end within the record. */
+    if (rec->size <= head)
+        return;
+    len = rec->size - head;
+    if (len > sizeof(file->mmap2.filename) || filename[len - 1])
+        return;
+    if (u64_set__has(&file->dsos, unwind_file__name_hash(filename)))
+        return;
+
+    memcpy(&file->mmap2, rec + 1, rec->size);
+    machine__process_mmap2_event(machine, &file->mmap2);
+}
+
+static bool unwind_file__ctx_ok(const struct unwind_file_rec *rec)
+{
+    const u32 head = offsetof(struct unwind_ctx, data);
+    const struct unwind_ctx *uc = (const void *)(rec + 1);
+
+    return rec->size >= head && uc->size >= 0 &&
+           (u32)uc->size <= rec->size - head;
+}
+
+static bool unwind_file__build_id_ok(const struct unwind_file_rec *rec)
+{
+    const struct unwind_file_build_id *bid = (const void *)(rec + 1);
+
+    return rec->size > sizeof(*bid) &&
+           bid->size <= UNWIND_FILE__BUILD_ID_SIZE &&
+           !((const char *)(rec + 1))[rec->size - 1];
+}
+
+/*
+ * Go through the records of a chunk: apply the maps if @machine is
+ * given, pass the unwind_ctxs to @cb if it is.
+ */
+static int unwind_file__process_chunk(struct unwind_file *file, u64 i,
+                                      char *buf, machine_t *machine,
+                                      ringbuf_cb_t cb, void *cookie)
+{
+    const u32 raw_size = file->index[i].chunk.raw_size;
+    const struct unwind_file_rec *rec;
+    const char *raw, *p, *end;
+    int ret;
+
+    raw = unwind_file__chunk(file, i, buf);
+    if (!raw)
+        return -EINVAL;
+
+    for (p = raw, end = raw + raw_size; p + sizeof(*rec) <= end;
+         p += ALIGN(sizeof(*rec) + rec->size, 8)) {
+        rec = (const struct unwind_file_rec *)p;
+        if (p + sizeof(*rec) + rec->size > end)
+            return -EINVAL;
+
+        switch (rec->type) {
+        case UNWIND_FILE_REC_CTX:
+            if (!cb)
+                break;
+            /* The resolver reads uc->size bytes of stack, keep it in. */
+            if (!unwind_file__ctx_ok(rec))
+                return -EINVAL;
+            ret = cb((struct unwind_ctx *)(rec + 1), rec->size, cookie);
+            if (ret < 0)
+                return ret;
+            break;
+        case UNWIND_FILE_REC_MMAP:
+            if (machine)
+                unwind_file__process_mmap(file, machine, rec);
+            break;
+        case UNWIND_FILE_REC_BUILD_ID:
+            if (machine && unwind_file__build_id_ok(rec))
+                unwind_file__check_build_id(file, (const void *)(rec + 1));
+            break;
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Apply the recorded maps to @machine and pass every record to @cb in
+ * the order they were written, on this thread. The records live in
+ * the mapping or a scratch buffer and are only valid until @cb
+ * returns, which stops the replay by returning < 0.
+ */
+int unwind_file__replay(struct unwind_file *file, machine_t *machine,
+                        ringbuf_cb_t cb, void *cookie)
+{
+    char *buf = xmalloc(file->max_raw_size + 1);
+    int ret = 0;
+    u64 i;
+
+    for (i = 0; i < file->nr_chunks && !ret; i++)
+        ret = unwind_file__process_chunk(file, i, buf, machine, cb, cookie);
+
+    free(buf);
+    return ret;
+}
+
+struct unwind_file_replayer {
+    struct unwind_file *file;
+    ringbuf_cb_t cb;
+    void *cookie;
+    atomic_size_t next;        /* chunk to take */
+    atomic_int ret;
+};
+
+static void *unwind_file__replay_worker(void *arg)
+{
+    struct unwind_file_replayer *replayer = arg;
+    struct unwind_file *file = replayer->file;
+    char *buf = xmalloc(file->max_raw_size + 1);
+    size_t i;
+    int ret;
+
+    while (!atomic_load(&replayer->ret)) {
+        i = atomic_fetch_add(&replayer->next, 1);
+        if (i >= file->nr_chunks)
+            break;
+
+        ret = unwind_file__process_chunk(file, i, buf, NULL,
+                                         replayer->cb, replayer->cookie);
+        if (ret)
+            atomic_store(&replayer->ret, ret);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Like unwind_file__replay(), but @nr_threads threads take whole
+ * chunks and call @cb concurrently, give them a machine made with
+ * MACHINE_THREADING_CONCURRENT. Every map in the file is applied
+ * before the first record is passed on, processes are snapshotted
+ * once anyway. Records of a chunk keep their order, chunks don't.
+ */
+int unwind_file__replay_parallel(struct unwind_file *file,
+                                 machine_t *machine, unsigned int nr_threads,
+                                 ringbuf_cb_t cb, void *cookie)
+{
+    struct unwind_file_replayer replayer = {
+        .file = file,
+        .cb = cb,
+        .cookie = cookie,
+    };
+    char *buf = xmalloc(file->max_raw_size + 1);
+    pthread_t *threads;
+    unsigned int i, nr = 0;
+    int ret = 0;
+    u64 j;
+
+    for (j = 0; j < file->nr_chunks && !ret; j++)
+        if (file->index[j].chunk.flags & UNWIND_FILE_CHUNK_MAPS)
+            ret = unwind_file__process_chunk(file, j, buf, machine,
+                                             NULL, NULL);
+    free(buf);
+    if (ret)
+        return ret;
+
+    if (!nr_threads)
+        nr_threads = 1;
+    threads = xcalloc(nr_threads, sizeof(*threads));
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&threads[nr], NULL,
+                           unwind_file__replay_worker, &replayer))
+            break;
+        nr++;
+    }
+
+    /* Whatever couldn't be started is done here. */
+    if (nr < nr_threads)
+        unwind_file__replay_worker(&replayer);
+
+    for (i = 0; i < nr; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    return atomic_load(&replayer.ret);
+}
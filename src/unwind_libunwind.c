@@ -5,6 +5,8 @@
 #include "utility.h"
 #include "dso.h"
 #include "map.h"
+#include "machine.h"
+#include "log.h"
 #include "libdw_bpf.h"
 #include <libunwind.h>
 #include <libunwind-x86_64.h>
@@ -51,8 +53,6 @@ UNW_OBJ(dwarf_search_unwind_table) (unw_addr_space_t as,
 #define DW_EH_PE_funcrel        0x40    /* start-of-procedure-relative */
 #define DW_EH_PE_aligned        0x50    /* aligned pointer */
 
-struct unwind_ctx;
-
 struct table_entry {
      u32 start_ip_offset;
      u32 fde_offset;
@@ -85,11 +85,24 @@ struct eh_frame_hdr {
 } __packed;
 
 struct unwind_info {
-     struct unwind_ctx *uc;
+     const struct unwind_sample *sample;
      struct machine *machine;
      struct thread *thread;
+     struct unwind_stats *stats;    /* this thread's, of machine */
+     struct map *map;    /* last one found, most lookups hit it again */
+     enum unwind_stop stop;
+     enum unwind_stop fail;    /* first failure of the current step */
+     u64 stack_used;     /* bytes above sp the unwind wanted to read */
 };
 
+/* libunwind only sees an error code, remember what it was about. */
+static inline void unwind_info__fail(struct unwind_info *ui,
+                                     enum unwind_stop why)
+{
+     if (ui->fail == UNWIND_STOP_END)
+          ui->fail = why;
+}
+
 #define dw_read(ptr, type, end) ({              \
                type *__p = (type *) ptr;        \
                type  __v;                       \
@@ -187,13 +200,22 @@ static u64 elf_section_offset(int fd, const char *name)
 static inline struct map *find_map(unw_word_t ip, struct unwind_info *ui)
 {
      /**
-      * TODO:
-      * 1. add a cache
-      * 2. maybe need to handle dlopen's so here
+      * TODO: maybe need to handle dlopen's so here
+      *
+      * Borrowed, we run inside the epoch read section of
+      * bpf_unwind_ctx__resolve_callchain(), for the whole unwind.
       */
-     struct map *map = maps__find(ui->thread->maps, ip);
-     if (map)
+     struct map *map = ui->map;
+
+     if (map && ip >= map->start && ip < map->end)
+          return map;
+
+     map = maps__find(ui->thread->maps, ip);
+     unwind_stats__add(&ui->stats->maps_find, 1);
+     if (map) {
           debug("find_map's name: %s\n", map->dso->name);
+          ui->map = map;
+     }
      return map;
 }
 
@@ -225,8 +247,14 @@ static int read_unwind_spec_eh_frame(struct dso *dso, struct machine *machine,
                                      u64 *fde_count)
 {
      int ret = -EINVAL, fd;
-     u64 offset = dso->data.eh_frame_hdr_offset;
+     u64 offset;
 
+     /*
+      * Resolvers sharing the dso may all look it up the first time
+      * round, they'll store the same value so a relaxed store does.
+      */
+     offset = atomic_load_explicit(&dso->data.eh_frame_hdr_offset,
+                                   memory_order_relaxed);
      if (offset == 0) {
           fd = dso__data_get_fd(dso, machine);
           if (fd < 0)
@@ -234,7 +262,8 @@ static int read_unwind_spec_eh_frame(struct dso *dso, struct machine *machine,
 
           /* Check the .eh_frame section for unwinding info */
           offset = elf_section_offset(fd, ".eh_frame_hdr");
-          dso->data.eh_frame_hdr_offset = offset;
+          atomic_store_explicit(&dso->data.eh_frame_hdr_offset, offset,
+                                memory_order_relaxed);
           dso__data_put_fd(dso);
      }
 
@@ -257,10 +286,13 @@ find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
      int ret = -EINVAL;
 
      debug("find_proc_info called\n");
+     unwind_stats__add(&ui->stats->find_proc_info, 1);
 
      map = find_map(ip, ui);
-     if (!map || !map->dso)
-          return -EINVAL;
+     if (!map || !map->dso) {
+          unwind_info__fail(ui, UNWIND_STOP_NO_MAP);
+          return -UNW_EINVALIDIP;
+     }
 
      if (!read_unwind_spec_eh_frame(map->dso, ui->machine,
                                     &table_data, &segbase, &fde_count)) {
@@ -275,6 +307,8 @@ find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
           ret = dwarf_search_unwind_table(as, ip, &di, pi,
                                           need_unwind_info, arg);
      }
+     if (ret < 0)
+          unwind_info__fail(ui, UNWIND_STOP_NO_CFI);
 
      return ret;
 }
@@ -283,7 +317,6 @@ static void put_unwind_info(unw_addr_space_t as __maybe_unused,
                             unw_proc_info_t *pi __maybe_unused,
                             void *arg __maybe_unused)
 {
-     fprintf(stderr, "unwind: put_unwind_info called\n");
 }
 
 static int get_dyn_info_list_addr(unw_addr_space_t as __maybe_unused,
@@ -319,34 +352,47 @@ static int access_mem(unw_addr_space_t as __maybe_unused,
                       int __write, void *arg)
 {
      struct unwind_info *ui = arg;
-     const char * const stack = ui->uc->data;
-     int ss = ui->uc->size;
+     const char * const stack = ui->sample->stack;
+     u64 ss = stack ? ui->sample->size : 0;
      u64 start, end;
      int offset;
      int ret;
 
-     if (__write || !stack || ss <= 0) {
+     if (__write) {
           *valp = 0;
           return 0;
      }
 
-     start = reg_value(&ui->uc->uregs, LIBUNWIND__ARCH_REG_SP);
+     start = reg_value(ui->sample->regs, LIBUNWIND__ARCH_REG_SP);
      end = start + ss;
-     debug("start: 0x%" PRIx64 " end: 0x%" PRIx64 "ss: %d\n",
+     debug("start: 0x%" PRIx64 " end: 0x%" PRIx64 "ss: %" PRIu64 "\n",
            start, end, ss);
 
      if (addr + sizeof(unw_word_t) < addr)
           return -EINVAL;
 
-     if (addr < start || addr + sizeof(unw_word_t) >= end) {
+     /*
+      * Whether or not it was captured, this is how deep the unwind had
+      * to look, feed it back into the capture size.
+      */
+     if (addr >= start && addr - start < STACK_USAGE__WINDOW)
+          ui->stack_used = max(ui->stack_used,
+                               addr + sizeof(unw_word_t) - start);
+
+     if (addr < start || addr + sizeof(unw_word_t) > end) {
+          unwind_stats__add(&ui->stats->dso_reads, 1);
           ret = access_dso_mem(ui, addr, valp);
           if (ret) {
+               unwind_info__fail(ui, addr >= start &&
+                                     addr - start < STACK_USAGE__WINDOW ?
+                                     UNWIND_STOP_STACK : UNWIND_STOP_ERROR);
                *valp = 0;
-               return ret;
+               return -UNW_EINVAL;
           }
           return 0;
      }
 
+     unwind_stats__add(&ui->stats->stack_reads, 1);
      offset = addr - start;
      *valp = *(unw_word_t*)&stack[offset];
      debug("access addr: 0x%lx, stack[%d]: 0x%lx\n", addr, offset, *valp);
@@ -366,7 +412,11 @@ static int access_reg(unw_addr_space_t as __maybe_unused,
      }
 
      id = LIBUNWIND__ARCH_REG_ID(regnum);
-     *valp = reg_value(&ui->uc->uregs, id);
+     if (id < 0) {
+          unwind_info__fail(ui, UNWIND_STOP_BAD_REG);
+          return -UNW_EBADREG;
+     }
+     *valp = reg_value(ui->sample->regs, id);
      debug("access_reg %d: %lx\n", id, *valp);
 
      return 0;
@@ -378,7 +428,7 @@ static int access_fpreg(unw_addr_space_t as __maybe_unused,
                         int __write __maybe_unused,
                         void *arg __maybe_unused)
 {
-     fprintf(stderr, "unwind: access_fpreg unsupported\n");
+     pr_warning("unwind: access_fpreg unsupported\n");
      return -UNW_EINVAL;
 }
 
@@ -386,7 +436,7 @@ static int resume(unw_addr_space_t as __maybe_unused,
                   unw_cursor_t *cu __maybe_unused,
                   void *arg __maybe_unused)
 {
-     fprintf(stderr, "unwind: resume unsupported\n");
+     pr_warning("unwind: resume unsupported\n");
      return -UNW_EINVAL;
 }
 
@@ -396,7 +446,7 @@ get_proc_name(unw_addr_space_t as __maybe_unused,
               char *bufp __maybe_unused, size_t buf_len __maybe_unused,
               unw_word_t *offp __maybe_unused, void *arg __maybe_unused)
 {
-     fprintf(stderr, "unwind: get_proc_name unsupported\n");
+     pr_warning("unwind: get_proc_name unsupported\n");
      return -UNW_EINVAL;
 }
 
@@ -415,7 +465,7 @@ static int _prepare_access(struct thread *thread)
 {
      thread->addr_space = unw_create_addr_space(&accessors, 0);
      if (!thread->addr_space) {
-          fprintf(stderr, "unwind: create unwind as failed.\n");
+          pr_warning("unwind: create unwind as failed.\n");
           return -ENOMEM;
      }
 
@@ -433,20 +483,18 @@ static void _finish_access(struct thread *thread)
      unw_destroy_addr_space(thread->addr_space);
 }
 
-static void display_error(int err)
+/* What a libunwind error says, if the accessors didn't know better. */
+static enum unwind_stop unwind_stop__from_error(int err)
 {
-     switch (err) {
-          case UNW_EINVAL:
-               fprintf(stderr, "unwind: Only supports local.\n");
-               break;
-          case UNW_EUNSPEC:
-               fprintf(stderr, "unwind: Unspecified error.\n");
-               break;
+     switch (-err) {
+          case UNW_ENOINFO:
+               return UNWIND_STOP_NO_CFI;
           case UNW_EBADREG:
-               fprintf(stderr, "unwind: Register unavailable.\n");
-               break;
+               return UNWIND_STOP_BAD_REG;
+          case UNW_EINVALIDIP:
+               return UNWIND_STOP_NO_MAP;
           default:
-               break;
+               return UNWIND_STOP_ERROR;
      }
 }
 
@@ -458,28 +506,41 @@ static int get_entries(struct unwind_info *ui,
      unw_addr_space_t addr_space;
      unw_cursor_t c;
      u64 val;
-     int ret, i = 0;
+     int ret, step = 0, i = 0;
 
      if (!st || !st->ips || st->depth < 1) {
-          fprintf(stderr, "stacktrace not init\n");
+          pr_warning("unwind: stacktrace not init\n");
           return EINVAL;
      }
 
-     val = reg_value(&ui->uc->uregs, LIBUNWIND__ARCH_REG_IP);
+     val = reg_value(ui->sample->regs, LIBUNWIND__ARCH_REG_IP);
      st->ips[i++] = val;
      debug("get_entries, ip: 0x%" PRIx64 "\n", val);
 
+     ui->stop = UNWIND_STOP_ERROR;
      addr_space = ui->thread->addr_space;
-     if (!addr_space)
+     if (!addr_space) {
+          st->depth = i;
           return -1;
+     }
 
+     ui->fail = UNWIND_STOP_END;
      ret = unw_init_remote(&c, addr_space, ui);
-     if (ret)
-          display_error(ret);
+     if (ret) {
+          ui->stop = ui->fail != UNWIND_STOP_END ? ui->fail :
+                     unwind_stop__from_error(ret);
+          st->depth = i;
+          return ret;
+     }
 
      debug("ready to run unw_step...\n");
 
-     while (!ret && (unw_step(&c) > 0) && i < st->depth) {
+     while (i < st->depth) {
+          ui->fail = UNWIND_STOP_END;
+          step = unw_step(&c);
+          if (step <= 0)
+               break;
+
           unw_get_reg(&c, UNW_REG_IP, &st->ips[i]);
 
           /*
@@ -495,6 +556,19 @@ static int get_entries(struct unwind_info *ui,
           ++i;
      }
 
+     /*
+      * The last step may have fallen back on frame pointers and ended
+      * quietly after the unwind info let it down, the accessors know.
+      */
+     if (i >= st->depth)
+          ui->stop = UNWIND_STOP_DEPTH;
+     else if (ui->fail != UNWIND_STOP_END)
+          ui->stop = ui->fail;
+     else if (step < 0)
+          ui->stop = unwind_stop__from_error(step);
+     else
+          ui->stop = UNWIND_STOP_END;
+
      st->depth = i;
      debug("update st->depth: %d\n", st->depth);
 
@@ -504,15 +578,36 @@ static int get_entries(struct unwind_info *ui,
 static int _get_entries(unwind_entry_cb_t cb,
                         void *arg,
                         struct thread *thread,
-                        struct unwind_ctx *uc,
+                        const struct unwind_sample *sample,
                         struct stacktrace *st)
 {
+     struct machine *machine = thread->maps->machine;
      struct unwind_info ui = {
-         .uc = uc,
-         .machine = thread->maps->machine,
+         .sample = sample,
+         .machine = machine,
          .thread = thread,
+         .stats = machine__stats(machine),
      };
-     return get_entries(&ui, cb, arg, st);
+     u64 start = unwind_stats__now(), end;
+     int ret = get_entries(&ui, cb, arg, st);
+
+     end = unwind_stats__now();
+     stack_usage__add(&thread->maps->stack_usage, ui.stack_used);
+
+     if (st && st->ips) {
+          st->stop = ui.stop;
+          st->flags = 0;
+          st->stack_missing = ui.stack_used > sample->size ?
+                              ui.stack_used - sample->size : 0;
+          unwind_stats__add(&ui.stats->unwinds, 1);
+          unwind_stats__add(&ui.stats->frames, st->depth);
+          unwind_stats__add(&ui.stats->stop[ui.stop], 1);
+          unwind_stats__hist(ui.stats->frames_hist, st->depth);
+          unwind_stats__hist(ui.stats->latency_hist, end - start);
+          machine_stats__tick(&machine->stats, end);
+     }
+
+     return ret;
 }
 
 static struct unwind_libunwind_ops unwind_libunwind_ops = {
@@ -579,7 +674,7 @@ int LIBUNWIND__ARCH_REG_ID(int regnum)
                id = X86_IP;
                break;
           default:
-               fprintf(stderr, "unwind: invalid reg id %d\n", regnum);
+               pr_warning("unwind: invalid reg id %d\n", regnum);
                return -EINVAL;
      }
 
@@ -628,10 +723,16 @@ void unwind__finish_access(struct thread *thread)
 
 int unwind__get_entries(unwind_entry_cb_t cb, void *arg,
                        struct thread *thread,
-                       struct unwind_ctx *data,
+                       const struct unwind_sample *sample,
                        struct stacktrace *st)
 {
      if (thread->ulops)
-          return thread->ulops->get_entries(cb, arg, thread, data, st);
+          return thread->ulops->get_entries(cb, arg, thread, sample, st);
+     if (st) {
+          st->depth = 0;
+          st->stop = UNWIND_STOP_NO_MAP;
+          st->stack_missing = 0;
+          st->flags = 0;
+     }
      return 0;
 }
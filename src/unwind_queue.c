@@ -0,0 +1,218 @@
+#include "libdw_bpf.h"
+#include "ring.h"
+#include "hash.h"
+#include "stdatomic.h"
+#include "utility.h"
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Bounded lock-free queue of pointers between any number of producers
+ * and consumers, e.g. a perf buffer poller and a pool of resolvers.
+ * Pushing and popping are a CAS on the ring, runs of entries move with
+ * one. Consumers that find it empty spin a little, then sleep on a
+ * condition variable that producers only touch when someone sleeps.
+ */
+
+#define UNWIND_QUEUE__SIZE    1024
+#define UNWIND_QUEUE__SPIN    1024
+
+struct unwind_queue {
+    struct mpmc_ring *ring;
+    atomic_bool closed;
+
+    /* Parking, see unwind_queue__park(). */
+    cache_aligned(atomic_uint sleepers);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* @size entries, rounded up to a power of two, 0 for the default. */
+struct unwind_queue *unwind_queue__new(unsigned int size)
+{
+    struct unwind_queue *queue = xzalloc_aligned(alignof(*queue),
+                                                 sizeof(*queue));
+    pthread_condattr_t attr;
+
+    queue->ring = mpmc_ring__new(roundup_pow_of_two(size ? size :
+                                                    UNWIND_QUEUE__SIZE),
+                                 sizeof(void *));
+    atomic_init(&queue->closed, false);
+    atomic_init(&queue->sleepers, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return queue;
+}
+
+/* Whatever is still queued is not touched, the items are the caller's. */
+void unwind_queue__delete(struct unwind_queue *queue)
+{
+    if (!queue)
+        return;
+
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    mpmc_ring__delete(queue->ring);
+    free(queue);
+}
+
+static void unwind_queue__wake(struct unwind_queue *queue, unsigned int nr)
+{
+    /* Pairs with the fence in unwind_queue__park(). */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&queue->sleepers, memory_order_relaxed))
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    if (nr > 1)
+        pthread_cond_broadcast(&queue->cond);
+    else
+        pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Queue as many of the @n @items as fit, in order, and return how many
+ * that was. Never blocks, sleeping consumers are woken once per call.
+ */
+unsigned int unwind_queue__push_batch(struct unwind_queue *queue,
+                                      void *const *items, unsigned int n)
+{
+    unsigned int done = 0, nr, i;
+    u64 pos;
+
+    while (done < n) {
+        nr = mpmc_ring__reserve_n(queue->ring, n - done, &pos);
+        if (!nr)
+            break;
+        for (i = 0; i < nr; i++) {
+            void **slot = mpmc_ring__data(queue->ring, pos + i);
+
+            *slot = items[done + i];
+            mpmc_ring__commit(queue->ring, slot);
+        }
+        done += nr;
+    }
+
+    if (done)
+        unwind_queue__wake(queue, done);
+    return done;
+}
+
+/* 0, or -EAGAIN if the queue is full. */
+int unwind_queue__push(struct unwind_queue *queue, void *item)
+{
+    return unwind_queue__push_batch(queue, &item, 1) ? 0 : -EAGAIN;
+}
+
+static inline bool unwind_queue__idle(struct unwind_queue *queue)
+{
+    return !mpmc_ring__ready(queue->ring) &&
+           !atomic_load_explicit(&queue->closed, memory_order_relaxed);
+}
+
+/*
+ * Spin for a while before going to sleep, a producer in the middle of
+ * a burst refills the queue faster than a futex round trip. Returns
+ * -ETIMEDOUT once @deadline, if any, has passed.
+ */
+static int unwind_queue__park(struct unwind_queue *queue,
+                              const struct timespec *deadline)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < UNWIND_QUEUE__SPIN; i++) {
+        if (!unwind_queue__idle(queue))
+            return 0;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_fetch_add(&queue->sleepers, 1);
+    /*
+     * Either we see the entry that was just committed or the producer
+     * sees us asleep.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (unwind_queue__idle(queue)) {
+        if (deadline)
+            ret = -pthread_cond_timedwait(&queue->cond, &queue->lock,
+                                          deadline);
+        else
+            pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    atomic_fetch_sub(&queue->sleepers, 1);
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+/*
+ * Take up to @n of the oldest items into @items, waiting up to
+ * @timeout ms (< 0 for ever, 0 not at all) for the first one. Returns
+ * how many were taken, 0 on timeout or once the queue is closed and
+ * drained.
+ */
+unsigned int unwind_queue__pop_batch(struct unwind_queue *queue,
+                                     void **items, unsigned int n,
+                                     int timeout)
+{
+    struct timespec deadline;
+    unsigned int nr, i;
+    u64 pos;
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for (;;) {
+        nr = mpmc_ring__claim_n(queue->ring, n, &pos);
+        if (nr)
+            break;
+        if (!timeout || atomic_load(&queue->closed))
+            return 0;
+        if (unwind_queue__park(queue, timeout > 0 ? &deadline : NULL))
+            return 0;
+    }
+
+    for (i = 0; i < nr; i++) {
+        void **slot = mpmc_ring__data(queue->ring, pos + i);
+
+        items[i] = *slot;
+        mpmc_ring__release(queue->ring, slot);
+    }
+
+    return nr;
+}
+
+/* The oldest item, or NULL, see unwind_queue__pop_batch(). */
+void *unwind_queue__pop(struct unwind_queue *queue, int timeout)
+{
+    void *item;
+
+    return unwind_queue__pop_batch(queue, &item, 1, timeout) ? item : NULL;
+}
+
+/*
+ * Wake every consumer, they drain what is queued and then pop nothing
+ * instead of waiting. Call it after the last push has returned.
+ */
+void unwind_queue__close(struct unwind_queue *queue)
+{
+    atomic_store(&queue->closed, true);
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
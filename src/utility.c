@@ -3,8 +3,7 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <stdarg.h>
-
-bool singlethreaded = true;
+#include <string.h>
 
 void *xmalloc(size_t size)
 {
@@ -20,6 +19,24 @@ void *xcalloc(size_t nmemb, size_t size)
 	return ret;
 }
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+	assert(ret);
+	return ret;
+}
+
+void *xzalloc_aligned(size_t align, size_t size)
+{
+	void *ret;
+
+	if (posix_memalign(&ret, align, size))
+		ret = NULL;
+	assert(ret);
+	memset(ret, 0, size);
+	return ret;
+}
+
 static int vscnprintf(char *buf, size_t size, const char *fmt, va_list args) {
 	int i;
 
@@ -18,6 +18,8 @@
 
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *ptr, size_t size);
+void *xzalloc_aligned(size_t align, size_t size);
 
 #define swap(x, y) ({ typeof(x) __tmp = (x); (x) = (y); (y) = __tmp; })
 
@@ -27,6 +29,12 @@ void *xcalloc(size_t nmemb, size_t size);
 	(void) (&_min1 == &_min2);		\
 	_min1 < _min2 ? _min1 : _min2; })
 
+#define max(x, y) ({				\
+	typeof(x) _max1 = (x);			\
+	typeof(y) _max2 = (y);			\
+	(void) (&_max1 == &_max2);		\
+	_max1 > _max2 ? _max1 : _max2; })
+
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -68,8 +76,6 @@ void *xcalloc(size_t nmemb, size_t size);
 #define LIST_POISON1  ((void *) 0x100 + POISON_POINTER_DELTA)
 #define LIST_POISON2  ((void *) 0x200 + POISON_POINTER_DELTA)
 
-extern bool singlethreaded;
-
 #define PATH_MAX    4096
 
 static inline unsigned long long rdclock(void)
@@ -15,11 +15,6 @@ std::string BPF_PROGRAM = R"(
 
 #define STACK_SIZE    4096 * 2
 
-struct key_ {
-        u64 ts;
-        u64 id;
-};
-
 struct unwind_ctx {
         u64 ts;
         u32 tid;
@@ -32,19 +27,19 @@ struct unwind_ctx {
         char data[STACK_SIZE];
 };
 
-BPF_ARRAY(zero, struct unwind_ctx, 1);
-BPF_HASH(cache, struct key_, struct unwind_ctx);
+/* Per-CPU scratch record, see bpf/ebpf_get_unwind_ctx.c. */
+BPF_PERCPU_ARRAY(scratch, struct unwind_ctx, 1);
 
 BPF_PERF_OUTPUT(unwind_ctxs);
 static __inline int get_unwind_ctx(struct pt_regs *ctx)
 {
         struct pt_regs *user_regs = NULL;
         struct task_struct *task = NULL;
-        struct unwind_ctx *zuc = NULL;
         struct unwind_ctx *uc = NULL;
-        struct key_ k = {};
         void *sp = NULL;
         int ret = 0;
+        u32 size;
+        u64 id;
         int z = 0;
 
         task = (struct task_struct *)bpf_get_current_task();
@@ -62,20 +57,14 @@ static __inline int get_unwind_ctx(struct pt_regs *ctx)
         if (ret < 0)
                 return -1;
 
-        zuc = zero.lookup(&z);
-        if (!zuc)
-                return -1;
-
-        k.ts = bpf_ktime_get_ns();
-        k.id = bpf_get_current_pid_tgid();
-
-        uc = cache.lookup_or_init(&k, zuc);
+        uc = scratch.lookup(&z);
         if (!uc)
                 return -1;
 
-        uc->ts = k.ts;
-        uc->tgid = k.id >> 32;
-        uc->tid = k.id;
+        id = bpf_get_current_pid_tgid();
+        uc->ts = bpf_ktime_get_ns();
+        uc->tgid = id >> 32;
+        uc->tid = id;
         ret = bpf_probe_read(&uc->uregs, sizeof(uc->uregs), user_regs);
         if (ret < 0)
                 return -1;
@@ -88,9 +77,12 @@ static __inline int get_unwind_ctx(struct pt_regs *ctx)
         else
                 uc->size = STACK_SIZE - ret;
 
-        unwind_ctxs.perf_submit(ctx, uc, sizeof(*uc));
+        /* Cut short after the stack read, see bpf/unwind_ctx.h. */
+        size = __builtin_offsetof(struct unwind_ctx, data) + uc->size;
+        if (size > sizeof(*uc))
+                size = sizeof(*uc);
 
-        cache.delete(&k);
+        unwind_ctxs.perf_submit(ctx, uc, size);
 
         return 0;
 }
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "machine.h"
+#include "thread.h"
+
+/*
+ * Stress test of the thread table of a MACHINE_THREADING_CONCURRENT
+ * machine: workers find, borrow and remove random tids, far more of
+ * them than the buckets start with room for, so the tables grow under
+ * their feet. Afterwards every tid is looked up once and half of them
+ * removed, the table has to hold exactly what's left. Linked with
+ * --wrap for thread__new() and unwind__finish_access(), so that every
+ * thread created has to be freed by machine__delete().
+ */
+
+#define NR_WORKERS      8
+#define NR_TIDS         16384
+#define NR_OPS          200000
+
+static machine_t *machine;
+static u64 nr_created, nr_freed, nr_bad;
+
+struct thread *__real_thread__new(pid_t tgid, pid_t tid);
+void __real_unwind__finish_access(struct thread *thread);
+struct thread *__wrap_thread__new(pid_t tgid, pid_t tid);
+void __wrap_unwind__finish_access(struct thread *thread);
+
+struct thread *__wrap_thread__new(pid_t tgid, pid_t tid)
+{
+    __atomic_fetch_add(&nr_created, 1, __ATOMIC_RELAXED);
+    return __real_thread__new(tgid, tid);
+}
+
+/* Only ever called from thread__delete(). */
+void __wrap_unwind__finish_access(struct thread *thread)
+{
+    __atomic_fetch_add(&nr_freed, 1, __ATOMIC_RELAXED);
+    __real_unwind__finish_access(thread);
+}
+
+/* Four threads per process, the first one leads. */
+static pid_t tgid_of(pid_t tid)
+{
+    return (tid - 1) / 4 * 4 + 1;
+}
+
+static void check(struct thread *th, pid_t tid)
+{
+    if (!th || th->tid != tid || th->tgid != tgid_of(tid))
+        __atomic_fetch_add(&nr_bad, 1, __ATOMIC_RELAXED);
+}
+
+static void *worker(void *arg)
+{
+    unsigned int seed = (unsigned long)arg;
+    struct thread *th;
+    pid_t tid;
+    int i;
+
+    for (i = 0; i < NR_OPS; i++) {
+        tid = rand_r(&seed) % NR_TIDS + 1;
+
+        switch (rand_r(&seed) % 8) {
+        case 0:
+            machine__remove_thread(machine, tgid_of(tid), tid);
+            break;
+        case 1:
+            if (tid == tgid_of(tid) && rand_r(&seed) % 16 == 0)
+                machine__remove_process(machine, tid);
+            break;
+        case 2:
+        case 3:
+        case 4:
+            th = machine__findnew_thread(machine, tgid_of(tid), tid);
+            check(th, tid);
+            thread__put(th);
+            break;
+        default:
+            epoch__read_lock(&machine->epoch);
+            th = machine__borrow_thread(machine, tgid_of(tid), tid);
+            check(th, tid);
+            epoch__read_unlock(&machine->epoch);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned int machine__nr_threads(machine_t *machine)
+{
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < THREADS__TABLE_SIZE; i++)
+        nr += atomic_load(&machine->threads[i].nr);
+
+    return nr;
+}
+
+static int count_thread(struct thread *th, void *priv)
+{
+    (*(unsigned int *)priv)++;
+    return 0;
+}
+
+static bool check_nr(const char *what, unsigned int want)
+{
+    unsigned int nr = machine__nr_threads(machine), walked = 0;
+    bool ok;
+
+    machine__for_each_thread(machine, count_thread, &walked);
+    ok = nr == want && walked == want;
+    printf("%-10s %u threads, %u walked, want %u%s\n", what, nr, walked,
+           want, ok ? "" : ", FAIL");
+    return ok;
+}
+
+int main(void)
+{
+    struct machine_opts opts = {
+        .threading = MACHINE_THREADING_CONCURRENT,
+    };
+    pthread_t workers[NR_WORKERS];
+    struct thread *th;
+    bool ok = true;
+    pid_t tid;
+    long i;
+
+    machine = machine__new_opts(&opts);
+    if (!machine) {
+        fprintf(stderr, "machine__new_opts failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < NR_WORKERS; i++)
+        if (pthread_create(&workers[i], NULL, worker, (void *)(i + 1))) {
+            perror("pthread_create");
+            return 1;
+        }
+    for (i = 0; i < NR_WORKERS; i++)
+        pthread_join(workers[i], NULL);
+
+    for (tid = 1; tid <= NR_TIDS; tid++) {
+        th = machine__findnew_thread(machine, tgid_of(tid), tid);
+        check(th, tid);
+        thread__put(th);
+    }
+    ok &= check_nr("all", NR_TIDS);
+
+    /* Keep the leaders, the threads with an even tid never lead. */
+    for (tid = 2; tid <= NR_TIDS; tid += 2)
+        machine__remove_thread(machine, tgid_of(tid), tid);
+    ok &= check_nr("odd tids", NR_TIDS / 2);
+
+    machine__delete(machine);
+    printf("%llu threads created, %llu freed, %llu bad lookups\n",
+           (unsigned long long)nr_created, (unsigned long long)nr_freed,
+           (unsigned long long)nr_bad);
+
+    if (!ok || nr_bad || nr_created != nr_freed) {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+
+    return 0;
+}
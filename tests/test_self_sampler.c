@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <libdw_bpf.h>
+
+/*
+ * End to end run of the whole pipeline without privileges: the process
+ * samples itself while it spins in known functions, and the callchains
+ * of the samples that landed in spin_leaf() have to go back up through
+ * spin_middle() to main(). Linked with -rdynamic, so dladdr() names
+ * them. Prints throughput and latency, fails if too few samples came
+ * in or too many callchains are wrong.
+ */
+
+#define SPIN_CPU_NS      2000000000ULL
+#define MAX_SAMPLES      65536
+#define MIN_SAMPLES      50
+
+static u64 nr_samples, nr_failed, nr_frames, nr_leaf, nr_good;
+static u64 latency[MAX_SAMPLES];
+static volatile u64 sink;
+
+static u64 now(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int function_is(u64 ip, const char *name)
+{
+    Dl_info info;
+
+    return dladdr((void *)ip, &info) && info.dli_sname &&
+           !strcmp(info.dli_sname, name);
+}
+
+/* On the resolver thread. */
+static void sample(pid_t tgid, pid_t tid, u64 time, struct stacktrace *st,
+                   int ret, void *cookie)
+{
+    int i, middle = 0, top = 0;
+
+    if (nr_samples < MAX_SAMPLES)
+        latency[nr_samples] = now(CLOCK_MONOTONIC) - time;
+    nr_samples++;
+    if (ret) {
+        nr_failed++;
+        return;
+    }
+    nr_frames += st->depth;
+
+    if (!st->depth || !function_is(st->ips[0], "spin_leaf"))
+        return;
+    nr_leaf++;
+    for (i = 1; i < st->depth; i++) {
+        middle |= function_is(st->ips[i], "spin_middle");
+        top |= middle && function_is(st->ips[i], "main");
+    }
+    nr_good += top;
+}
+
+__attribute__ ((noinline)) void spin_leaf(u64 n)
+{
+    u64 i, x = sink;
+
+    for (i = 0; i < n; i++)
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    sink = x;
+}
+
+__attribute__ ((noinline)) void spin_middle(u64 cpu_ns)
+{
+    u64 end = now(CLOCK_PROCESS_CPUTIME_ID) + cpu_ns;
+
+    while (now(CLOCK_PROCESS_CPUTIME_ID) < end)
+        spin_leaf(1 << 20);
+    sink++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(void)
+{
+    struct self_sampler_opts opts = {
+        .sample_freq = 1000,
+        .callback = sample,
+    };
+    machine_t *machine = machine__new();
+    self_sampler_t *sampler;
+    u64 start, secs_ns, lost, nr;
+
+    sampler = self_sampler__new(machine, &opts);
+    if (!sampler) {
+        perror("self_sampler__new");
+        return 1;
+    }
+
+    start = now(CLOCK_MONOTONIC);
+    spin_middle(SPIN_CPU_NS);
+    lost = self_sampler__lost(sampler);
+    self_sampler__delete(sampler);
+    secs_ns = now(CLOCK_MONOTONIC) - start;
+    machine__delete(machine);
+
+    nr = nr_samples < MAX_SAMPLES ? nr_samples : MAX_SAMPLES;
+    qsort(latency, nr, sizeof(*latency), cmp_u64);
+    printf("%llu samples in %.2fs, %llu lost, %llu failed, "
+           "%.1f frames per callchain\n",
+           (unsigned long long)nr_samples, secs_ns / 1e9,
+           (unsigned long long)lost, (unsigned long long)nr_failed,
+           nr_samples ? (double)nr_frames / nr_samples : 0);
+    if (nr)
+        printf("latency p50 %lluus p99 %lluus max %lluus\n",
+               (unsigned long long)latency[nr / 2] / 1000,
+               (unsigned long long)latency[nr * 99 / 100] / 1000,
+               (unsigned long long)latency[nr - 1] / 1000);
+    printf("%llu/%llu samples in spin_leaf unwound to main\n",
+           (unsigned long long)nr_good, (unsigned long long)nr_leaf);
+
+    if (nr_samples < MIN_SAMPLES || nr_leaf < nr_samples / 2 ||
+        nr_good < nr_leaf * 9 / 10) {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+
+    return 0;
+}
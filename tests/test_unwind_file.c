@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libdw_bpf.h>
+
+/*
+ * Round trips records through an unwind_file without privileges: they
+ * are written with the maps of this process, closed, and replayed on
+ * one thread, on several, and from a copy that lost its tail the way
+ * a file does whose writer died. Every record has to come back whole,
+ * in order where that's promised, and exactly once. A record whose
+ * stack size runs past its end has to stop the replay.
+ */
+
+#define NR_RECORDS      2000
+#define NR_THREADS      4
+#define CHUNK_SIZE      (1U << 16)
+
+struct replay {
+    u64 nr;
+    u64 sum;           /* of the ts of the records seen */
+    u64 next;          /* ts the next record must have, 0 if any */
+    u64 bad;
+};
+
+static char path[] = "/tmp/test_unwind_file.XXXXXX";
+
+static int record_size(u64 ts)
+{
+    return ts * 37 % STACK_SIZE;
+}
+
+static void fill(struct unwind_ctx *uc, u64 ts)
+{
+    int i;
+
+    memset(uc, 0, sizeof(*uc));
+    uc->ts = ts;
+    uc->tgid = getpid();
+    uc->tid = uc->tgid + ts % 4;
+    snprintf(uc->name, sizeof(uc->name), "rec%llu", (unsigned long long)ts);
+    uc->size = record_size(ts);
+    for (i = 0; i < uc->size; i++)
+        uc->data[i] = ts + i * 7;
+}
+
+static bool record_ok(const struct unwind_ctx *uc, int size)
+{
+    char name[TASK_COMM_LEN];
+    int i;
+
+    if (size != (int)unwind_ctx__size(uc) || uc->size != record_size(uc->ts))
+        return false;
+    snprintf(name, sizeof(name), "rec%llu", (unsigned long long)uc->ts);
+    if (uc->tgid != (u32)getpid() || strcmp(uc->name, name))
+        return false;
+    for (i = 0; i < uc->size; i++)
+        if (uc->data[i] != (char)(uc->ts + i * 7))
+            return false;
+
+    return true;
+}
+
+/* On as many threads as are replaying. */
+static int replayed(struct unwind_ctx *uc, int size, void *cookie)
+{
+    struct replay *replay = cookie;
+
+    if (!record_ok(uc, size) || (replay->next && uc->ts != replay->next))
+        __atomic_fetch_add(&replay->bad, 1, __ATOMIC_RELAXED);
+    if (replay->next)
+        replay->next = uc->ts + 1;
+    __atomic_fetch_add(&replay->nr, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&replay->sum, uc->ts, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static off_t write_file(int level)
+{
+    struct unwind_file_opts opts = {
+        .chunk_size = CHUNK_SIZE,
+        .level = level,
+    };
+    struct unwind_ctx *uc = malloc(sizeof(*uc));
+    unwind_file_t *file;
+    struct stat st;
+    u64 ts;
+
+    file = unwind_file__create(path, &opts);
+    if (!file) {
+        perror("unwind_file__create");
+        exit(1);
+    }
+    for (ts = 1; ts <= NR_RECORDS; ts++) {
+        fill(uc, ts);
+        if (unwind_file__write(file, uc, unwind_ctx__size(uc))) {
+            fprintf(stderr, "unwind_file__write failed\n");
+            exit(1);
+        }
+    }
+    free(uc);
+    if (unwind_file__close(file) || stat(path, &st)) {
+        fprintf(stderr, "unwind_file__close failed\n");
+        exit(1);
+    }
+
+    return st.st_size;
+}
+
+/* Make the record named @name claim all of STACK_SIZE as its stack. */
+static int corrupt_file(const char *name)
+{
+    const int off = offsetof(struct unwind_ctx, size) -
+                    offsetof(struct unwind_ctx, name);
+    int size = STACK_SIZE, ret = -1;
+    struct stat st;
+    char *buf, *p;
+    FILE *fp;
+
+    if (stat(path, &st) || !(fp = fopen(path, "r+")))
+        return -1;
+    buf = malloc(st.st_size);
+    if (fread(buf, 1, st.st_size, fp) == (size_t)st.st_size) {
+        p = memmem(buf, st.st_size, name, strlen(name) + 1);
+        if (p && !fseek(fp, p - buf + off, SEEK_SET) &&
+            fwrite(&size, sizeof(size), 1, fp) == 1)
+            ret = 0;
+    }
+    free(buf);
+    fclose(fp);
+
+    return ret;
+}
+
+static int replay_file(struct replay *replay, unsigned int nr_threads)
+{
+    struct machine_opts opts = {
+        .threading = nr_threads ? MACHINE_THREADING_CONCURRENT
+                                : MACHINE_THREADING_SINGLE,
+    };
+    machine_t *machine = machine__new_opts(&opts);
+    unwind_file_t *file;
+    int ret;
+
+    memset(replay, 0, sizeof(*replay));
+    replay->next = nr_threads ? 0 : 1;
+
+    file = unwind_file__open(path);
+    if (!file) {
+        perror("unwind_file__open");
+        exit(1);
+    }
+    if (nr_threads)
+        ret = unwind_file__replay_parallel(file, machine, nr_threads,
+                                           replayed, replay);
+    else
+        ret = unwind_file__replay(file, machine, replayed, replay);
+    unwind_file__close(file);
+    machine__delete(machine);
+
+    return ret;
+}
+
+static bool check(const char *what, int ret, const struct replay *replay,
+                  u64 nr)
+{
+    bool ok = !ret && !replay->bad && replay->nr == nr &&
+              replay->sum == nr * (nr + 1) / 2;
+
+    printf("%-24s %llu/%llu records, %llu bad%s\n", what,
+           (unsigned long long)replay->nr, (unsigned long long)nr,
+           (unsigned long long)replay->bad, ok ? "" : ", FAIL");
+    return ok;
+}
+
+int main(void)
+{
+    struct replay replay;
+    off_t deflated, stored;
+    bool ok = true;
+    int fd, ret;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    deflated = write_file(0);
+    ret = replay_file(&replay, 0);
+    ok &= check("deflated", ret, &replay, NR_RECORDS);
+    ret = replay_file(&replay, NR_THREADS);
+    ok &= check("deflated, parallel", ret, &replay, NR_RECORDS);
+
+    stored = write_file(-1);
+    ret = replay_file(&replay, 0);
+    ok &= check("stored", ret, &replay, NR_RECORDS);
+    ret = replay_file(&replay, NR_THREADS);
+    ok &= check("stored, parallel", ret, &replay, NR_RECORDS);
+    if (deflated >= stored) {
+        printf("deflated file isn't smaller, %lld >= %lld, FAIL\n",
+               (long long)deflated, (long long)stored);
+        ok = false;
+    }
+
+    /*
+     * Without index and trailer, and cut in the middle of a chunk, the
+     * complete chunks before it still have to replay, as a prefix.
+     */
+    if (truncate(path, stored / 2)) {
+        perror("truncate");
+        return 1;
+    }
+    ret = replay_file(&replay, 0);
+    ok &= check("truncated", ret, &replay, replay.nr);
+    if (!replay.nr || replay.nr >= NR_RECORDS) {
+        printf("truncated file replayed %llu records, FAIL\n",
+               (unsigned long long)replay.nr);
+        ok = false;
+    }
+
+    /* A record claiming more stack than it carries must not get out. */
+    write_file(-1);
+    if (corrupt_file("rec1000")) {
+        perror("corrupt");
+        return 1;
+    }
+    ret = replay_file(&replay, 0);
+    if (ret != -EINVAL || replay.nr >= 1000) {
+        printf("corrupt record replayed with %d, FAIL\n", ret);
+        ok = false;
+    } else {
+        printf("%-24s rejected after %llu records\n", "corrupt",
+               (unsigned long long)replay.nr);
+    }
+
+    unlink(path);
+    if (!ok) {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+
+    return 0;
+}